@@ -0,0 +1,211 @@
+/**
+ * @file allocator.h
+ * @brief Pool and arena memory allocators
+ * @ingroup lowlevel
+ *
+ * This module implements two specialized allocators that sit on top of the
+ * standard heap, and that can be used in place of malloc/free for objects
+ * with a simple lifetime:
+ *
+ *  * A pool (#pool_t) hands out fixed-size elements. Allocation and release
+ *    are O(1), and freeing elements never fragments the heap because the
+ *    pool memory is only returned to the heap when the pool is closed. Pools
+ *    are a good fit for objects that are created and destroyed often, like
+ *    command blocks or sound voices.
+ *  * An arena (#arena_t) is a linear allocator over a fixed buffer. Allocation
+ *    just bumps a pointer, and all the allocations are released at once via
+ *    #arena_reset. Arenas are a good fit for data with a well defined lifetime,
+ *    for instance everything that is needed only for the current frame, or
+ *    while a level is loaded.
+ *
+ * Both allocators can be created in uncached mode (#ALLOC_UNCACHED): the memory
+ * is then allocated with #malloc_uncached, and all the returned pointers are
+ * in the uncached segment, so they follow the same rules of #malloc_uncached
+ * (they must never be accessed through the cache).
+ *
+ * @code{.c}
+ *      // Allocate an arena for frame-temporary data
+ *      arena_t frame_arena;
+ *      arena_init(&frame_arena, 64*1024, 0);
+ *
+ *      while (1) {
+ *          arena_reset(&frame_arena);
+ *          vertex_t *verts = arena_alloc(&frame_arena, sizeof(vertex_t) * nverts);
+ *          [...]
+ *      }
+ * @endcode
+ *
+ * Both allocators keep usage statistics (see #alloc_stats_t) that can be
+ * used to tune their size.
+ *
+ * @note Like the standard heap, these allocators must not be used from
+ *       interrupt handlers.
+ */
+#ifndef __LIBDRAGON_ALLOCATOR_H
+#define __LIBDRAGON_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Allocate the memory as uncached (see #malloc_uncached) */
+#define ALLOC_UNCACHED      (1<<0)
+
+/**
+ * @brief Usage statistics of an allocator
+ */
+typedef struct {
+    size_t capacity;        ///< Total memory reserved from the heap (bytes)
+    size_t used;            ///< Memory currently allocated (bytes)
+    size_t peak;            ///< Maximum value of used since the allocator was created
+    uint32_t num_allocs;    ///< Number of successful allocations
+    uint32_t num_failures;  ///< Number of failed allocations (out of memory)
+} alloc_stats_t;
+
+/** @brief A chunk of memory owned by a pool */
+typedef struct pool_chunk_s pool_chunk_t;
+
+/**
+ * @brief A pool allocator of fixed-size elements
+ *
+ * The contents of this structure are private and should not be accessed
+ * directly.
+ */
+typedef struct {
+    size_t elem_size;       ///< Size of each element (rounded up)
+    int chunk_elems;        ///< Number of elements allocated per chunk
+    int flags;              ///< Allocation flags (ALLOC_*)
+    void *free_list;        ///< Linked list of free elements
+    pool_chunk_t *chunks;   ///< Linked list of allocated chunks
+    alloc_stats_t stats;    ///< Usage statistics
+} pool_t;
+
+/**
+ * @brief A linear (bump) allocator over a fixed buffer
+ *
+ * The contents of this structure are private and should not be accessed
+ * directly.
+ */
+typedef struct {
+    uint8_t *base;          ///< Start of the buffer
+    uint8_t *cur;           ///< Current allocation pointer
+    uint8_t *end;           ///< End of the buffer
+    int flags;              ///< Allocation flags (ALLOC_*)
+    alloc_stats_t stats;    ///< Usage statistics
+} arena_t;
+
+/**
+ * @brief Initialize a pool of fixed-size elements
+ *
+ * The pool starts empty, and allocates memory from the heap in chunks of
+ * @p chunk_elems elements each time it runs out of free elements.
+ *
+ * Elements are aligned to 8 bytes (16 bytes for uncached pools, so that
+ * each element covers whole cachelines).
+ *
+ * @param[out] pool         Pool to initialize
+ * @param[in]  elem_size    Size of each element in bytes
+ * @param[in]  chunk_elems  Number of elements to allocate at a time
+ * @param[in]  flags        Allocation flags (eg: #ALLOC_UNCACHED)
+ */
+void pool_init(pool_t *pool, size_t elem_size, int chunk_elems, int flags);
+
+/**
+ * @brief Allocate an element from a pool
+ *
+ * @param[in]  pool         Pool to allocate from
+ * @return A pointer to the element (uninitialized), or NULL if the heap
+ *         is exhausted.
+ */
+void *pool_alloc(pool_t *pool);
+
+/**
+ * @brief Return an element to its pool
+ *
+ * @param[in]  pool         Pool the element was allocated from
+ * @param[in]  elem         Element to free (NULL is ignored)
+ */
+void pool_free(pool_t *pool, void *elem);
+
+/**
+ * @brief Release all the memory of a pool
+ *
+ * All the elements allocated from the pool become invalid.
+ *
+ * @param[in]  pool         Pool to close
+ */
+void pool_close(pool_t *pool);
+
+/**
+ * @brief Get the usage statistics of a pool
+ *
+ * @param[in]  pool         Pool to inspect
+ * @param[out] stats        Statistics
+ */
+void pool_get_stats(pool_t *pool, alloc_stats_t *stats);
+
+/**
+ * @brief Initialize an arena
+ *
+ * Reserves @p size bytes from the heap. Allocations from the arena will
+ * fail once this buffer is exhausted.
+ *
+ * @param[out] arena        Arena to initialize
+ * @param[in]  size         Size of the arena in bytes
+ * @param[in]  flags        Allocation flags (eg: #ALLOC_UNCACHED)
+ */
+void arena_init(arena_t *arena, size_t size, int flags);
+
+/**
+ * @brief Allocate memory from an arena, with a specific alignment
+ *
+ * @param[in]  arena        Arena to allocate from
+ * @param[in]  size         Number of bytes to allocate
+ * @param[in]  align        Alignment in bytes (must be a power of 2)
+ * @return A pointer to the allocated memory (uninitialized), or NULL if the
+ *         arena is full.
+ */
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t align);
+
+/**
+ * @brief Allocate memory from an arena
+ *
+ * The memory is aligned to 8 bytes (16 bytes for uncached arenas).
+ *
+ * @param[in]  arena        Arena to allocate from
+ * @param[in]  size         Number of bytes to allocate
+ * @return A pointer to the allocated memory (uninitialized), or NULL if the
+ *         arena is full.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * @brief Release all the allocations of an arena at once
+ *
+ * @param[in]  arena        Arena to reset
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * @brief Release the memory of an arena to the heap
+ *
+ * @param[in]  arena        Arena to close
+ */
+void arena_close(arena_t *arena);
+
+/**
+ * @brief Get the usage statistics of an arena
+ *
+ * @param[in]  arena        Arena to inspect
+ * @param[out] stats        Statistics
+ */
+void arena_get_stats(arena_t *arena, alloc_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -18,6 +18,14 @@
 /** @brief Special path value in #directory_entry::path defining the root sector */
 #define ROOT_PATH       "DragonFS 2.0"
 
+/**
+ * @brief File flag (in the top nibble of #directory_entry::flags) marking a compressed file
+ *
+ * The file is stored as a #compressed_header followed by the compressed chunks.
+ * The size in the flags is the uncompressed size of the file.
+ */
+#define FLAGS_COMPRESSED        0x4
+
 /** @brief The size of a sector */
 #define SECTOR_SIZE     256
 /** @brief The size of a sector payload */
@@ -32,7 +40,10 @@ struct directory_entry
     uint32_t flags;
     /** @brief The file or directory name */
     char path[MAX_FILENAME_LEN+1];
-    /** @brief Offset to start sector of the file */
+    /** @brief Offset to start sector of the file.
+     *
+     *  In the root sector, this is instead the offset of the path hash table
+     *  (see #path_hash_table), or 0 if the image was built without one. */
     uint32_t file_pointer;
 } __attribute__((__packed__));
 
@@ -41,6 +52,85 @@ _Static_assert(sizeof(struct directory_entry) == SECTOR_SIZE, "invalid directory
 /** @brief Type definition */
 typedef struct directory_entry directory_entry_t;
 
+/** @brief Magic value in #path_hash_table::magic ("DFH2") */
+#define PATH_HASH_MAGIC         0x44464832
+/** @brief Value of #path_hash_bucket::dirent for an unused bucket */
+#define PATH_HASH_EMPTY         0x00000000
+/** @brief Value of #path_hash_bucket::dirent when several paths share the same hash */
+#define PATH_HASH_AMBIGUOUS     0xFFFFFFFF
+/** @brief Initial value of a path hash (FNV-1a offset basis) */
+#define PATH_HASH_INIT          0x811C9DC5
+/** @brief Fold a character into a path hash (FNV-1a) */
+#define PATH_HASH_STEP(h, c)    (((h) ^ (uint8_t)(c)) * 0x01000193)
+/** @brief Initial value of the check hash of a path */
+#define PATH_CHECK_INIT         0x9E3779B9
+/** @brief Fold a character into the check hash of a path (rotate, xor, multiply) */
+#define PATH_CHECK_STEP(h, c)   (((((h) << 5) | ((h) >> 27)) ^ (uint8_t)(c)) * 0x85EBCA6B)
+
+/**
+ * @brief Bucket of the path hash table
+ *
+ * The hash is calculated over the canonical absolute path of the file,
+ * without the leading slash and with components separated by a single
+ * slash (eg: "sprites/hero.sprite").  A second, independent hash of the
+ * same path is stored to tell apart paths that are not in the image but
+ * share the hash of one that is.
+ */
+struct path_hash_bucket
+{
+    /** @brief Hash of the path */
+    uint32_t hash;
+    /** @brief Check hash of the path (see #PATH_CHECK_STEP) */
+    uint32_t check;
+    /** @brief Offset of the directory entry of the file, or #PATH_HASH_EMPTY / #PATH_HASH_AMBIGUOUS */
+    uint32_t dirent;
+} __attribute__((__packed__));
+
+/** @brief Type definition */
+typedef struct path_hash_bucket path_hash_bucket_t;
+
+/**
+ * @brief Header of the path hash table
+ *
+ * The table is an open-addressing hash table with linear probing, which
+ * allows to find the directory entry of a file by absolute path without
+ * walking the directory structure. Only files are indexed.
+ */
+struct path_hash_table
+{
+    /** @brief Magic value (#PATH_HASH_MAGIC) */
+    uint32_t magic;
+    /** @brief Number of buckets (always a power of two) */
+    uint32_t num_buckets;
+    /** @brief Buckets */
+    path_hash_bucket_t buckets[];
+} __attribute__((__packed__));
+
+/** @brief Type definition */
+typedef struct path_hash_table path_hash_table_t;
+
+/**
+ * @brief Header of a compressed file
+ *
+ * A compressed file is split into chunks of 1 << #chunk_log2 bytes (the last
+ * one can be shorter), each compressed independently with the LZ4 block format,
+ * so that seeking only requires to decompress a single chunk.  A chunk whose
+ * length equals its uncompressed length (rounded up to an even number of bytes)
+ * is stored uncompressed.  Chunks are padded so that they start at even offsets.
+ */
+struct compressed_header
+{
+    /** @brief log2 of the uncompressed size of a chunk */
+    uint32_t chunk_log2;
+    /** @brief Number of chunks */
+    uint32_t num_chunks;
+    /** @brief Offset of each chunk from the start of the header, plus the end of the last one */
+    uint32_t offsets[];
+} __attribute__((__packed__));
+
+/** @brief Type definition */
+typedef struct compressed_header compressed_header_t;
+
 /** @brief Open file handle structure */
 typedef struct open_file
 {
@@ -61,6 +151,26 @@ typedef struct open_file
     uint32_t loc;
     /** @brief The offset within the filesystem where the file is stored */
     uint32_t cart_start_loc;
+    /** @brief Buffer holding the current chunk of a compressed file, or NULL if not compressed */
+    uint8_t *chunk_data;
+    /** @brief Index of the chunk currently decompressed in #chunk_data */
+    uint32_t chunk_index;
+    /** @brief log2 of the size of a chunk of a compressed file */
+    uint32_t chunk_log2;
+    /** @brief Offsets of the chunks of a compressed file (see #compressed_header) */
+    uint32_t *chunk_offsets;
+    /** @brief Streaming window (two buffers of #stream_size bytes), or NULL if streaming is disabled */
+    uint8_t *stream_data;
+    /** @brief Size in bytes of each streaming buffer */
+    uint32_t stream_size;
+    /** @brief Offset within the file of the data in each streaming buffer, or 0xFFFFFFFF */
+    uint32_t stream_loc[2];
+    /** @brief Whether a prefetch into each streaming buffer is in flight */
+    volatile int stream_pending[2];
+    /** @brief Streaming statistics */
+    dfs_stream_stats_t stream_stats;
+    /** @brief Canonical path of the file while tracing is enabled (see #dfs_trace_enable), or NULL */
+    char *trace_path;
 } open_file_t;
 
 /** @} */ /* dfs */
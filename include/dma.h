@@ -7,6 +7,65 @@
 #define __LIBDRAGON_DMA_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/** @brief Maximum number of transfers pending in the PI queue */
+#define DMA_QUEUE_SIZE      32
+
+/**
+ * @brief Priority of a transfer in the PI queue
+ *
+ * Pending transfers of higher priority are started before the ones of lower
+ * priority.  Large transfers are split in chunks, so that a higher priority
+ * transfer does not need to wait for a bulk transfer to finish.
+ */
+typedef enum {
+    DMA_PRIORITY_HIGH = 0,      ///< Latency-sensitive transfers (eg: audio refills)
+    DMA_PRIORITY_NORMAL,        ///< Default priority
+    DMA_PRIORITY_LOW,           ///< Bulk transfers (eg: asset loading)
+} dma_priority_t;
+
+/**
+ * @brief Callback invoked when a queued transfer is complete
+ *
+ * It is called from within the PI interrupt handler, so it should be short.
+ * It can queue further transfers.
+ */
+typedef void (*dma_callback_t)(void *ctx);
+
+/**
+ * @brief Tags used to attribute PI bus usage (see #dma_stats_set_tag)
+ */
+typedef enum {
+    DMA_TAG_OTHER = 0,          ///< Accesses not tagged by anybody
+    DMA_TAG_DFS,                ///< DragonFS
+    DMA_TAG_AUDIO,              ///< Audio streaming
+    DMA_TAG_DEBUG,              ///< Debug output (USB, ISViewer)
+    DMA_TAG_USER0,              ///< Free for application use
+    DMA_TAG_USER1,              ///< Free for application use
+    DMA_TAG_USER2,              ///< Free for application use
+    DMA_TAG_USER3,              ///< Free for application use
+    DMA_NUM_TAGS
+} dma_tag_t;
+
+/**
+ * @brief PI bus usage statistics of a tag
+ */
+typedef struct {
+    uint32_t dma_transfers;     ///< Number of DMA transfers started
+    uint32_t io_accesses;       ///< Number of CPU accesses (#io_read, #io_write, ...)
+    uint32_t read_bytes;        ///< Bytes read from the PI bus
+    uint32_t write_bytes;       ///< Bytes written to the PI bus
+    uint32_t stall_ticks;       ///< CPU ticks spent waiting for the PI to become idle
+} dma_tag_stats_t;
+
+/**
+ * @brief Snapshot of the PI bus usage statistics (see #dma_stats_get)
+ */
+typedef struct {
+    uint32_t elapsed_ticks;                 ///< Ticks since the last #dma_stats_reset
+    dma_tag_stats_t tags[DMA_NUM_TAGS];     ///< Statistics of each tag
+} dma_stats_t;
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,9 +77,17 @@ void dma_write(const void * ram_address, unsigned long pi_address, unsigned long
 void dma_read_raw_async(void *ram_address, unsigned long pi_address, unsigned long len);
 void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len);
 void dma_read(void * ram_address, unsigned long pi_address, unsigned long len);
+void dma_read_any(void *ram_address, unsigned long pi_address, unsigned long len);
 
 void dma_wait(void);
 
+bool dma_queue_read(void *ram_address, unsigned long pi_address, unsigned long len,
+                    dma_priority_t priority, dma_callback_t cb, void *ctx);
+bool dma_queue_write(const void *ram_address, unsigned long pi_address, unsigned long len,
+                     dma_priority_t priority, dma_callback_t cb, void *ctx);
+void dma_queue_wait(void);
+void dma_queue_poll(void);
+
 /* 32 bit IO read from PI device */
 uint32_t io_read(uint32_t pi_address);
 
@@ -29,6 +96,24 @@ void io_write(uint32_t pi_address, uint32_t data);
 
 bool io_accessible(uint32_t pi_address);
 
+dma_tag_t dma_stats_set_tag(dma_tag_t tag);
+void dma_stats_get(dma_stats_t *stats);
+void dma_stats_reset(void);
+void dma_stats_dump(bool reset);
+
+/// @cond
+static inline void __dma_stats_tag_restore(dma_tag_t *prev) { dma_stats_set_tag(*prev); }
+/// @endcond
+
+/**
+ * @brief Charge the PI bus accesses until the end of the current block to a tag
+ *
+ * The previous tag is restored automatically when the block is exited.
+ */
+#define DMA_STATS_TAG_SCOPE(tag) \
+    __attribute__((cleanup(__dma_stats_tag_restore), unused)) \
+    dma_tag_t __dma_stats_prev_tag = dma_stats_set_tag(tag)
+
 __attribute__((deprecated("use dma_wait instead"))) 
 volatile int dma_busy(void);
 
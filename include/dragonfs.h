@@ -6,6 +6,10 @@
 #ifndef __LIBDRAGON_DRAGONFS_H
 #define __LIBDRAGON_DRAGONFS_H
 
+#include <stdbool.h>
+#include "surface.h"
+#include "fs_iovec.h"
+
 /** 
  * @addtogroup dfs
  * @{
@@ -20,9 +24,43 @@
 #define DFS_DEFAULT_LOCATION    0
 
 /**
- * @brief Maximum open files in DragonFS
+ * @brief Default maximum number of open files in DragonFS
+ *
+ * The table of open files grows on demand, so this only caps memory usage.
+ * Use #dfs_init_ex to change it.
+ */
+#define DFS_DEFAULT_MAX_OPEN_FILES  32
+
+/**
+ * @brief Highest maximum number of open files that can be configured
  */
-#define MAX_OPEN_FILES      4
+#define DFS_MAX_OPEN_FILES_LIMIT    4096
+
+/**
+ * @brief Maximum open files in DragonFS (kept for backward compatibility)
+ */
+#define MAX_OPEN_FILES      DFS_DEFAULT_MAX_OPEN_FILES
+
+/**
+ * @brief Maximum number of pending asynchronous reads
+ *
+ * See #dfs_read_async.
+ */
+#define DFS_MAX_ASYNC_READS 16
+
+/**
+ * @brief Default number of directory sectors cached in RDRAM
+ *
+ * See #dfs_set_sector_cache.
+ */
+#define DFS_DEFAULT_SECTOR_CACHE_SIZE   8
+
+/**
+ * @brief Default size of a streaming buffer
+ *
+ * See #dfs_stream_enable.
+ */
+#define DFS_DEFAULT_STREAM_WINDOW       8192
 
 /**
  * @brief Maximum filename length
@@ -76,6 +114,69 @@
 #define FLAGS_EOF           0x2
 /** @} */
 
+/**
+ * @brief Statistics of the directory sector cache
+ *
+ * See #dfs_get_cache_stats.
+ */
+typedef struct
+{
+    /** @brief Number of sector reads served from the cache */
+    uint32_t hits;
+    /** @brief Number of sector reads that required a DMA from ROM */
+    uint32_t misses;
+} dfs_cache_stats_t;
+
+/**
+ * @brief Statistics of a streaming file
+ *
+ * See #dfs_stream_get_stats.
+ */
+typedef struct
+{
+    /** @brief Number of reads served from a buffer that was already filled */
+    uint32_t hits;
+    /** @brief Number of reads that had to wait for a prefetch in flight */
+    uint32_t waits;
+    /** @brief Number of reads that required a blocking DMA (eg: after a seek) */
+    uint32_t misses;
+} dfs_stream_stats_t;
+
+/**
+ * @brief Location of the contents of a file in PI address space
+ *
+ * See #dfs_extent.
+ */
+typedef struct
+{
+    /** @brief PI address of the first byte of the file */
+    uint32_t pi_address;
+    /** @brief Size of the file in bytes */
+    uint32_t size;
+    /** @brief Alignment in bytes guaranteed for #pi_address (a power of two) */
+    uint32_t alignment;
+} dfs_extent_t;
+
+/**
+ * @brief Configuration of DragonFS (see #dfs_init_ex)
+ */
+typedef struct
+{
+    /** @brief Maximum number of files open at the same time (up to
+     *         #DFS_MAX_OPEN_FILES_LIMIT), or 0 for #DFS_DEFAULT_MAX_OPEN_FILES */
+    int max_open_files;
+} dfs_config_t;
+
+/**
+ * @brief Callback invoked when an asynchronous read is complete
+ *
+ * @param[in] len
+ *            Number of bytes read
+ * @param[in] ctx
+ *            Opaque pointer passed to #dfs_read_async
+ */
+typedef void (*dfs_read_cb_t)(int len, void *ctx);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -83,12 +184,25 @@ extern "C" {
 #endif
 
 int dfs_init(uint32_t base_fs_loc);
+int dfs_init_ex(uint32_t base_fs_loc, const dfs_config_t *config);
 int dfs_chdir(const char * const path);
 int dfs_dir_findfirst(const char * const path, char *buf);
 int dfs_dir_findnext(char *buf);
 
 int dfs_open(const char * const path);
 int dfs_read(void * const buf, int size, int count, uint32_t handle);
+int dfs_readv(uint32_t handle, fs_iovec_t *iov, int n);
+int dfs_read_async(uint32_t handle, void * const buf, int len, dfs_read_cb_t cb, void *ctx);
+int dfs_stream_enable(uint32_t handle, int window_size);
+int dfs_stream_get_stats(uint32_t handle, dfs_stream_stats_t *stats);
+void dfs_trace_enable(bool enable);
+
+int dfs_extent(uint32_t handle, dfs_extent_t *extent);
+int dfs_extent_read(const dfs_extent_t *extent, uint32_t offset, void *buf, uint32_t len);
+int dfs_extent_read_dmem(const dfs_extent_t *extent, uint32_t offset, uint32_t dmem_addr,
+                         uint32_t len, void *staging);
+int dfs_extent_read_surface(const dfs_extent_t *extent, uint32_t offset, surface_t *surface);
+
 int dfs_seek(uint32_t handle, int offset, int origin);
 int dfs_tell(uint32_t handle);
 int dfs_close(uint32_t handle);
@@ -96,6 +210,10 @@ int dfs_eof(uint32_t handle);
 int dfs_size(uint32_t handle);
 uint32_t dfs_rom_addr(const char *path);
 
+int dfs_set_sector_cache(int num_sectors);
+void dfs_get_cache_stats(dfs_cache_stats_t *stats);
+void dfs_reset_cache_stats(void);
+
 #ifdef __cplusplus
 }
 #endif
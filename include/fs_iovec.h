@@ -0,0 +1,32 @@
+/**
+ * @file fs_iovec.h
+ * @brief Scatter read ranges
+ * @ingroup system
+ */
+#ifndef __LIBDRAGON_FS_IOVEC_H
+#define __LIBDRAGON_FS_IOVEC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief A range of a file to read with #fs_readv
+ */
+typedef struct
+{
+    /** @brief Buffer to read into */
+    void *buf;
+    /** @brief Offset within the file of the first byte to read */
+    uint32_t offset;
+    /** @brief Number of bytes to read */
+    uint32_t len;
+} fs_iovec_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * @file heapprof.h
+ * @brief Heap profiler
+ * @ingroup lowlevel
+ *
+ * The heap profiler tracks all the allocations made through the standard
+ * heap functions (malloc, calloc, realloc, memalign, free), and thus also
+ * those made via #malloc_uncached and those made internally by the C library
+ * (eg: stdio buffers, strdup). It keeps track of the live and peak heap
+ * usage, and attributes allocations to the call sites that made them,
+ * so that it is possible to find out which subsystem owns the memory when
+ * the heap usage peaks.
+ *
+ * To use the profiler, the application must be linked with the heap functions
+ * wrapped. When using n64.mk, this is done by setting the N64_HEAP_PROFILE
+ * variable to 1 (eg: `make N64_HEAP_PROFILE=1`); using the profiler without
+ * the wrappers fails to link with undefined references to `__real__malloc_r`.
+ * Then, call #heapprof_init to start profiling, and #heapprof_dump to print
+ * a report on the debug channels (see #debug_init):
+ *
+ * @code{.c}
+ *      debug_init_isviewer();
+ *      heapprof_init(1);       // record the call site of every allocation
+ *
+ *      [...]
+ *
+ *      heapprof_dump();
+ * @endcode
+ *
+ * Attributing an allocation requires walking the stack, which is slow. To
+ * reduce the overhead, it is possible to sample only one allocation every
+ * N (see #heapprof_init). Global counters (live and peak bytes, number of
+ * allocations) are always exact, while per-site counters only include
+ * sampled allocations.
+ *
+ * The report is symbolized if the ROM contains a symbol table (see n64sym).
+ */
+#ifndef __LIBDRAGON_HEAPPROF_H
+#define __LIBDRAGON_HEAPPROF_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Maximum number of distinct call sites tracked by the profiler */
+#define HEAPPROF_MAX_SITES          256
+/** @brief Number of stack frames used to identify a call site */
+#define HEAPPROF_SITE_DEPTH         4
+
+/**
+ * @brief Global heap statistics collected by the profiler
+ */
+typedef struct {
+    uint32_t live_bytes;        ///< Bytes currently allocated (including those allocated before #heapprof_init)
+    uint32_t peak_bytes;        ///< Maximum value of live_bytes
+    uint32_t num_allocs;        ///< Number of allocations
+    uint32_t num_frees;         ///< Number of frees
+    uint32_t num_sampled;       ///< Number of allocations attributed to a call site
+    uint32_t num_dropped;       ///< Sampled allocations that could not be tracked (tables full)
+} heapprof_stats_t;
+
+/**
+ * @brief Start profiling the heap
+ *
+ * Only allocations made after this call are tracked. Calling this function
+ * again resets all the statistics.
+ *
+ * @param[in]  sample_rate  Attribute one allocation every @p sample_rate
+ *                          to its call site (1 = all allocations).
+ */
+void heapprof_init(int sample_rate);
+
+/**
+ * @brief Stop profiling the heap
+ */
+void heapprof_close(void);
+
+/**
+ * @brief Get the global heap statistics
+ *
+ * @param[out] stats        Statistics
+ */
+void heapprof_get_stats(heapprof_stats_t *stats);
+
+/**
+ * @brief Print a report of the heap usage on the debug channels
+ *
+ * The report lists the call sites sorted by the amount of memory they owned
+ * when the heap usage peaked, with their current live bytes.
+ */
+void heapprof_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,6 +6,8 @@
 #ifndef __LIBDRAGON_INTERRUPT_H
 #define __LIBDRAGON_INTERRUPT_H
 
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -90,6 +92,8 @@ void disable_interrupts();
 
 interrupt_state_t get_interrupts_state(); 
 
+bool in_interrupt_handler(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,6 +42,8 @@
 #include "graphics.h"
 #include "interrupt.h"
 #include "n64sys.h"
+#include "allocator.h"
+#include "heapprof.h"
 #include "backtrace.h"
 #include "rdp.h"
 #include "rsp.h"
@@ -102,7 +102,8 @@
  * primitive called "syncpoint" (#rspq_syncpoint_t). A syncpoint can be
  * created via #rspq_syncpoint_new and records the current writing position in the
  * queue. It is then possible to call #rspq_syncpoint_check to check whether
- * the RSP has reached that position, or #rspq_syncpoint_wait to wait for
+ * the RSP has reached that position, #rspq_syncpoint_callback to be notified
+ * asynchronously, or #rspq_syncpoint_wait to wait for
  * the RSP to reach that position.
  * 
  * Syncpoints are implemented using RSP interrupts, so their overhead is small
@@ -144,6 +145,7 @@
 
 #include <stdint.h>
 #include <rsp.h>
+#include <rspq_constants.h>
 #include <pputils.h>
 
 #ifdef __cplusplus
@@ -160,6 +162,9 @@ extern "C" {
  */
 #define RSPQ_MAX_SHORT_COMMAND_SIZE    16
 
+/** @brief Maximum number of 32-bit words that can be reserved at once with #rspq_reserve. */
+#define RSPQ_MAX_RESERVE_SIZE          (RSPQ_DRAM_HIGHPRI_BUFFER_SIZE - RSPQ_MAX_SHORT_COMMAND_SIZE)
+
 /**
  * @brief A preconstructed block of commands
  * 
@@ -225,8 +230,13 @@ void rspq_close(void);
  * 
  * The function returns the overlay ID, which is the ID to use to enqueue
  * commands for this overlay. The overlay ID must be passed to #rspq_write
- * when adding new commands. rspq allows up to 16 overlays to be registered
- * simultaneously, as the overlay ID occupies the top 4 bits of each command.
+ * when adding new commands. rspq allows up to 15 overlays to be registered
+ * simultaneously, as the overlay ID occupies the top 4 bits of each command
+ * (and ID 0 is reserved for internal commands). Overlays are swapped in and
+ * out of IMEM/DMEM on demand, when a command for an overlay that is not
+ * currently loaded is found: interleaving commands of different overlays
+ * is thus expensive (see the benchmark in test_rspq_overlay_pingpong), so
+ * it is better to batch commands of the same overlay together.
  * The lower 4 bits specify the command ID, so in theory each overlay could
  * offer a maximum of 16 commands. To overcome this limitation, this function 
  * will reserve multiple consecutive IDs in case an overlay with more than 16
@@ -276,6 +286,9 @@ void rspq_overlay_register_static(rsp_ucode_t *overlay_ucode, uint32_t overlay_i
  * 
  * Note that when new overlays are registered, the queue engine may recycle 
  * IDs from previously unregistered overlays.
+ * 
+ * This function waits for the RSP to run all the commands enqueued so far,
+ * so that none of them can refer to the overlay after it is unregistered.
  *             
  * @param      overlay_id  The ID of the ucode (as returned by
  *                         #rspq_overlay_register) to unregister.
@@ -509,6 +522,125 @@ inline void rspq_write_end(rspq_write_t *w) {
     w->pointer = 0;
 }
 
+/**
+ * @brief Reserve space in the RSP queue for writing multiple commands.
+ * 
+ * When enqueuing many small commands in a row, the check for the end of the
+ * current buffer done by #rspq_write for every command can become a sizable
+ * part of the cost. This function performs the check once for a whole batch
+ * of commands: it makes sure that there is space for @p size words, and
+ * returns a pointer to it. The commands can then be written with #rspq_put,
+ * which performs no check at all. Finally, call #rspq_reserve_end with the
+ * updated pointer to enqueue them:
+ * 
+ * @code{.c}
+ *      RSPQ_DECLARE_COMMAND(CMD_SET_LIGHT, 0x7, 2);
+ * 
+ *      volatile uint32_t *ptr = rspq_reserve(MAX_LIGHTS * CMD_SET_LIGHT_SIZE);
+ *      for (int i=0; i<MAX_LIGHTS; i++) {
+ *          rspq_put(ptr, gfx_overlay_id, CMD_SET_LIGHT, i,
+ *              (lights[i].r << 16) | (lights[i].g << 8) | lights[i].b);
+ *      }
+ *      rspq_reserve_end(ptr);
+ * @endcode
+ * 
+ * No other command must be enqueued between #rspq_reserve and
+ * #rspq_reserve_end, and at most @p size words must be written. As with
+ * #rspq_write, call #rspq_flush afterwards to make sure the RSP runs the
+ * commands.
+ * 
+ * @param      size      Number of 32-bit words to reserve (at most #RSPQ_MAX_RESERVE_SIZE)
+ * @returns              Pointer to the reserved space, to be used with #rspq_put
+ * 
+ * @see #rspq_put
+ * @see #rspq_reserve_end
+ */
+inline volatile uint32_t* rspq_reserve(int size) {
+    extern volatile uint32_t *rspq_cur_pointer, *rspq_cur_sentinel;
+    extern void rspq_reserve_next_buffer(int size);
+
+    if (__builtin_expect(rspq_cur_pointer > rspq_cur_sentinel - size, 0))
+        rspq_reserve_next_buffer(size);
+    return rspq_cur_pointer;
+}
+
+/**
+ * @brief Finish writing commands in the space reserved by #rspq_reserve.
+ * 
+ * @param       ptr     Pointer past the last written command (as updated by #rspq_put)
+ * 
+ * @see #rspq_reserve
+ */
+inline void rspq_reserve_end(volatile uint32_t *ptr) {
+    extern volatile uint32_t *rspq_cur_pointer;
+    rspq_cur_pointer = ptr;
+}
+
+/**
+ * @brief Declare a command of an overlay, for use with #rspq_put.
+ * 
+ * This defines two compile-time constants, `name_ID` and `name_SIZE`, with
+ * the command index and its size in 32-bit words. #rspq_put uses them to
+ * encode the command and to check at compile time that the number of
+ * arguments matches the size of the command.
+ * 
+ * @param      name      Name of the command
+ * @param      cmd_id    Index of the command within the overlay
+ * @param      size      Size of the command in 32-bit words (as declared in the
+ *                       overlay with RSPQ_DefineCommand, divided by 4)
+ * 
+ * @hideinitializer
+ */
+#define RSPQ_DECLARE_COMMAND(name, cmd_id, size) \
+    _Static_assert((size) >= 1 && (size) <= RSPQ_MAX_SHORT_COMMAND_SIZE, "invalid size for command " #name); \
+    enum { name##_ID = (cmd_id), name##_SIZE = (size) }
+
+/**
+ * @brief Write a command in the space reserved by #rspq_reserve.
+ * 
+ * This is the equivalent of #rspq_write for reserved space: the command must
+ * have been declared with #RSPQ_DECLARE_COMMAND, and the number of arguments
+ * must match its size. The command is written at @p ptr, which is then
+ * advanced past it. No check is done on the available space.
+ * 
+ * @param      ptr       Write pointer (returned by #rspq_reserve). It must be
+ *                       a variable, as it is updated.
+ * @param      ovl_id    The overlay ID of the command, as returned by
+ *                       #rspq_overlay_register.
+ * @param      cmd       Name of the command (see #RSPQ_DECLARE_COMMAND)
+ * @param      ...       Arguments for the command
+ * 
+ * @see #rspq_reserve
+ * @see #rspq_write
+ * 
+ * @hideinitializer
+ */
+#define rspq_put(ptr, ovl_id, cmd, ...) \
+    __PPCAT(_rspq_put, __HAS_VARARGS(__VA_ARGS__)) (ptr, ovl_id, cmd, ##__VA_ARGS__)
+
+/// @cond
+
+// Helpers used to implement rspq_put
+#define _rspq_put_arg(arg) \
+    *__rspq_arg++ = (arg);
+
+#define _rspq_put0(ptr, ovl_id, cmd) ({ \
+    _Static_assert(cmd##_SIZE == 1, "wrong number of arguments for command " #cmd); \
+    (ptr)[0] = (ovl_id) + ((cmd##_ID)<<24); \
+    (ptr) += 1; \
+})
+
+#define _rspq_put1(ptr, ovl_id, cmd, arg0, ...) ({ \
+    _Static_assert(cmd##_SIZE == 1 + __COUNT_VARARGS(__VA_ARGS__), "wrong number of arguments for command " #cmd); \
+    volatile uint32_t *__rspq_arg = (ptr)+1; \
+    (void)__rspq_arg; \
+    __CALL_FOREACH(_rspq_put_arg, ##__VA_ARGS__); \
+    (ptr)[0] = ((ovl_id) + ((cmd##_ID)<<24)) | (arg0); \
+    (ptr) += cmd##_SIZE; \
+})
+
+/// @endcond
+
 /**
  * @brief Make sure that RSP starts executing up to the last written command.
  * 
@@ -632,6 +764,44 @@ bool rspq_syncpoint_check(rspq_syncpoint_t sync_id);
  */
 void rspq_syncpoint_wait(rspq_syncpoint_t sync_id);
 
+/**
+ * @brief Register a callback to be called when a syncpoint is reached by RSP.
+ * 
+ * This is the non-blocking alternative to #rspq_syncpoint_wait: instead of
+ * spinning until the RSP has caught up, the CPU can keep working and the
+ * callback is invoked by the SP interrupt handler as soon as the syncpoint
+ * is reached. This is useful to recycle buffers or free memory once the
+ * RSP has finished consuming it:
+ * 
+ * @code{.c}
+ *      static void buffer_done(void *ctx) {
+ *          mybuffer_t *buf = ctx;
+ *          buf->busy = false;     // the buffer can be reused by the CPU
+ *      }
+ * 
+ *      buf->busy = true;
+ *      rspq_write(ovl_id, CMD_PROCESS, PhysicalAddr(buf->data));
+ *      rspq_syncpoint_callback(rspq_syncpoint_new(), buffer_done, buf);
+ * @endcode
+ * 
+ * If the syncpoint was already reached at the moment of the call, the callback
+ * is invoked immediately. Otherwise, the queue is flushed to make sure the
+ * RSP will eventually reach it. Callbacks registered for the same syncpoint
+ * are called in registration order.
+ * 
+ * Since the callback runs in interrupt context, it must be short and it must
+ * not write commands to the queue, wait for the RSP, or use the heap. At most
+ * #RSPQ_MAX_SYNCPOINT_CALLBACKS callbacks can be pending at the same time.
+ * Pending callbacks are discarded by #rspq_close.
+ * 
+ * @param[in]  sync_id  ID of the syncpoint to wait for
+ * @param[in]  cb       Function to call when the syncpoint is reached
+ * @param[in]  ctx      Argument passed to the callback
+ * 
+ * @see #rspq_syncpoint_t
+ */
+void rspq_syncpoint_callback(rspq_syncpoint_t sync_id, void (*cb)(void *ctx), void *ctx);
+
 
 /**
  * @brief Begin creating a new block.
@@ -682,6 +852,9 @@ rspq_block_t* rspq_block_end(void);
  * creation of a second block B; this means that B will contain the special
  * command that will call A.
  *
+ * Blocks can be run both in the normal and in the high-priority queue
+ * (see #rspq_highpri_begin).
+ *
  * @param block The block that must be run
  * 
  * @note The maximum depth of nested block calls is 8.
@@ -702,6 +875,28 @@ void rspq_block_run(rspq_block_t *block);
  */
 void rspq_block_free(rspq_block_t *block);
 
+/**
+ * @brief Compact a block into a single contiguous buffer
+ * 
+ * While a block is being created, its commands are written into a chain of
+ * buffers of growing size, linked by jumps. This function copies all the
+ * commands of the block into a single, tightly sized buffer, and frees the
+ * original storage. The finalized block is faster to fetch for the RSP and
+ * uses less memory.
+ * 
+ * Finalizing a block is optional, and is mostly useful for blocks that are
+ * kept alive for a long time.
+ * 
+ * @param  block  The block to finalize (as returned by #rspq_block_end)
+ * @return The finalized block, that replaces the original one. The original
+ *         block is freed and must not be used anymore.
+ * 
+ * @note The same restrictions of #rspq_block_free apply to the original
+ *       block: it must not be referenced by other blocks, and it must not
+ *       be pending execution in the queue.
+ */
+rspq_block_t* rspq_block_finalize(rspq_block_t *block);
+
 /**
  * @brief Start building a high-priority queue.
  * 
@@ -734,8 +929,9 @@ void rspq_block_free(rspq_block_t *block);
  * @note It is not possible to create a block while the high-priority queue is
  *       active. Arrange for constructing blocks beforehand.
  *       
- * @note It is currently not possible to call a block from the
- *       high-priority queue. (FIXME: to be implemented)
+ * @note Blocks prepared beforehand can be called from the high-priority
+ *       queue via #rspq_block_run. This is the cheapest way to enqueue
+ *       a latency-sensitive sequence of commands that is run repeatedly.
  *       
  */
 void rspq_highpri_begin(void);
@@ -826,6 +1022,173 @@ void rspq_dma_to_rdram(void *rdram_addr, uint32_t dmem_addr, uint32_t len, bool
  */
 void rspq_dma_to_dmem(uint32_t dmem_addr, void *rdram_addr, uint32_t len, bool is_async);
 
+/**
+ * @brief Profiling data for a single command ID (see #rspq_profile_get)
+ */
+typedef struct {
+    uint64_t cycles;            ///< RCP cycles spent in the command (including overlay loading)
+    uint32_t count;             ///< Number of times the command was run
+} rspq_profile_slot_t;
+
+/**
+ * @brief Profiling data of the RSP queue (see #rspq_profile_get)
+ */
+typedef struct {
+    uint64_t total_cycles;                          ///< Sum of the cycles of all the commands
+    rspq_profile_slot_t commands[RSPQ_PROFILE_SLOTS];   ///< Data for each command ID (indexed by command ID)
+} rspq_profile_data_t;
+
+/**
+ * @brief Fetch the RSP profiling data accumulated so far
+ * 
+ * When the RSP queue engine is built with RSPQ_PROFILE set to 1 (see
+ * rspq_constants.h), the RSP measures the time spent by each command, using
+ * the RCP clock counter, and accumulates it in DMEM together with the number
+ * of calls. This function fetches the data (waiting for the RSP to process
+ * all the pending commands) and returns the totals since the last
+ * #rspq_profile_reset.
+ * 
+ * The time spent by the RSP waiting for new commands is accounted to the
+ * internal command 0x00, as that is the command that idles the RSP (the
+ * clock counter is 24-bit, so idle periods longer than 2^24 cycles are not
+ * measured correctly). As the
+ * counters in DMEM are 16-bit, fetch the data at least every 65535 calls of
+ * the same command (eg: once per frame).
+ * 
+ * @param[out] data     Profiling data
+ */
+void rspq_profile_get(rspq_profile_data_t *data);
+
+/**
+ * @brief Reset the RSP profiling data
+ */
+void rspq_profile_reset(void);
+
+/**
+ * @brief Print the RSP profiling data on the debug channels
+ * 
+ * Commands are listed together with the name of the overlay they belong to,
+ * sorted by the total number of cycles.
+ */
+void rspq_profile_dump(void);
+
+/**
+ * @brief Latency statistics of the highpri queue (see #rspq_highpri_stats_get)
+ * 
+ * The histograms have logarithmic buckets: bucket 0 counts latencies below
+ * 1 us, bucket i counts latencies in the range [2^(i-1), 2^i) us, and the
+ * last bucket also counts all the longer latencies.
+ */
+typedef struct {
+    uint32_t count;                 ///< Number of measured highpri submissions
+    uint32_t merged;                ///< Submissions appended to a previous one that was still pending
+    uint32_t start_max_us;          ///< Maximum time until the RSP started running highpri (us)
+    uint32_t complete_max_us;       ///< Maximum time until the RSP finished running highpri (us)
+    uint64_t start_total_us;        ///< Sum of the times until the RSP started running highpri (us)
+    uint64_t complete_total_us;     ///< Sum of the times until the RSP finished running highpri (us)
+    uint32_t start_hist[RSPQ_HIGHPRI_HIST_BUCKETS];     ///< Histogram of the start latencies
+    uint32_t complete_hist[RSPQ_HIGHPRI_HIST_BUCKETS];  ///< Histogram of the completion latencies
+} rspq_highpri_stats_t;
+
+/**
+ * @brief Fetch the latency statistics of the highpri queue
+ * 
+ * Each highpri submission (#rspq_highpri_begin) is timed from the moment the
+ * CPU requests the RSP to switch to highpri mode, until the RSP actually
+ * starts running the highpri queue (start latency), and until the RSP goes
+ * back to the lowpri queue (completion latency). The start latency is
+ * dominated by the lowpri command that is running at the moment of the
+ * request, as the RSP can only switch between commands, so it can be used
+ * to tune the granularity of lowpri commands.
+ * 
+ * The RSP notifies both events via the SP interrupt, so the measurement has
+ * a small overhead, and includes the interrupt latency.
+ * 
+ * A submission started while the previous one is still pending is merged
+ * into it, and is only counted in the merged field.
+ * 
+ * @param[out] stats    Latency statistics since the last #rspq_highpri_stats_reset
+ */
+void rspq_highpri_stats_get(rspq_highpri_stats_t *stats);
+
+/**
+ * @brief Reset the latency statistics of the highpri queue
+ */
+void rspq_highpri_stats_reset(void);
+
+/**
+ * @brief Print the latency statistics of the highpri queue on the debug channels
+ */
+void rspq_highpri_stats_dump(void);
+
+/**
+ * @brief Start capturing the command stream
+ *
+ * While the capture is active, all the commands written to the RSP queue
+ * (lowpri, highpri and blocks), the creation of blocks and syncpoints, and
+ * the frame markers (see #rspq_capture_frame) are recorded in a ring buffer
+ * of the specified size. When the buffer is full, the oldest records are
+ * dropped. The capture can then be saved, and analyzed offline with the
+ * rspqdump tool, which reports command histograms, bytes per frame and
+ * redundant state changes:
+ *
+ * @code{.c}
+ *      rspq_capture_start(512*1024);
+ *      while (1) {
+ *          [...]
+ *          rspq_capture_frame();
+ *      }
+ *
+ *      // Save to SD (see #debug_init_sdfs)...
+ *      rspq_capture_save("sd:/rspq.cap");
+ *
+ *      // ...or send via USB
+ *      int size; void *img = rspq_capture_get_image(&size);
+ *      usb_write(DATATYPE_RAWBINARY, img, size);
+ *      free(img);
+ * @endcode
+ *
+ * Capturing has no cost when writing commands, but every time a buffer is
+ * switched the written commands are copied in the ring buffer.
+ * Calling this function again restarts the capture with an empty buffer.
+ *
+ * @param[in]  size     Size of the ring buffer in bytes (at least #RSPQ_CAPTURE_MIN_SIZE)
+ */
+void rspq_capture_start(int size);
+
+/**
+ * @brief Stop capturing the command stream, and release the ring buffer
+ */
+void rspq_capture_stop(void);
+
+/**
+ * @brief Mark the end of a frame in the command stream capture
+ *
+ * This is used to compute per-frame statistics. It does nothing if
+ * the capture is not active.
+ */
+void rspq_capture_frame(void);
+
+/**
+ * @brief Get the command stream captured so far, as a binary image
+ *
+ * The image contains the captured records, plus the command sizes and the
+ * names of the overlays currently registered, so that it can be decoded
+ * offline. The capture stays active.
+ *
+ * @param[out] size     Size of the image in bytes
+ * @return              The image (allocated with malloc, must be freed by the caller)
+ */
+void* rspq_capture_get_image(int *size);
+
+/**
+ * @brief Save the command stream captured so far to a file
+ *
+ * @param[in]  fn       Filename (eg: "sd:/rspq.cap", see #debug_init_sdfs)
+ * @return              True if the file was written successfully
+ */
+bool rspq_capture_save(const char *fn);
+
 #ifdef __cplusplus
 }
 #endif
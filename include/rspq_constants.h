@@ -3,6 +3,12 @@
 
 #define RSPQ_DEBUG                     1
 
+/** Enable per-command RSP cycle profiling (see #rspq_profile_get). This changes the
+ *  DMEM layout, so libdragon and all the overlays must be rebuilt. */
+#ifndef RSPQ_PROFILE
+#define RSPQ_PROFILE                   0
+#endif
+
 #define RSPQ_DRAM_LOWPRI_BUFFER_SIZE   0x200   ///< Size of each RSPQ RDRAM buffer for lowpri queue (in 32-bit words)
 #define RSPQ_DRAM_HIGHPRI_BUFFER_SIZE  0x80    ///< Size of each RSPQ RDRAM buffer for highpri queue (in 32-bit words)
 
@@ -10,19 +16,47 @@
 #define RSPQ_OVERLAY_TABLE_SIZE        0x10    ///< Number of overlay IDs (0-F)
 #define RSPQ_OVERLAY_DESC_SIZE         0x10    ///< Size of a single overlay descriptor
 
-/** Maximum number of overlays that can be registered (affects DMEM table size) */
-#define RSPQ_MAX_OVERLAY_COUNT         8
+/** Maximum number of overlays that can be registered, including the internal one. The descriptors
+ *  are kept in RDRAM, so this does not affect DMEM usage. Each overlay needs at least one ID. */
+#define RSPQ_MAX_OVERLAY_COUNT         16
 #define RSPQ_OVERLAY_ID_COUNT          16
-#define RSPQ_MAX_OVERLAY_COMMAND_COUNT ((RSPQ_MAX_OVERLAY_COUNT - 1) * 16)
+#define RSPQ_MAX_OVERLAY_COMMAND_COUNT ((RSPQ_OVERLAY_ID_COUNT - 1) * 16)
+
+/** Maximum number of callbacks waiting for a syncpoint (see #rspq_syncpoint_callback) */
+#define RSPQ_MAX_SYNCPOINT_CALLBACKS   32
 
 /** Minimum / maximum size of a block's chunk (contiguous memory buffer) */
 #define RSPQ_BLOCK_MIN_SIZE            64
 #define RSPQ_BLOCK_MAX_SIZE            4192
 
+/** Number of command IDs tracked by the profiler, and size of the profiling data in DMEM (in bytes) */
+#define RSPQ_PROFILE_SLOTS             256
+#define RSPQ_PROFILE_DMEM_SIZE         (RSPQ_PROFILE_SLOTS*6 + 8)
+
+/** Number of buckets of the highpri latency histograms (see #rspq_highpri_stats_get) */
+#define RSPQ_HIGHPRI_HIST_BUCKETS      16
+
+/** Command stream capture image (see #rspq_capture_start and tools/rspqdump). All fields are big-endian. */
+#define RSPQ_CAPTURE_MAGIC             "RSPQCAP1"
+#define RSPQ_CAPTURE_HEADER_SIZE       (8 + 4 + 4 + 256 + RSPQ_OVERLAY_ID_COUNT + RSPQ_OVERLAY_ID_COUNT*16)
+#define RSPQ_CAPTURE_FLAG_DROPPED      (1<<0)  ///< The ring buffer overflowed, and the oldest records were dropped
+#define RSPQ_CAPTURE_MIN_SIZE          (4*RSPQ_BLOCK_MAX_SIZE*4)  ///< Minimum size of the capture ring buffer (in bytes)
+
+/** Record types in the capture ring buffer. Each record starts with a word (type<<24 | payload words). */
+#define RSPQ_CAPTURE_REC_LOWPRI        1       ///< Words written in the lowpri queue
+#define RSPQ_CAPTURE_REC_HIGHPRI       2       ///< Words written in the highpri queue
+#define RSPQ_CAPTURE_REC_BLOCK         3       ///< Words written in the block being created
+#define RSPQ_CAPTURE_REC_BLOCK_BEGIN   4       ///< A block is being created
+#define RSPQ_CAPTURE_REC_BLOCK_END     5       ///< The block was created (payload: physical address of its commands)
+#define RSPQ_CAPTURE_REC_BLOCK_MOVE    6       ///< A block was moved (payload: old and new physical address)
+#define RSPQ_CAPTURE_REC_SYNCPOINT     7       ///< A syncpoint was created (payload: syncpoint ID)
+#define RSPQ_CAPTURE_REC_FRAME         8       ///< End of frame (payload: CPU ticks)
+
 /** Maximum number of nested block calls */
 #define RSPQ_MAX_BLOCK_NESTING_LEVEL   8
 #define RSPQ_LOWPRI_CALL_SLOT          (RSPQ_MAX_BLOCK_NESTING_LEVEL+0)  ///< Special slot used to store the current lowpri pointer
 #define RSPQ_HIGHPRI_CALL_SLOT         (RSPQ_MAX_BLOCK_NESTING_LEVEL+1)  ///< Special slot used to store the current highpri pointer
+#define RSPQ_HIGHPRI_CALL_BASE         (RSPQ_MAX_BLOCK_NESTING_LEVEL+2)  ///< First slot of the nesting levels used by blocks called in highpri mode
 
 /** Signal used by RSP to notify that a syncpoint was reached */
 #define SP_STATUS_SIG_SYNCPOINT                SP_STATUS_SIG2
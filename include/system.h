@@ -20,8 +20,10 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <dir.h>
 #include <sys/stat.h>
+#include "fs_iovec.h"
 
 /**
  * @brief Filesystem hook structure
@@ -136,6 +138,24 @@ typedef struct
      * @return 0 on successful lookup or a negative value on failure or empty directory.
      */
     int (*findnext)( dir_t *dir );
+    /** 
+     * @brief Function to call when performing a vectored read operation
+     *
+     * Read multiple ranges of a file, at the offsets specified in each
+     * range, without changing the current position.  Filesystems that can
+     * batch the transfers should provide this; otherwise, #fs_readv falls
+     * back to seeking and reading each range.
+     *
+     * @param[in] file
+     *            Arbitrary file handle returned by #filesystem_t::open
+     * @param[in] iov
+     *            Array of ranges to read
+     * @param[in] iovcnt
+     *            Number of ranges in iov
+     *
+     * @return The total number of bytes read or a negative value on failure.
+     */
+    int (*readv)( void *file, fs_iovec_t *iov, int iovcnt );
 } filesystem_t;
 
 /**
@@ -185,6 +205,8 @@ typedef struct
 int attach_filesystem( const char * const prefix, filesystem_t *filesystem );
 int detach_filesystem( const char * const prefix );
 
+int fs_readv( int file, fs_iovec_t *iov, int iovcnt );
+
 int hook_stdio_calls( stdio_t *stdio_calls );
 int unhook_stdio_calls( stdio_t *stdio_calls );
 
@@ -0,0 +1,184 @@
+/**
+ * @file allocator.c
+ * @brief Pool and arena memory allocators
+ * @ingroup lowlevel
+ */
+#include <stdlib.h>
+#include <malloc.h>
+#include "allocator.h"
+#include "n64sys.h"
+#include "debug.h"
+#include "utils.h"
+
+/** @brief Header of a chunk of memory owned by a pool */
+struct pool_chunk_s {
+    pool_chunk_t *next;     ///< Next chunk in the pool
+};
+
+/** @brief Size reserved for the chunk header (keeps elements aligned) */
+#define POOL_CHUNK_HEADER   16
+
+/** @brief Alignment of allocations from cached and uncached allocators */
+#define ALLOC_ALIGN(flags)  (((flags) & ALLOC_UNCACHED) ? 16 : 8)
+
+/** @brief Allocate a raw buffer from the heap, honoring the allocation flags */
+static void *alloc_raw(size_t size, int flags)
+{
+    if (flags & ALLOC_UNCACHED)
+        return malloc_uncached(size);
+    return memalign(8, size);
+}
+
+/** @brief Free a buffer allocated by #alloc_raw */
+static void free_raw(void *buf, int flags)
+{
+    if (flags & ALLOC_UNCACHED)
+        free_uncached(buf);
+    else
+        free(buf);
+}
+
+/** @brief Account a successful allocation of the given size */
+static inline void stats_alloc(alloc_stats_t *stats, size_t size)
+{
+    stats->used += size;
+    stats->num_allocs++;
+    if (stats->used > stats->peak)
+        stats->peak = stats->used;
+}
+
+void pool_init(pool_t *pool, size_t elem_size, int chunk_elems, int flags)
+{
+    assertf(chunk_elems > 0, "invalid number of elements per chunk: %d", chunk_elems);
+
+    // Elements must at least be able to hold the free list link
+    if (elem_size < sizeof(void*))
+        elem_size = sizeof(void*);
+
+    pool->elem_size = ROUND_UP(elem_size, ALLOC_ALIGN(flags));
+    pool->chunk_elems = chunk_elems;
+    pool->flags = flags;
+    pool->free_list = NULL;
+    pool->chunks = NULL;
+    pool->stats = (alloc_stats_t){0};
+}
+
+/** @brief Allocate a new chunk and add its elements to the free list */
+static bool pool_grow(pool_t *pool)
+{
+    size_t size = POOL_CHUNK_HEADER + pool->elem_size * pool->chunk_elems;
+    pool_chunk_t *chunk = alloc_raw(size, pool->flags);
+    if (!chunk)
+        return false;
+
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->stats.capacity += size;
+
+    // Thread the new elements into the free list, in address order
+    uint8_t *elem = (uint8_t*)chunk + POOL_CHUNK_HEADER;
+    for (int i = 0; i < pool->chunk_elems; i++) {
+        void **next = (void**)(elem + i * pool->elem_size);
+        *next = (i == pool->chunk_elems-1) ? pool->free_list : elem + (i+1) * pool->elem_size;
+    }
+    pool->free_list = elem;
+    return true;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    if (!pool->free_list && !pool_grow(pool)) {
+        pool->stats.num_failures++;
+        return NULL;
+    }
+
+    void **elem = pool->free_list;
+    pool->free_list = *elem;
+    stats_alloc(&pool->stats, pool->elem_size);
+    return elem;
+}
+
+void pool_free(pool_t *pool, void *elem)
+{
+    if (!elem) return;
+    assertf(pool->stats.used >= pool->elem_size, "pool_free: too many elements freed");
+
+    *(void**)elem = pool->free_list;
+    pool->free_list = elem;
+    pool->stats.used -= pool->elem_size;
+}
+
+void pool_close(pool_t *pool)
+{
+    pool_chunk_t *chunk = pool->chunks;
+    while (chunk) {
+        pool_chunk_t *next = chunk->next;
+        free_raw(chunk, pool->flags);
+        chunk = next;
+    }
+
+    pool->chunks = NULL;
+    pool->free_list = NULL;
+    pool->stats.capacity = 0;
+    pool->stats.used = 0;
+}
+
+void pool_get_stats(pool_t *pool, alloc_stats_t *stats)
+{
+    *stats = pool->stats;
+}
+
+void arena_init(arena_t *arena, size_t size, int flags)
+{
+    size = ROUND_UP(size, ALLOC_ALIGN(flags));
+    arena->base = alloc_raw(size, flags);
+    assertf(arena->base, "arena_init: out of memory (%d bytes)", (int)size);
+    arena->cur = arena->base;
+    arena->end = arena->base + size;
+    arena->flags = flags;
+    arena->stats = (alloc_stats_t){0};
+    arena->stats.capacity = size;
+}
+
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t align)
+{
+    assertf((align & (align-1)) == 0, "invalid alignment: %d", (int)align);
+
+    uint8_t *ptr = (uint8_t*)ROUND_UP((uint32_t)arena->cur, align);
+    if (ptr > arena->end || size > arena->end - ptr) {
+        arena->stats.num_failures++;
+        return NULL;
+    }
+
+    // Padding introduced by the alignment counts as used memory
+    stats_alloc(&arena->stats, ptr + size - arena->cur);
+    arena->cur = ptr + size;
+    return ptr;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    // Keep the allocation pointer aligned, so that allocations of the default
+    // alignment never waste space in padding.
+    int align = ALLOC_ALIGN(arena->flags);
+    return arena_alloc_aligned(arena, ROUND_UP(size, align), align);
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena->cur = arena->base;
+    arena->stats.used = 0;
+}
+
+void arena_close(arena_t *arena)
+{
+    free_raw(arena->base, arena->flags);
+    arena->base = arena->cur = arena->end = NULL;
+    arena->stats.capacity = 0;
+    arena->stats.used = 0;
+}
+
+void arena_get_stats(arena_t *arena, alloc_stats_t *stats)
+{
+    *stats = arena->stats;
+}
@@ -10,6 +10,7 @@
 #include "dragonfs.h"
 #include "n64sys.h"
 #include "dma.h"
+#include "interrupt.h"
 #include "samplebuffer.h"
 #include "debug.h"
 #include <stdbool.h>
@@ -24,17 +25,34 @@
 /** @brief Profile of DMA usage by WAV64, used for debugging purposes. */
 int64_t __wav64_profile_dma = 0;
 
+/** @brief Completion callback of the PI queue for waveform reads */
+static void waveform_dma_done(void *ctx) {
+	*(volatile bool*)ctx = true;
+}
+
 void raw_waveform_read(samplebuffer_t *sbuf, int base_rom_addr, int wpos, int wlen, int bps) {
 	uint32_t rom_addr = base_rom_addr + (wpos << bps);
 	uint8_t* ram_addr = (uint8_t*)samplebuffer_append(sbuf, wlen);
 	int bytes = wlen << bps;
+	DMA_STATS_TAG_SCOPE(DMA_TAG_AUDIO);
 
 	uint32_t t0 = TICKS_READ();
-	// Run the DMA transfer. We rely on libdragon's PI DMA function which works
-	// also for misaligned addresses and odd lengths.
-	// The mixer/samplebuffer guarantees that ROM/RAM addresses are always
-	// on the same 2-byte phase, as the only requirement of dma_read.
-	dma_read(ram_addr, rom_addr, bytes);
+	// Run the DMA transfer through the PI queue with high priority, so that
+	// it jumps ahead of bulk loads queued by the application. The queue
+	// is driven by the PI interrupt, so if interrupts are disabled, or
+	// we are being called from an interrupt handler (eg: the audio
+	// callback), fall back to a direct transfer.
+	// The sample buffer is uncached, so no cache maintenance is required.
+	volatile bool done = false;
+	if (get_interrupts_state() == INTERRUPTS_ENABLED && !in_interrupt_handler() &&
+		dma_queue_read(ram_addr, (rom_addr | 0x10000000) & 0x1FFFFFFF, bytes,
+			DMA_PRIORITY_HIGH, waveform_dma_done, (void*)&done)) {
+		while (!done) {}
+	} else {
+		// The mixer/samplebuffer guarantees that ROM/RAM addresses are always
+		// on the same 2-byte phase, as the only requirement of dma_read.
+		dma_read(ram_addr, rom_addr, bytes);
+	}
 	__wav64_profile_dma += TICKS_READ() - t0;
 }
 
@@ -102,6 +102,8 @@ static bool isviewer_init(void)
 
 static void isviewer_write(const uint8_t *data, int len)
 {
+	DMA_STATS_TAG_SCOPE(DMA_TAG_DEBUG);
+
 	while (len > 0)
 	{
 		uint32_t l = len < ISVIEWER_BUFFER_LEN ? len : ISVIEWER_BUFFER_LEN;
@@ -110,17 +112,20 @@ static void isviewer_write(const uint8_t *data, int len)
 		// we might overflow the input buffer if it's not a multiple
 		// of 4 bytes but it doesn't matter because we are going to
 		// write the exact number of bytes later.
+		// Go through io_write so that the writes do not collide with
+		// DMA transfers, and are accounted in the PI bus statistics.
 		for (int i=0; i < l; i+=4)
 		{
-			ISVIEWER_BUFFER[i/4] = ((uint32_t)data[0] << 24) |
-								   ((uint32_t)data[1] << 16) |
-								   ((uint32_t)data[2] <<  8) |
-								   ((uint32_t)data[3] <<  0);
+			io_write(PhysicalAddr(&ISVIEWER_BUFFER[i/4]),
+				((uint32_t)data[0] << 24) |
+				((uint32_t)data[1] << 16) |
+				((uint32_t)data[2] <<  8) |
+				((uint32_t)data[3] <<  0));
 			data += 4;
 		}
 
 		// Flush the data into the ISViewer
-		*ISVIEWER_WRITE_LEN = l;
+		io_write(PhysicalAddr(ISVIEWER_WRITE_LEN), l);
 		len -= l;
 	}
 }
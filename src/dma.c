@@ -4,11 +4,14 @@
  * @ingroup dma
  */
 #include <stdbool.h>
+#include <string.h>
 #include "n64types.h"
+#include "dma.h"
 #include "n64sys.h"
 #include "interrupt.h"
 #include "debug.h"
 #include "regsinternal.h"
+#include "timer.h"
 
 /**
  * @defgroup dma DMA Controller
@@ -41,8 +44,76 @@
 #define PI_STATUS_IO_BUSY  ( 1 << 1 )
 /** @brief PI Error */
 #define PI_STATUS_ERROR    ( 1 << 2 )
+/** @brief PI Clear Interrupt (write only) */
+#define PI_STATUS_CLR_INTR ( 1 << 1 )
 /** @} */
 
+/** @brief Statistics of PI bus usage, per tag */
+static dma_stats_t dma_stats;
+/** @brief Tag charged for the PI bus accesses being performed */
+static dma_tag_t dma_tag = DMA_TAG_OTHER;
+
+/** @brief Names of the tags, for #dma_stats_dump */
+static const char *dma_tag_names[DMA_NUM_TAGS] = {
+    "other", "dfs", "audio", "debug", "user0", "user1", "user2", "user3",
+};
+
+/** @brief Number of priority levels of the PI queue */
+#define DMA_PRIORITY_COUNT      3
+/** @brief Largest chunk transferred at once by the PI queue */
+#define DMA_QUEUE_CHUNK_SIZE    16384
+/** @brief Size of the bounce buffer used by the PI queue for misaligned reads */
+#define DMA_BOUNCE_SIZE         1024
+
+/** @brief A transfer in the PI queue */
+typedef struct dma_request_s
+{
+    /** @brief RDRAM address of the next byte to transfer */
+    uint8_t *ram;
+    /** @brief PI address of the next byte to transfer */
+    uint32_t pi;
+    /** @brief Number of bytes still to transfer */
+    uint32_t left;
+    /** @brief Whether this is a write (RDRAM to PI) */
+    bool write;
+    /** @brief Priority of the transfer */
+    dma_priority_t priority;
+    /** @brief Tag charged for the transfer in the statistics */
+    dma_tag_t tag;
+    /** @brief Completion callback */
+    dma_callback_t cb;
+    /** @brief Opaque context for the callback */
+    void *ctx;
+    /** @brief Next transfer of the same priority (or in the free list) */
+    struct dma_request_s *next;
+} dma_request_t;
+
+/** @brief Storage for the transfers in the PI queue */
+static dma_request_t dma_requests[DMA_QUEUE_SIZE];
+/** @brief List of unused transfer structures */
+static dma_request_t *dma_free = NULL;
+/** @brief First pending transfer of each priority */
+static dma_request_t *dma_queue_head[DMA_PRIORITY_COUNT];
+/** @brief Last pending transfer of each priority */
+static dma_request_t *dma_queue_tail[DMA_PRIORITY_COUNT];
+/** @brief Transfer whose chunk is in flight, or NULL if the PI queue is idle */
+static dma_request_t *dma_inflight = NULL;
+/** @brief Number of bytes of the chunk in flight */
+static uint32_t dma_inflight_len;
+/** @brief Offset of the first useful byte in the bounce buffer, or -1 if the chunk is not bounced */
+static int dma_inflight_skip;
+/** @brief Number of pending transfers */
+static volatile int dma_queue_count = 0;
+/** @brief Whether the PI queue was initialized */
+static bool dma_queue_initialized = false;
+/** @brief Bounce buffer for reads that cannot be done with a direct DMA */
+static uint8_t dma_bounce[DMA_BOUNCE_SIZE] __attribute__((aligned(16)));
+
+/** @brief Size of each of the scratch buffers used by #dma_read_any */
+#define DMA_SCRATCH_SIZE        4096
+/** @brief Double-buffered scratch area used by #dma_read_any to realign data */
+static uint8_t dma_scratch[2][DMA_SCRATCH_SIZE] __attribute__((aligned(16)));
+
 /** @brief Structure used to interact with the PI registers */
 static volatile struct PI_regs_s * const PI_regs = (struct PI_regs_s *)0xa4600000;
 
@@ -51,6 +122,16 @@ static volatile int __dma_busy(void)
     return PI_regs->status & (PI_STATUS_DMA_BUSY | PI_STATUS_IO_BUSY);
 }
 
+/**
+ * @brief Wait for the PI to be idle, accounting the stall in the statistics
+ */
+static void __dma_spin(void)
+{
+    uint32_t t0 = TICKS_READ();
+    while (__dma_busy()) {}
+    dma_stats.tags[dma_tag].stall_ticks += TICKS_READ() - t0;
+}
+
 /**
  * @brief Check whether the specified PI address can be accessed doing I/O from CPU
  * 
@@ -135,7 +216,7 @@ void dma_read_raw_async(void * ram_address, unsigned long pi_address, unsigned l
 
     disable_interrupts();
 
-    while (__dma_busy()) ;
+    __dma_spin();
     MEMORY_BARRIER();
     PI_regs->ram_address = ram_address;
     MEMORY_BARRIER();
@@ -144,6 +225,9 @@ void dma_read_raw_async(void * ram_address, unsigned long pi_address, unsigned l
     PI_regs->write_length = len-1;
     MEMORY_BARRIER();
 
+    dma_stats.tags[dma_tag].dma_transfers++;
+    dma_stats.tags[dma_tag].read_bytes += len;
+
     enable_interrupts();
 }
 
@@ -171,7 +255,7 @@ void dma_write_raw_async(const void * ram_address, unsigned long pi_address, uns
 
     disable_interrupts();
 
-    while (__dma_busy()) ;
+    __dma_spin();
     MEMORY_BARRIER();
     PI_regs->ram_address = (void*)ram_address;
     MEMORY_BARRIER();
@@ -180,6 +264,9 @@ void dma_write_raw_async(const void * ram_address, unsigned long pi_address, uns
     PI_regs->read_length = len-1;
     MEMORY_BARRIER();
 
+    dma_stats.tags[dma_tag].dma_transfers++;
+    dma_stats.tags[dma_tag].write_bytes += len;
+
     enable_interrupts();
 }
 
@@ -188,7 +275,9 @@ void dma_write_raw_async(const void * ram_address, unsigned long pi_address, uns
  * @note This function must be called with interrupts disabled.
  */
 static uint32_t __io_read32(void* pi_pointer) {
-    while (__dma_busy()) {}
+    __dma_spin();
+    dma_stats.tags[dma_tag].io_accesses++;
+    dma_stats.tags[dma_tag].read_bytes += 4;
     MEMORY_BARRIER();
     return *(volatile uint32_t*)pi_pointer;
 }
@@ -204,11 +293,13 @@ static uint32_t __io_read32u(void *pi_pointer) {
     // wait for #dma_busy inbetween. So we can't simply tell GCC to 
     // generate the LWL/LWR pair via __attribute__((aligned(1)), otherwise
     // we would only be able to wait once before both of them.
-    while (__dma_busy()) {}
+    __dma_spin();
     MEMORY_BARRIER();
     __asm volatile("lwl %0,0(%1)" : "+r"(val) : "r"(pi_pointer));    
 
-    while (__dma_busy()) {}
+    __dma_spin();
+    dma_stats.tags[dma_tag].io_accesses += 2;
+    dma_stats.tags[dma_tag].read_bytes += 4;
     MEMORY_BARRIER();
     __asm volatile("lwr %0,3(%1)" : "+r"(val) : "r"(pi_pointer));
 
@@ -228,7 +319,9 @@ static uint16_t __io_read16(void *pi_pointer) {
     if (pi_address & 2) {
         return (uint16_t)__io_read32((void*)(pi_address^2));
     } else {
-        while (__dma_busy()) {}
+        __dma_spin();
+        dma_stats.tags[dma_tag].io_accesses++;
+        dma_stats.tags[dma_tag].read_bytes += 2;
         MEMORY_BARRIER();
         return *(volatile uint16_t*)pi_pointer;
     }
@@ -365,7 +458,7 @@ void dma_read_async(void *ram_pointer, unsigned long pi_address, unsigned long l
  */
 void dma_wait(void)
 {
-    while (__dma_busy()) {}
+    __dma_spin();
 }
 
 
@@ -394,6 +487,443 @@ void dma_read(void *ram_address, unsigned long pi_address, unsigned long len)
     dma_wait();
 }
 
+/**
+ * @brief Start the next chunk of the highest priority pending transfer
+ *
+ * Reads whose RDRAM and PI addresses are suitably aligned DMA directly into the
+ * destination buffer. Otherwise, the first few bytes are read through the bounce
+ * buffer to align the RDRAM address; if the two addresses have a different 2-byte
+ * phase, the whole transfer goes through the bounce buffer.
+ *
+ * @note This function must be called with interrupts disabled.
+ */
+static void __dma_queue_start(void)
+{
+    dma_request_t *req = NULL;
+
+    for (int p = 0; p < DMA_PRIORITY_COUNT && !req; p++)
+        req = dma_queue_head[p];
+
+    dma_inflight = req;
+    if (!req)
+        return;
+
+    // Charge the transfer to the tag that queued it
+    dma_tag_t prev_tag = dma_stats_set_tag(req->tag);
+
+    // The PI might be busy with a transfer started by somebody else. Wait for
+    // it and acknowledge its interrupt, so that the next one is ours.
+    dma_wait();
+    PI_regs->status = PI_STATUS_CLR_INTR;
+
+    uint32_t ram = (uint32_t)req->ram;
+    uint32_t len = req->left;
+
+    if (req->write || ((ram & 7) == 0 && (req->pi & 1) == 0)) {
+        // Direct transfer. Odd lengths only work up to 0x7E bytes: leave
+        // the last byte of larger transfers to the bounce buffer.
+        if (len > DMA_QUEUE_CHUNK_SIZE)
+            len = DMA_QUEUE_CHUNK_SIZE;
+        else if ((len & 1) && len >= 0x7F)
+            len -= 1;
+
+        dma_inflight_len = len;
+        dma_inflight_skip = -1;
+        if (req->write)
+            dma_write_raw_async((void*)PhysicalAddr(req->ram), req->pi, len);
+        else
+            dma_read_raw_async((void*)PhysicalAddr(req->ram), req->pi, len);
+        dma_stats_set_tag(prev_tag);
+        return;
+    }
+
+    // Bounced transfer. If RDRAM and PI have the same 2-byte phase, just read
+    // enough to align RDRAM, so that the rest can be a direct transfer.
+    uint32_t max = ((ram ^ req->pi) & 1) ? DMA_BOUNCE_SIZE - 2 : 8 - (ram & 7);
+    if (len > max)
+        len = max;
+
+    uint32_t start = req->pi & ~1;
+    uint32_t end = (req->pi + len + 1) & ~1;
+
+    dma_inflight_len = len;
+    dma_inflight_skip = req->pi - start;
+    data_cache_hit_invalidate(dma_bounce, sizeof(dma_bounce));
+    dma_read_raw_async((void*)PhysicalAddr(dma_bounce), start, end - start);
+    dma_stats_set_tag(prev_tag);
+}
+
+/**
+ * @brief PI interrupt handler of the PI queue
+ *
+ * Called at the end of every PI DMA. Transfers are serialized by the PI and
+ * the interrupt is acknowledged right before starting each chunk, so when
+ * this runs and the PI is idle, the chunk in flight is complete.
+ */
+static void __dma_queue_interrupt(void)
+{
+    dma_request_t *req = dma_inflight;
+
+    if (!req || __dma_busy()) {
+        // Not ours
+        return;
+    }
+
+    if (dma_inflight_skip >= 0) {
+        memcpy(req->ram, dma_bounce + dma_inflight_skip, dma_inflight_len);
+        // The next chunk might be a direct DMA into the same cacheline
+        if (((uint32_t)req->ram & 0xE0000000) == 0x80000000)
+            data_cache_hit_writeback_invalidate(req->ram, dma_inflight_len);
+    }
+
+    req->ram += dma_inflight_len;
+    req->pi += dma_inflight_len;
+    req->left -= dma_inflight_len;
+
+    dma_callback_t cb = NULL;
+    void *ctx = NULL;
+
+    if (!req->left) {
+        // Retire the transfer before starting the next one and calling the
+        // callback, which might queue more transfers.
+        dma_queue_head[req->priority] = req->next;
+        cb = req->cb;
+        ctx = req->ctx;
+
+        req->next = dma_free;
+        dma_free = req;
+        dma_queue_count--;
+    }
+
+    // Keep the bus busy
+    __dma_queue_start();
+
+    if (cb)
+        cb(ctx);
+}
+
+/**
+ * @brief Queue a transfer in the PI queue
+ *
+ * @param[in] ram_address       RDRAM address
+ * @param[in] pi_address        PI address
+ * @param[in] len               Length in bytes
+ * @param[in] write             Whether the transfer is a write
+ * @param[in] priority          Priority of the transfer
+ * @param[in] cb                Completion callback (can be NULL)
+ * @param[in] ctx               Opaque context for the callback
+ *
+ * @return true if the transfer was queued, false if the queue is full
+ */
+static bool __dma_queue(void *ram_address, unsigned long pi_address, unsigned long len,
+                        bool write, dma_priority_t priority, dma_callback_t cb, void *ctx)
+{
+    assert(len > 0);
+    assert(priority >= 0 && priority < DMA_PRIORITY_COUNT);
+
+    disable_interrupts();
+
+    if (!dma_queue_initialized) {
+        for (int i = 0; i < DMA_QUEUE_SIZE; i++) {
+            dma_requests[i].next = dma_free;
+            dma_free = &dma_requests[i];
+        }
+        register_PI_handler(__dma_queue_interrupt);
+        set_PI_interrupt(1);
+        dma_queue_initialized = true;
+    }
+
+    dma_request_t *req = dma_free;
+    if (!req) {
+        enable_interrupts();
+        return false;
+    }
+    dma_free = req->next;
+
+    req->ram = ram_address;
+    req->pi = pi_address;
+    req->left = len;
+    req->write = write;
+    req->priority = priority;
+    req->tag = dma_tag;
+    req->cb = cb;
+    req->ctx = ctx;
+    req->next = NULL;
+
+    if (dma_queue_tail[priority] && dma_queue_head[priority])
+        dma_queue_tail[priority]->next = req;
+    else
+        dma_queue_head[priority] = req;
+    dma_queue_tail[priority] = req;
+    dma_queue_count++;
+
+    if (!dma_inflight)
+        __dma_queue_start();
+
+    enable_interrupts();
+    return true;
+}
+
+/**
+ * @brief Queue a read from a peripheral through PI DMA
+ *
+ * The transfer is added to a queue, and started by the PI interrupt handler as
+ * soon as the transfers queued before it (and the ones of higher priority)
+ * are complete, so the CPU never needs to wait for the PI.  Large transfers
+ * are split in chunks of 16 KiB, so that higher priority transfers can start
+ * in the middle of them.
+ *
+ * Any alignment of the RDRAM and PI addresses is supported.  When they are
+ * both aligned (8 bytes for RDRAM, 2 bytes for PI), or once the transfer gets
+ * aligned, the data is transferred directly into the buffer.  Otherwise, it
+ * goes through an internal bounce buffer and is copied by the CPU, which is
+ * slower.
+ *
+ * @note The buffer must not be in the CPU data cache when the read is queued:
+ *       call data_cache_hit_writeback_invalidate on it beforehand if needed.
+ *       Do not access the buffer until the callback is invoked.
+ * @note Transfers of the queue and direct transfers like #dma_read can be
+ *       mixed freely.  To wait for queued transfers, #dma_wait is not enough:
+ *       use #dma_queue_wait or a callback.
+ *
+ * @param[out] ram_address
+ *             Pointer to a buffer in RDRAM to place read data
+ * @param[in]  pi_address
+ *             Memory address of the peripheral to read from
+ * @param[in]  len
+ *             Length in bytes to read into ram_address
+ * @param[in]  priority
+ *             Priority of the transfer
+ * @param[in]  cb
+ *             Callback to invoke when the transfer is complete (can be NULL)
+ * @param[in]  ctx
+ *             Opaque pointer passed to the callback
+ *
+ * @return true if the transfer was queued, false if the queue is full
+ *         (see #DMA_QUEUE_SIZE).
+ */
+bool dma_queue_read(void *ram_address, unsigned long pi_address, unsigned long len,
+                    dma_priority_t priority, dma_callback_t cb, void *ctx)
+{
+    return __dma_queue(ram_address, pi_address, len, false, priority, cb, ctx);
+}
+
+/**
+ * @brief Queue a write to a peripheral through PI DMA
+ *
+ * This is the write counterpart of #dma_queue_read.  Writes are always done
+ * directly from the buffer, so they have the same alignment constraints of
+ * #dma_write_raw_async.
+ *
+ * @note The buffer must have been written back from the CPU data cache
+ *       (eg: with data_cache_hit_writeback) before queuing the write.
+ *
+ * @param[in] ram_address
+ *            Pointer to a buffer to read data from (must be 8-byte aligned)
+ * @param[in] pi_address
+ *            Memory address of the peripheral to write to (must be 2-byte aligned)
+ * @param[in] len
+ *            Length in bytes to write (must be multiple of 2)
+ * @param[in] priority
+ *            Priority of the transfer
+ * @param[in] cb
+ *            Callback to invoke when the transfer is complete (can be NULL)
+ * @param[in] ctx
+ *            Opaque pointer passed to the callback
+ *
+ * @return true if the transfer was queued, false if the queue is full
+ *         (see #DMA_QUEUE_SIZE).
+ */
+bool dma_queue_write(const void *ram_address, unsigned long pi_address, unsigned long len,
+                     dma_priority_t priority, dma_callback_t cb, void *ctx)
+{
+    assertf(((uint32_t)ram_address & 7) == 0 && (pi_address & 1) == 0 && (len & 1) == 0,
+        "misaligned queued write: %p -> %08lx (%lu bytes)", ram_address, pi_address, len);
+    return __dma_queue((void*)ram_address, pi_address, len, true, priority, cb, ctx);
+}
+
+/**
+ * @brief Wait until all the transfers in the PI queue are complete
+ *
+ * @note Interrupts must be enabled, as the queue is driven by the PI interrupt.
+ */
+void dma_queue_wait(void)
+{
+    while (dma_queue_count) {}
+}
+
+/**
+ * @brief Advance the PI queue without relying on the PI interrupt
+ *
+ * Wait for the PI to be idle, then do what the PI interrupt handler would
+ * do: retire the chunk in flight (calling the callback of the transfer if it
+ * is complete) and start the next one.  This allows to wait for queued
+ * transfers when interrupts are disabled or from an interrupt handler.
+ */
+void dma_queue_poll(void)
+{
+    dma_wait();
+    disable_interrupts();
+    __dma_queue_interrupt();
+    enable_interrupts();
+}
+
+/**
+ * @brief Copy memory between buffers with any relative alignment
+ *
+ * After aligning the destination, data is moved 8 bytes at a time, combining
+ * two aligned 64-bit loads from the source with shifts when the source is
+ * misaligned.  The source is read in whole aligned 64-bit words, so up to 7
+ * bytes past its end might be read.
+ *
+ * @param[out] dst      Destination buffer
+ * @param[in]  src      Source buffer
+ * @param[in]  len      Number of bytes to copy
+ */
+static void __memcpy_realign(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    while (len && ((uint32_t)dst & 7)) {
+        *dst++ = *src++;
+        len--;
+    }
+
+    uint64_t *d = (uint64_t*)dst;
+    uint32_t shift = ((uint32_t)src & 7) * 8;
+
+    if (!shift) {
+        const uint64_t *s = (const uint64_t*)src;
+        for (; len >= 8; len -= 8)
+            *d++ = *s++;
+        src = (const uint8_t*)s;
+    } else {
+        // Big-endian: the first bytes are in the upper bits of each word
+        const uint64_t *s = (const uint64_t*)((uint32_t)src & ~7);
+        uint64_t w0 = *s++;
+        for (; len >= 8; len -= 8) {
+            uint64_t w1 = *s++;
+            *d++ = (w0 << shift) | (w1 >> (64 - shift));
+            w0 = w1;
+        }
+        src = (const uint8_t*)s - 8 + shift / 8;
+    }
+
+    dst = (uint8_t*)d;
+    while (len--)
+        *dst++ = *src++;
+}
+
+/**
+ * @brief Read a few bytes through the scratch area, writing them uncached
+ *
+ * @param[out] ram          Destination (uncached writes)
+ * @param[in]  pi_address   PI address to read from
+ * @param[in]  len          Number of bytes (less than #DMA_SCRATCH_SIZE)
+ */
+static void __dma_read_scratch_uncached(uint8_t *ram, uint32_t pi_address, uint32_t len)
+{
+    uint32_t start = pi_address & ~1;
+    uint32_t end = (pi_address + len + 1) & ~1;
+
+    data_cache_hit_invalidate(dma_scratch[0], 16);
+    dma_read_raw_async((void*)PhysicalAddr(dma_scratch[0]), start, end - start);
+    dma_wait();
+
+    uint8_t *dst = UncachedAddr(ram);
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] = dma_scratch[0][pi_address - start + i];
+}
+
+/**
+ * @brief Read data from a peripheral through PI DMA, with any alignment
+ *
+ * This function reads data with any combination of RDRAM address, PI address
+ * and length, without the 2-byte phase constraint of #dma_read_async, and
+ * without CPU accesses to the PI bus (so it works on the full PI address range):
+ *
+ *   * If RDRAM and PI addresses have the same 2-byte phase, the bulk of the data
+ *     is transferred with a single DMA directly into the buffer; only the few
+ *     bytes at the start and at the end that break 8-byte alignment are read
+ *     via a small DMA into a scratch area.
+ *   * Otherwise, data is read in chunks into a double-buffered scratch area,
+ *     and realigned by the CPU with 64-bit shifts while the PI is reading the
+ *     next chunk, so the transfer runs close to full PI bandwidth.
+ *
+ * Contrary to #dma_read, this function also takes care of the data cache:
+ * there is no need to invalidate the buffer beforehand.  The function blocks
+ * until the read is complete.
+ *
+ * @note This function uses a static scratch area, so it must not be called
+ *       from interrupt handlers.
+ *
+ * @param[out] ram_address
+ *             Pointer to a buffer in RDRAM to place read data
+ * @param[in]  pi_address
+ *             Memory address of the peripheral to read from
+ * @param[in]  len
+ *             Length in bytes to read into ram_address
+ */
+void dma_read_any(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    uint8_t *ram = ram_address;
+
+    assertf(!in_interrupt_handler(), "dma_read_any cannot be called from an interrupt handler");
+    if (!len)
+        return;
+
+    if (((uint32_t)ram ^ pi_address) & 1) {
+        // Different phase: pipeline DMA into one scratch buffer with the
+        // realignment of the other. All chunks are even-sized, so the offset
+        // of the first byte within the scratch buffer is always the same.
+        const uint32_t chunk = DMA_SCRATCH_SIZE - 2;
+        const uint32_t skip = pi_address & 1;
+        uint32_t pi = pi_address & ~1;
+        int b = 0;
+
+        data_cache_hit_invalidate(dma_scratch[0], DMA_SCRATCH_SIZE);
+        uint32_t n = len < chunk ? len : chunk;
+        dma_read_raw_async((void*)PhysicalAddr(dma_scratch[0]), pi, (skip + n + 1) & ~1);
+
+        while (len) {
+            dma_wait();
+            pi += n;
+            len -= n;
+
+            uint32_t next = len < chunk ? len : chunk;
+            if (next) {
+                data_cache_hit_invalidate(dma_scratch[b^1], DMA_SCRATCH_SIZE);
+                dma_read_raw_async((void*)PhysicalAddr(dma_scratch[b^1]), pi, (skip + next + 1) & ~1);
+            }
+
+            __memcpy_realign(ram, dma_scratch[b] + skip, n);
+            ram += n;
+            n = next;
+            b ^= 1;
+        }
+        return;
+    }
+
+    // Same phase: read the unaligned head and tail through the scratch area,
+    // and DMA the 8-byte aligned body straight into the buffer. Head and tail
+    // are written uncached, as they share cachelines with the body.
+    uint32_t head = (8 - ((uint32_t)ram & 7)) & 7;
+    if (head > len)
+        head = len;
+    uint32_t body = (len - head) & ~7;
+    uint32_t tail = len - head - body;
+
+    if (((uint32_t)ram & 0xE0000000) == 0x80000000)
+        data_cache_hit_writeback_invalidate(ram, len);
+
+    if (body) {
+        dma_read_raw_async((void*)PhysicalAddr(ram + head), pi_address + head, body);
+        dma_wait();
+    }
+    if (head)
+        __dma_read_scratch_uncached(ram, pi_address, head);
+    if (tail)
+        __dma_read_scratch_uncached(ram + head + body, pi_address + head + body, tail);
+}
+
 /**
  * @brief Write to a peripheral
  *
@@ -466,12 +996,108 @@ void io_write(uint32_t pi_address, uint32_t data)
 
     disable_interrupts();
 
-    while (__dma_busy()) ;
+    __dma_spin();
     MEMORY_BARRIER();
     *uncached_address = data;
     MEMORY_BARRIER();
 
+    dma_stats.tags[dma_tag].io_accesses++;
+    dma_stats.tags[dma_tag].write_bytes += 4;
+
+    enable_interrupts();
+}
+
+/**
+ * @brief Set the tag charged for the following PI bus accesses
+ *
+ * PI bus usage statistics (see #dma_stats_get) are kept separately for each
+ * tag, so that it is possible to tell how much bus time goes to each
+ * subsystem.  Libdragon tags its own accesses (eg: DragonFS, audio streaming,
+ * debug output); applications can use the user tags for their own code.
+ * Transfers in the PI queue are charged to the tag that was active when
+ * they were queued.
+ *
+ * See also #DMA_STATS_TAG_SCOPE to set a tag for the rest of a block.
+ *
+ * @param[in] tag       Tag to charge
+ * @return The previous tag
+ */
+dma_tag_t dma_stats_set_tag(dma_tag_t tag)
+{
+    assert(tag >= 0 && tag < DMA_NUM_TAGS);
+    dma_tag_t prev = dma_tag;
+    dma_tag = tag;
+    return prev;
+}
+
+/**
+ * @brief Get a snapshot of the PI bus usage statistics
+ *
+ * @param[out] stats    Structure to fill with the statistics accumulated
+ *                      since the last #dma_stats_reset
+ */
+void dma_stats_get(dma_stats_t *stats)
+{
+    disable_interrupts();
+    *stats = dma_stats;
+    stats->elapsed_ticks = TICKS_READ() - dma_stats.elapsed_ticks;
+    enable_interrupts();
+}
+
+/**
+ * @brief Reset the PI bus usage statistics
+ */
+void dma_stats_reset(void)
+{
+    disable_interrupts();
+    memset(&dma_stats, 0, sizeof(dma_stats));
+    dma_stats.elapsed_ticks = TICKS_READ();
     enable_interrupts();
 }
 
+/**
+ * @brief Dump the PI bus usage statistics to the debug output
+ *
+ * For each tag that accessed the bus, prints the number of DMA transfers and
+ * CPU accesses, the amount of data read and written, the average bandwidth,
+ * and the time that the CPU spent waiting for the PI to become idle.
+ *
+ * To monitor the bus usage over time, call this periodically from the main
+ * loop with reset set to true.  The statistics are taken (and reset) before
+ * printing, so the debug output of the dump itself is charged to
+ * #DMA_TAG_DEBUG in the following period.
+ *
+ * @note Do not call this from an interrupt handler, as it would interleave
+ *       its output with a debug output in progress.
+ *
+ * @param[in] reset     Whether to reset the statistics (see #dma_stats_reset)
+ */
+void dma_stats_dump(bool reset)
+{
+    assertf(!in_interrupt_handler(), "dma_stats_dump cannot be called from an interrupt handler");
+
+    dma_stats_t stats;
+    disable_interrupts();
+    dma_stats_get(&stats);
+    if (reset)
+        dma_stats_reset();
+    enable_interrupts();
+
+    uint32_t elapsed_us = TIMER_MICROS(stats.elapsed_ticks);
+    debugf("PI bus statistics (%lu ms):\n", elapsed_us / 1000);
+    debugf("  %-6s %8s %8s %10s %10s %8s %10s\n", "tag", "dma", "io", "read KB", "write KB", "KB/s", "stall us");
+
+    for (int i = 0; i < DMA_NUM_TAGS; i++) {
+        dma_tag_stats_t *t = &stats.tags[i];
+        if (!t->dma_transfers && !t->io_accesses && !t->stall_ticks)
+            continue;
+
+        uint64_t bytes = (uint64_t)t->read_bytes + t->write_bytes;
+        uint32_t kbps = elapsed_us ? bytes * 1000000 / 1024 / elapsed_us : 0;
+        debugf("  %-6s %8lu %8lu %10lu %10lu %8lu %10d\n", dma_tag_names[i],
+            t->dma_transfers, t->io_accesses, t->read_bytes / 1024, t->write_bytes / 1024,
+            kbps, TIMER_MICROS(t->stall_ticks));
+    }
+}
+
 /** @} */ /* dma */
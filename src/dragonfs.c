@@ -6,11 +6,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <malloc.h>
 #include <sys/stat.h>
 #include "libdragon.h"
 #include "system.h"
 #include "dfsinternal.h"
 #include "rompak_internal.h"
+#include "regsinternal.h"
+#include "utils.h"
 
 /**
  * @defgroup dfs DragonFS
@@ -34,13 +37,30 @@
  *
  * DFS files have a maximum size of 256 MiB.  Directories can have an unlimited
  * number of files in them.  Each token (separated by a / in the path) can be 243 characters
- * maximum.  Directories can be 100 levels deep at maximum.  There can be 4 files open
- * simultaneously.
+ * maximum.  Directories can be 100 levels deep at maximum.
+ *
+ * The table of open files starts small and grows on demand, so only the files
+ * actually open use memory.  By default, up to #DFS_DEFAULT_MAX_OPEN_FILES files
+ * can be open simultaneously; the limit can be changed (up to
+ * #DFS_MAX_OPEN_FILES_LIMIT) by initializing DFS with #dfs_init_ex.
  *
  * When DFS is initialized, it will register itself with newlib using 'rom:/' as a prefix.
  * Files can be accessed either with standard POSIX functions and the 'rom:/' prefix or
  * with DFS API calls and no prefix.  Files can be opened using both sets of API calls
- * simultaneously as long as no more than four files are open at any one time.
+ * simultaneously; files opened either way count towards the same limit.
+ *
+ * Images built by 'mkdfs' contain a hash table indexing the absolute path of every
+ * file, so that opening a file by absolute path does not require walking the
+ * directory structure one entry at a time.  Paths that are relative to a
+ * subdirectory or contain "." or ".." components are still resolved by walking.
+ *
+ * Files can be stored compressed by passing '--compress' to 'mkdfs'.  They are
+ * decompressed transparently by #dfs_read (and thus by the POSIX functions),
+ * a chunk at a time, so that seeking within them stays cheap.
+ *
+ * Besides the blocking #dfs_read, files can be read with #dfs_read_async, which
+ * queues the transfer and notifies its completion via a callback, so that the
+ * CPU can keep running while data is streamed from ROM.
  * @{
  */
 
@@ -70,57 +90,286 @@ enum
 
 /** @brief Base filesystem pointer */
 static uint32_t base_ptr = 0;
-/** @brief Open file tracking */
-static open_file_t open_files[MAX_OPEN_FILES];
+/** @brief Number of bits of a file handle used for the slot index */
+#define HANDLE_INDEX_BITS   12
+/** @brief Mask of the slot index in a file handle */
+#define HANDLE_INDEX_MASK   ((1 << HANDLE_INDEX_BITS) - 1)
+/** @brief Number of generations before a slot reuses the same handle */
+#define HANDLE_GENERATIONS  (1 << (31 - HANDLE_INDEX_BITS))
+
+/** @brief Slot of the open file table */
+typedef struct
+{
+    /** @brief Open file structure, allocated the first time the slot is used */
+    open_file_t *file;
+    /** @brief Generation of the slot, bumped every time a file is closed */
+    uint32_t generation;
+    /** @brief Index of the next free slot, or -1 (valid only while free) */
+    int next_free;
+} file_slot_t;
+
+/** @brief Open file tracking (grows on demand up to #max_open_files slots) */
+static file_slot_t *open_files = 0;
+/** @brief Number of allocated slots in #open_files */
+static int open_files_size = 0;
+/** @brief Head of the list of free slots, or -1 */
+static int open_files_free = -1;
+/** @brief Maximum number of files that can be open at the same time */
+static int max_open_files = DFS_DEFAULT_MAX_OPEN_FILES;
 /** @brief Directory pointer stack */
 static uint32_t directories[MAX_DIRECTORY_DEPTH];
 /** @brief Depth into directory pointer stack */
 static uint32_t directory_top = 0;
 /** @brief Pointer to next directory entry set when doing a directory walk */
 static directory_entry_t *next_entry = 0;
+/** @brief Location of the path hash table buckets, or 0 if the image has no table */
+static uint32_t path_hash_buckets = 0;
+/** @brief Number of buckets in the path hash table */
+static uint32_t path_hash_num_buckets = 0;
+
+/** @brief Number of path hash buckets fetched with a single DMA while probing */
+#define PATH_HASH_GROUP     8
+
+/** @brief Tag of a sector in the directory sector cache */
+typedef struct
+{
+    /** @brief Cartridge location of the cached sector, or 0 if the slot is empty */
+    uint32_t loc;
+    /** @brief Value of #sector_cache_clock at the time of the last access */
+    uint32_t last_use;
+} sector_cache_tag_t;
+
+/** @brief Sector cache tags */
+static sector_cache_tag_t *sector_cache_tags = 0;
+/** @brief Sector cache data (one #SECTOR_SIZE block per tag) */
+static uint8_t *sector_cache_data = 0;
+/** @brief Number of sectors in the sector cache */
+static int sector_cache_size = 0;
+/** @brief Whether the application configured the sector cache size */
+static bool sector_cache_configured = false;
+/** @brief Access counter used to find the least recently used sector */
+static uint32_t sector_cache_clock = 0;
+/** @brief Sector cache statistics */
+static dfs_cache_stats_t sector_cache_stats;
+
+/** @brief Whether file accesses are being traced */
+static bool trace_enabled = false;
+
+/** @brief A pending asynchronous read, waiting for its completion */
+typedef struct
+{
+    /** @brief Number of bytes of the read */
+    int len;
+    /** @brief Completion callback */
+    dfs_read_cb_t cb;
+    /** @brief Opaque context for the callback */
+    void *ctx;
+} async_read_t;
+
+/** @brief Ring of pending asynchronous reads, in the order they will complete */
+static async_read_t async_reads[DFS_MAX_ASYNC_READS];
+/** @brief Index of the oldest pending asynchronous read */
+static volatile int async_head = 0;
+/** @brief Number of pending asynchronous reads */
+static volatile int async_count = 0;
 
 /**
  * @brief Read a sector from cartspace
  *
  * This function handles fetching a sector from cartspace into RDRAM using
- * DMA.
+ * DMA.  Sectors are kept in a small LRU cache, as walking directories reads
+ * the same directory entries over and over.
  *
  * @param[in]  cart_loc
  *             Pointer to cartridge location
  * @param[out] ram_loc
  *             Pointer to RAM buffer to place the read sector
  */
-static inline void grab_sector(void *cart_loc, void *ram_loc)
+static void grab_sector(void *cart_loc, void *ram_loc)
+{
+    if(!sector_cache_size)
+    {
+        /* Make sure we have fresh cache */
+        data_cache_hit_writeback_invalidate(ram_loc, SECTOR_SIZE);
+
+        dma_read((void *)(((uint32_t)ram_loc) & 0x1FFFFFFF), (uint32_t)cart_loc, SECTOR_SIZE);
+        sector_cache_stats.misses++;
+        return;
+    }
+
+    int victim = 0;
+
+    for(int i = 0; i < sector_cache_size; i++)
+    {
+        if(sector_cache_tags[i].loc == (uint32_t)cart_loc)
+        {
+            /* Cache hit */
+            sector_cache_tags[i].last_use = ++sector_cache_clock;
+            sector_cache_stats.hits++;
+
+            memcpy(ram_loc, sector_cache_data + i * SECTOR_SIZE, SECTOR_SIZE);
+            return;
+        }
+
+        if(sector_cache_tags[i].last_use < sector_cache_tags[victim].last_use)
+        {
+            victim = i;
+        }
+    }
+
+    /* Cache miss, replace the least recently used sector. The cache data is
+     * 16-byte aligned and a multiple of 16 bytes, so there is no need to
+     * writeback before invalidating. */
+    uint8_t *data = sector_cache_data + victim * SECTOR_SIZE;
+    data_cache_hit_invalidate(data, SECTOR_SIZE);
+
+    dma_read((void *)(((uint32_t)data) & 0x1FFFFFFF), (uint32_t)cart_loc, SECTOR_SIZE);
+
+    sector_cache_tags[victim].loc = (uint32_t)cart_loc;
+    sector_cache_tags[victim].last_use = ++sector_cache_clock;
+    sector_cache_stats.misses++;
+
+    memcpy(ram_loc, data, SECTOR_SIZE);
+}
+
+/**
+ * @brief Drop all the sectors from the sector cache
+ */
+static void flush_sector_cache(void)
 {
-    /* Make sure we have fresh cache */
-    data_cache_hit_writeback_invalidate(ram_loc, SECTOR_SIZE);
+    if(sector_cache_tags)
+    {
+        memset(sector_cache_tags, 0, sector_cache_size * sizeof(sector_cache_tag_t));
+    }
+
+    sector_cache_clock = 0;
+}
+
+/**
+ * @brief Check whether the PI interrupt can run, completing queued reads
+ *
+ * When interrupts are disabled, or within an interrupt handler, transfers
+ * queued in the PI queue never complete by themselves.
+ *
+ * @return true if queued reads complete in the background
+ */
+static inline bool interrupts_serviced(void)
+{
+    return get_interrupts_state() == INTERRUPTS_ENABLED && !in_interrupt_handler();
+}
 
-    dma_read((void *)(((uint32_t)ram_loc) & 0x1FFFFFFF), (uint32_t)cart_loc, SECTOR_SIZE);
+/**
+ * @brief Wait for the prefetch into a streaming buffer to complete
+ *
+ * If the PI interrupt cannot run, the PI queue is advanced by polling.
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[in] b
+ *            Index of the streaming buffer
+ */
+static void stream_wait(open_file_t *file, int b)
+{
+    while(file->stream_pending[b])
+    {
+        if(!interrupts_serviced())
+        {
+            /* The PI interrupt cannot complete the prefetch for us */
+            dma_queue_poll();
+        }
+    }
 }
 
 /**
  * @brief Find a free open file structure
  *
+ * Free slots are kept in a list, so this is O(1).  If there are none, the
+ * table is grown (doubling its size) up to #max_open_files slots.
+ *
  * @return A pointer to an open file structure or NULL if no more open file structures.
  */
 static open_file_t *find_free_file()
 {
-    for(int i = 0; i < MAX_OPEN_FILES; i++)
+    if(open_files_free < 0)
     {
-        if(!open_files[i].handle)
+        if(open_files_size >= max_open_files)
+        {
+            /* No free files */
+            return 0;
+        }
+
+        int new_size = open_files_size ? open_files_size * 2 : 4;
+        if(new_size > max_open_files) { new_size = max_open_files; }
+
+        file_slot_t *slots = realloc(open_files, new_size * sizeof(file_slot_t));
+        if(!slots) { return 0; }
+
+        /* Link the new slots in the free list. Open file structures are
+         * allocated lazily, and never move, as pending DMAs refer to them. */
+        for(int i = open_files_size; i < new_size; i++)
         {
-            /* Found one! */
-            return &open_files[i];
+            slots[i].file = 0;
+            slots[i].generation = 1;
+            slots[i].next_free = (i + 1 < new_size) ? i + 1 : -1;
         }
+
+        open_files = slots;
+        open_files_free = open_files_size;
+        open_files_size = new_size;
     }
 
-    /* No free files */
-    return 0;
+    int idx = open_files_free;
+    file_slot_t *slot = &open_files[idx];
+
+    if(!slot->file)
+    {
+        slot->file = memalign(16, sizeof(open_file_t));
+        if(!slot->file) { return 0; }
+        memset(slot->file, 0, sizeof(open_file_t));
+    }
+
+    open_files_free = slot->next_free;
+    slot->file->handle = (slot->generation << HANDLE_INDEX_BITS) | idx;
+
+    return slot->file;
+}
+
+/**
+ * @brief Release an open file structure, making its slot available again
+ *
+ * The generation of the slot is bumped, so that the old handle is not valid
+ * anymore.
+ *
+ * @param[in] file
+ *            Open file structure as returned by #find_free_file
+ */
+static void release_file(open_file_t *file)
+{
+    int idx = file->handle & HANDLE_INDEX_MASK;
+    file_slot_t *slot = &open_files[idx];
+
+    /* Prefetches must not land in freed memory */
+    stream_wait(file, 0);
+    stream_wait(file, 1);
+
+    free(file->chunk_data);
+    free(file->stream_data);
+    free(file->trace_path);
+    memset(file, 0, sizeof(open_file_t));
+
+    slot->generation = (slot->generation + 1) % HANDLE_GENERATIONS;
+    if(!slot->generation) { slot->generation = 1; }
+    slot->next_free = open_files_free;
+    open_files_free = idx;
 }
 
 /**
  * @brief Find an open file structure based on a handle
  *
+ * Handles encode the slot index in their lower bits, and the generation of
+ * the slot in the upper bits, so the lookup is O(1) and stale handles
+ * (of files that were closed) are rejected.
+ *
  * @param[in] x
  *            The file handle given to the open file
  *
@@ -128,19 +377,19 @@ static open_file_t *find_free_file()
  */
 static open_file_t *find_open_file(uint32_t x)
 {
-    if(x == 0) { return 0; }
+    uint32_t idx = x & HANDLE_INDEX_MASK;
+
+    if(idx >= open_files_size) { return 0; }
 
-    for(int i = 0; i < MAX_OPEN_FILES; i++)
+    open_file_t *file = open_files[idx].file;
+
+    if(!file || !file->handle || file->handle != x)
     {
-        if(open_files[i].handle == x)
-        {
-            /* Found it! */
-            return &open_files[i];
-        }
+        /* Couldn't find handle */
+        return 0;
     }
 
-    /* Couldn't find handle */
-    return 0;
+    return file;
 }
 
 /**
@@ -614,6 +863,163 @@ static int recurse_path(const char * const path, int mode, directory_entry_t **d
     return ret;
 }
 
+/**
+ * @brief Look up a file using the path hash table
+ *
+ * Absolute paths (and relative paths, when the current directory is the root)
+ * are hashed and looked up in the path hash table written by mkdfs, so that
+ * opening a file costs a couple of DMAs regardless of how deep it is in the
+ * directory structure or how many files are in each directory.
+ *
+ * Paths that cannot be resolved through the table (eg: they contain "." or ".."
+ * components, or the image was built without a table) are reported back to the
+ * caller, which is expected to walk the directory structure instead.
+ *
+ * @param[in]  path
+ *             Path of the file to look up
+ * @param[out] dirent
+ *             Directory entry of the file, if found
+ *
+ * @return DFS_ESUCCESS if the file was found, DFS_ENOFILE if it does not exist,
+ *         or DFS_EBADINPUT if the path must be resolved by walking directories.
+ */
+static int find_hashed_file(const char * const path, directory_entry_t **dirent)
+{
+    if(!path_hash_buckets || !path)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    if(path[0] != '/' && directory_top > 0)
+    {
+        /* Relative to a directory other than the root */
+        return DFS_EBADINPUT;
+    }
+
+    /* Hash the canonical form of the path, remembering the last component */
+    uint32_t hash = PATH_HASH_INIT;
+    uint32_t check = PATH_CHECK_INIT;
+    const char *leaf = 0;
+    int leaf_len = 0;
+    const char *cur = path;
+
+    while(*cur)
+    {
+        if(*cur == '/')
+        {
+            cur++;
+            continue;
+        }
+
+        const char *token = cur;
+        while(*cur && *cur != '/') { cur++; }
+        int len = cur - token;
+
+        if(len > MAX_FILENAME_LEN ||
+           (len == 1 && token[0] == '.') ||
+           (len == 2 && token[0] == '.' && token[1] == '.'))
+        {
+            return DFS_EBADINPUT;
+        }
+
+        if(leaf)
+        {
+            hash = PATH_HASH_STEP(hash, '/');
+            check = PATH_CHECK_STEP(check, '/');
+        }
+
+        for(int i = 0; i < len; i++)
+        {
+            hash = PATH_HASH_STEP(hash, token[i]);
+            check = PATH_CHECK_STEP(check, token[i]);
+        }
+
+        leaf = token;
+        leaf_len = len;
+    }
+
+    if(!leaf)
+    {
+        /* This is the root directory */
+        return DFS_EBADINPUT;
+    }
+
+    /* Linear probing. Buckets are fetched in aligned groups, so that most lookups
+     * need a single DMA for the table plus one for the directory entry. */
+    path_hash_bucket_t group[PATH_HASH_GROUP] __attribute__((aligned(16)));
+    uint32_t mask = path_hash_num_buckets - 1;
+    uint32_t idx = hash & mask;
+    uint32_t probed = 0;
+
+    while(probed < path_hash_num_buckets)
+    {
+        uint32_t first = idx & ~(PATH_HASH_GROUP - 1);
+
+        data_cache_hit_invalidate(group, sizeof(group));
+        dma_read((void *)(((uint32_t)group) & 0x1FFFFFFF),
+            path_hash_buckets + first * sizeof(path_hash_bucket_t), sizeof(group));
+
+        for(int i = idx - first; i < PATH_HASH_GROUP; i++, probed++)
+        {
+            if(group[i].dirent == PATH_HASH_EMPTY)
+            {
+                /* End of the probe sequence */
+                return DFS_ENOFILE;
+            }
+
+            if(group[i].hash != hash || group[i].check != check)
+            {
+                /* Another path, possibly with the same hash */
+                continue;
+            }
+
+            if(group[i].dirent == PATH_HASH_AMBIGUOUS)
+            {
+                /* Several files share these hashes */
+                return DFS_EBADINPUT;
+            }
+
+            /* Verify the name too, to weed out paths that are not in the image */
+            directory_entry_t *cur_node = (directory_entry_t *)(base_ptr + group[i].dirent);
+            directory_entry_t node;
+            grab_sector(cur_node, &node);
+
+            if(FILETYPE(get_flags(&node)) == FLAGS_FILE &&
+               strncmp(node.path, leaf, leaf_len) == 0 && node.path[leaf_len] == 0)
+            {
+                *dirent = cur_node;
+                return DFS_ESUCCESS;
+            }
+        }
+
+        idx = (first + PATH_HASH_GROUP) & mask;
+    }
+
+    return DFS_ENOFILE;
+}
+
+/**
+ * @brief Find the directory entry of a file given a path
+ *
+ * @param[in]  path
+ *             Relative or absolute path of the file
+ * @param[out] dirent
+ *             Directory entry of the file, if found
+ *
+ * @return DFS_ESUCCESS on success or a negative error on failure.
+ */
+static int find_file(const char * const path, directory_entry_t **dirent)
+{
+    int ret = find_hashed_file(path, dirent);
+
+    if(ret != DFS_EBADINPUT)
+    {
+        return ret;
+    }
+
+    return recurse_path(path, WALK_OPEN, dirent, TYPE_FILE);
+}
+
 /**
  * @brief Helper functioner to initialize the filesystem
  *
@@ -624,6 +1030,9 @@ static int recurse_path(const char * const path, int mode, directory_entry_t **d
  */
 static int __dfs_init(uint32_t base_fs_loc)
 {
+    /* A different image might be mapped at the same address */
+    flush_sector_cache();
+
     /* Check to see if it passes the check */
     directory_entry_t id_node;
     grab_sector((void *)base_fs_loc, &id_node);
@@ -635,7 +1044,49 @@ static int __dfs_init(uint32_t base_fs_loc)
         base_ptr = base_fs_loc;
         clear_directory();
 
-        memset(open_files, 0, sizeof(open_files));
+        /* Forget about files opened on the previous image */
+        for(int i = 0; i < open_files_size; i++)
+        {
+            if(open_files[i].file && open_files[i].file->handle)
+            {
+                release_file(open_files[i].file);
+            }
+        }
+
+        if(open_files_size > max_open_files)
+        {
+            /* The maximum was lowered: start again with an empty table */
+            for(int i = 0; i < open_files_size; i++)
+            {
+                free(open_files[i].file);
+            }
+            free(open_files);
+            open_files = 0;
+            open_files_size = 0;
+            open_files_free = -1;
+        }
+
+        /* Images built by older versions of mkdfs have no path hash table */
+        path_hash_buckets = 0;
+        path_hash_num_buckets = 0;
+
+        if(id_node.file_pointer)
+        {
+            /* Only the first 8 bytes are read, but a whole cacheline is
+             * invalidated, so it must not be shared with other data */
+            uint32_t header[4] __attribute__((aligned(16)));
+            data_cache_hit_invalidate(header, sizeof(header));
+            dma_read((void *)(((uint32_t)header) & 0x1FFFFFFF),
+                base_ptr + id_node.file_pointer, sizeof(path_hash_table_t));
+
+            uint32_t num_buckets = header[1];
+            if(header[0] == PATH_HASH_MAGIC && num_buckets >= PATH_HASH_GROUP &&
+               (num_buckets & (num_buckets - 1)) == 0)
+            {
+                path_hash_buckets = base_ptr + id_node.file_pointer + sizeof(path_hash_table_t);
+                path_hash_num_buckets = num_buckets;
+            }
+        }
 
         /* Good FS */
         return DFS_ESUCCESS;
@@ -645,6 +1096,80 @@ static int __dfs_init(uint32_t base_fs_loc)
     return DFS_EBADFS;
 }
 
+/**
+ * @brief Configure the directory sector cache
+ *
+ * DragonFS keeps the most recently used directory sectors in RDRAM, so that
+ * repeatedly opening files or listing the same directories does not need to
+ * read them again from ROM.  By default, #DFS_DEFAULT_SECTOR_CACHE_SIZE sectors
+ * are cached; call this function before or after #dfs_init to change that.
+ * Each sector uses #SECTOR_SIZE bytes of RDRAM.
+ *
+ * @param[in] num_sectors
+ *            Number of sectors to cache, or 0 to disable the cache.
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_set_sector_cache(int num_sectors)
+{
+    if(num_sectors < 0)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    free(sector_cache_tags);
+    free(sector_cache_data);
+    sector_cache_tags = 0;
+    sector_cache_data = 0;
+    sector_cache_size = 0;
+    sector_cache_configured = true;
+
+    if(!num_sectors)
+    {
+        return DFS_ESUCCESS;
+    }
+
+    sector_cache_tags = calloc(num_sectors, sizeof(sector_cache_tag_t));
+    sector_cache_data = memalign(16, num_sectors * SECTOR_SIZE);
+
+    if(!sector_cache_tags || !sector_cache_data)
+    {
+        free(sector_cache_tags);
+        free(sector_cache_data);
+        sector_cache_tags = 0;
+        sector_cache_data = 0;
+        return DFS_ENOMEM;
+    }
+
+    sector_cache_size = num_sectors;
+    flush_sector_cache();
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Get the statistics of the directory sector cache
+ *
+ * Each sector read while walking directories counts either as a hit (served
+ * from RDRAM) or as a miss (read from ROM via DMA).  With the cache disabled,
+ * every read counts as a miss.
+ *
+ * @param[out] stats
+ *             Structure to fill with the statistics
+ */
+void dfs_get_cache_stats(dfs_cache_stats_t *stats)
+{
+    *stats = sector_cache_stats;
+}
+
+/**
+ * @brief Reset the statistics of the directory sector cache
+ */
+void dfs_reset_cache_stats(void)
+{
+    memset(&sector_cache_stats, 0, sizeof(sector_cache_stats));
+}
+
 /**
  * @brief Change directories to the specified path.  
  *
@@ -657,6 +1182,8 @@ static int __dfs_init(uint32_t base_fs_loc)
  */
 int dfs_chdir(const char * const path)
 {
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
     /* Reset directory listing */
     next_entry = 0;
 
@@ -684,6 +1211,8 @@ int dfs_chdir(const char * const path)
  */
 int dfs_dir_findfirst(const char * const path, char *buf)
 {
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
     directory_entry_t *dirent;
     int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_DIR);
 
@@ -708,7 +1237,7 @@ int dfs_dir_findfirst(const char * const path, char *buf)
     /* Set up directory to point to next entry */
     next_entry = get_next_entry(&t_node);
 
-    return get_flags(&t_node);
+    return FILETYPE(get_flags(&t_node));
 }
 
 /**
@@ -723,6 +1252,8 @@ int dfs_dir_findfirst(const char * const path, char *buf)
  */
 int dfs_dir_findnext(char *buf)
 {
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
     if(!next_entry)
     {
         /* No file found */
@@ -741,62 +1272,364 @@ int dfs_dir_findnext(char *buf)
     /* Set up directory to point to next entry */
     next_entry = get_next_entry(&t_node);
 
-    return get_flags(&t_node);
+    return FILETYPE(get_flags(&t_node));
 }
 
 /**
- * @brief Open a file given a path
+ * @brief Trace the opening of a file
  *
- * Check if we have any free file handles, and if we do, try
- * to open the file specified.  Supports absolute and relative
- * paths
+ * Store the canonical path of the file (no leading slash, "." and ".."
+ * resolved) in the open file structure, and log it.
  *
+ * @param[in] file
+ *            Open file structure
  * @param[in] path
- *            Path of the file to open
- *
- * @return A valid file handle to reference the file by or a negative error on failure.
+ *            Path the file was opened with
  */
-int dfs_open(const char * const path)
+static void trace_open(open_file_t *file, const char * const path)
 {
-    /* Ensure we always open with a unique handle */
-    static uint32_t next_handle = 1;
-
-    /* Try to find a free slot */
-    open_file_t *file = find_free_file();
+    char *canon = malloc(strlen(path) + 1);
+    const char *cur = path;
+    int len = 0;
 
-    if(!file)
+    if(!canon)
     {
-        return DFS_ENOMEM;        
+        return;
     }
 
-    /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
-
-    if(ret != DFS_ESUCCESS)
+    while(*cur)
     {
-        /* File not found, or other error */
-        return ret;
-    }
+        if(*cur == '/')
+        {
+            cur++;
+            continue;
+        }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
+        const char *token = cur;
+        while(*cur && *cur != '/') { cur++; }
+        int token_len = cur - token;
 
-    /* Set up file handle */
-    file->handle = next_handle++;
-    file->size = get_size(&t_node);
-    file->loc = 0;
-    file->cart_start_loc = get_start_location(&t_node);
-    file->cached_loc = 0xFFFFFFFF;
+        if(token_len == 1 && token[0] == '.')
+        {
+            continue;
+        }
 
-    return file->handle;
-}
+        if(token_len == 2 && token[0] == '.' && token[1] == '.')
+        {
+            /* Drop the last component */
+            while(len > 0 && canon[len - 1] != '/') { len--; }
+            if(len > 0) { len--; }
+            continue;
+        }
 
-/**
- * @brief Close an already open file handle.
- *
- * @param[in] handle
+        if(len)
+        {
+            canon[len++] = '/';
+        }
+
+        memcpy(canon + len, token, token_len);
+        len += token_len;
+    }
+
+    canon[len] = 0;
+    file->trace_path = canon;
+
+    debugf("dfs-trace: open %s\n", canon);
+}
+
+/**
+ * @brief Decompress a LZ4 block
+ *
+ * @param[in]  src
+ *             Compressed data
+ * @param[in]  src_len
+ *             Length of the compressed data (it can include trailing padding)
+ * @param[out] dst
+ *             Buffer where to decompress
+ * @param[in]  dst_len
+ *             Expected length of the decompressed data
+ *
+ * @return The number of bytes decompressed, or -1 if the data is corrupted.
+ */
+static int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_len)
+{
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dst, *oend = dst + dst_len;
+
+    while(op < oend)
+    {
+        if(ip >= iend) { return -1; }
+
+        int token = *ip++;
+        int len = token >> 4;
+
+        /* Literals */
+        if(len == 15)
+        {
+            int b;
+            do {
+                if(ip >= iend) { return -1; }
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > oend - op || len > iend - ip) { return -1; }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* The last sequence has only literals */
+        if(op == oend) { break; }
+        if(iend - ip < 2) { return -1; }
+
+        /* Match */
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op - dst) { return -1; }
+
+        len = token & 15;
+        if(len == 15)
+        {
+            int b;
+            do {
+                if(ip >= iend) { return -1; }
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        len += 4;
+
+        if(len > oend - op) { return -1; }
+
+        const uint8_t *match = op - offset;
+        if(offset >= len)
+        {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else
+        {
+            /* Overlapping match (eg: run of repeated bytes) */
+            while(len--) { *op++ = *match++; }
+        }
+    }
+
+    return op - dst;
+}
+
+/**
+ * @brief Set up an open file for reading a compressed file
+ *
+ * Allocate the chunk buffers and load the chunk index, so that any position
+ * in the file can be reached by decompressing a single chunk.
+ *
+ * @param[in] file
+ *            Open file structure, whose size and start location are set
+ *
+ * @return DFS_ESUCCESS on success or a negative error on failure.
+ */
+static int open_compressed(open_file_t *file)
+{
+    /* Only the first 8 bytes are read, see __dfs_init */
+    uint32_t header[4] __attribute__((aligned(16)));
+    data_cache_hit_invalidate(header, sizeof(header));
+    dma_read((void *)(((uint32_t)header) & 0x1FFFFFFF), file->cart_start_loc, sizeof(compressed_header_t));
+
+    uint32_t chunk_log2 = header[0];
+    uint32_t num_chunks = header[1];
+
+    if(chunk_log2 < 4 || chunk_log2 > 20 ||
+       num_chunks != (file->size + (1 << chunk_log2) - 1) >> chunk_log2)
+    {
+        return DFS_EBADFS;
+    }
+
+    /* One buffer for the decompressed chunk, one for the compressed chunk,
+     * then the chunk offsets. */
+    uint32_t chunk_size = 1 << chunk_log2;
+    uint32_t offsets_size = (num_chunks + 1) * sizeof(uint32_t);
+    uint8_t *data = memalign(16, chunk_size * 2 + ROUND_UP(offsets_size, 16));
+
+    if(!data)
+    {
+        return DFS_ENOMEM;
+    }
+
+    uint32_t *offsets = (uint32_t *)(data + chunk_size * 2);
+    data_cache_hit_invalidate(offsets, ROUND_UP(offsets_size, 16));
+    dma_read((void *)(((uint32_t)offsets) & 0x1FFFFFFF),
+        file->cart_start_loc + sizeof(compressed_header_t), offsets_size);
+
+    file->chunk_data = data;
+    file->chunk_offsets = offsets;
+    file->chunk_log2 = chunk_log2;
+    file->chunk_index = 0xFFFFFFFF;
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Load and decompress a chunk of a compressed file
+ *
+ * @param[in] file
+ *            Open file structure of a compressed file
+ * @param[in] index
+ *            Index of the chunk to load
+ *
+ * @return DFS_ESUCCESS on success or a negative error on failure.
+ */
+static int load_chunk(open_file_t *file, uint32_t index)
+{
+    uint32_t chunk_size = 1 << file->chunk_log2;
+    uint32_t len = MIN(chunk_size, file->size - (index << file->chunk_log2));
+    uint32_t comp_start = file->chunk_offsets[index];
+    uint32_t comp_len = file->chunk_offsets[index + 1] - comp_start;
+
+    if(comp_len > chunk_size || (comp_start & 1) || (comp_len & 1))
+    {
+        return DFS_EBADFS;
+    }
+
+    file->chunk_index = 0xFFFFFFFF;
+
+    if(comp_len == ROUND_UP(len, 2))
+    {
+        /* Stored uncompressed */
+        data_cache_hit_invalidate(file->chunk_data, chunk_size);
+        dma_read((void *)(((uint32_t)file->chunk_data) & 0x1FFFFFFF),
+            file->cart_start_loc + comp_start, comp_len);
+    }
+    else
+    {
+        uint8_t *comp = file->chunk_data + chunk_size;
+        data_cache_hit_invalidate(comp, chunk_size);
+        dma_read((void *)(((uint32_t)comp) & 0x1FFFFFFF),
+            file->cart_start_loc + comp_start, comp_len);
+
+        if(lz4_decompress(comp, comp_len, file->chunk_data, len) != len)
+        {
+            return DFS_EBADFS;
+        }
+    }
+
+    file->chunk_index = index;
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Read data from a compressed file
+ *
+ * @param[in]  file
+ *             Open file structure of a compressed file
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  to_read
+ *             Number of bytes to read (already clamped to the file size)
+ *
+ * @return The actual number of bytes read or a negative value on failure.
+ */
+static int read_compressed(open_file_t *file, uint8_t *buf, int to_read)
+{
+    uint32_t chunk_size = 1 << file->chunk_log2;
+    int did_read = 0;
+
+    while(to_read)
+    {
+        uint32_t index = file->loc >> file->chunk_log2;
+
+        if(index != file->chunk_index)
+        {
+            int ret = load_chunk(file, index);
+
+            if(ret != DFS_ESUCCESS)
+            {
+                return ret;
+            }
+        }
+
+        uint32_t offset = file->loc & (chunk_size - 1);
+        int copy = MIN((int)(chunk_size - offset), to_read);
+
+        memcpy(buf, file->chunk_data + offset, copy);
+
+        file->loc += copy;
+        buf += copy;
+        to_read -= copy;
+        did_read += copy;
+    }
+
+    return did_read;
+}
+
+/**
+ * @brief Open a file given a path
+ *
+ * Check if we have any free file handles, and if we do, try
+ * to open the file specified.  Supports absolute and relative
+ * paths
+ *
+ * @param[in] path
+ *            Path of the file to open
+ *
+ * @return A valid file handle to reference the file by or a negative error on failure.
+ */
+int dfs_open(const char * const path)
+{
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
+    /* Try to find file */
+    directory_entry_t *dirent;
+    int ret = find_file(path, &dirent);
+
+    if(ret != DFS_ESUCCESS)
+    {
+        /* File not found, or other error */
+        return ret;
+    }
+
+    /* Try to find a free slot */
+    open_file_t *file = find_free_file();
+
+    if(!file)
+    {
+        return DFS_ENOMEM;        
+    }
+
+    /* We now have the pointer to the file entry */
+    directory_entry_t t_node;
+    grab_sector(dirent, &t_node);
+
+    /* Set up file handle */
+    file->size = get_size(&t_node);
+    file->loc = 0;
+    file->cart_start_loc = get_start_location(&t_node);
+    file->cached_loc = 0xFFFFFFFF;
+    file->chunk_data = 0;
+
+    if(get_flags(&t_node) & FLAGS_COMPRESSED)
+    {
+        ret = open_compressed(file);
+
+        if(ret != DFS_ESUCCESS)
+        {
+            release_file(file);
+            return ret;
+        }
+    }
+
+    if(trace_enabled)
+    {
+        trace_open(file, path);
+    }
+
+    return file->handle;
+}
+
+/**
+ * @brief Close an already open file handle.
+ *
+ * @param[in] handle
  *            A valid file handle as returned from #dfs_open.
  *
  * @return DFS_ESUCCESS on success or a negative value on error.
@@ -805,30 +1638,803 @@ int dfs_close(uint32_t handle)
 {
     open_file_t *file = find_open_file(handle);
 
-    if(!file)
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    release_file(file);
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Seek to an offset in the file
+ *
+ * @param[in] handle
+ *            A valid file handle as returned from #dfs_open.
+ * @param[in] offset
+ *            A byte offset from the origin to seek from.
+ * @param[in] origin
+ *            An offset to seek from.  Either `SEEK_SET`, `SEEK_CUR` or `SEEK_END`.
+ *  
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_seek(uint32_t handle, int offset, int origin)
+{
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    switch(origin)
+    {
+        case SEEK_SET:
+            /* From the beginning */
+            if(offset < 0)
+            { 
+                file->loc = 0; 
+            }
+            else
+            {
+                file->loc = offset;
+            }
+
+            break;
+        case SEEK_CUR:
+        {
+            /* From the current position */
+            int new_offset = (int)file->loc + offset;
+
+            if(new_offset < 0)
+            {
+                new_offset = 0;
+            }
+
+            file->loc = new_offset;
+
+            break;
+        }
+        case SEEK_END:
+        {
+            /* From the end of the file */
+            int new_offset = (int)file->size + offset;
+
+            if(new_offset < 0)
+            {
+                new_offset = 0;
+            }
+
+            file->loc = new_offset;
+
+            break;
+        }
+        default:
+            /* Impossible */
+            return DFS_EBADINPUT;
+    }
+
+    /* Lets get some bounds checking */
+    if(file->loc > file->size)
+    {
+        file->loc = file->size;
+    }
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Return the current offset into a file
+ *
+ * @param[in] handle
+ *            A valid file handle as returned from #dfs_open.
+ *
+ * @return The current byte offset into a file or a negative error on failure.
+ */
+int dfs_tell(uint32_t handle)
+{
+    /* The good thing is that the location is always in the file structure */
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    return file->loc;
+}
+
+/**
+ * @brief Completion callback of the PI queue for asynchronous reads
+ *
+ * All the reads are queued with the same priority, so they complete in order
+ * and the one completing is always the oldest in the ring.
+ *
+ * @param[in] ctx
+ *            Pointer to the asynchronous read
+ */
+static void async_read_done(void *ctx)
+{
+    async_read_t *req = ctx;
+
+    /* Retire the request before calling the callback, which might queue more reads */
+    dfs_read_cb_t cb = req->cb;
+    void *cb_ctx = req->ctx;
+    int len = req->len;
+
+    async_head = (async_head + 1) % DFS_MAX_ASYNC_READS;
+    async_count--;
+
+    if(cb)
+    {
+        cb(len, cb_ctx);
+    }
+}
+
+/**
+ * @brief Queue an asynchronous read
+ *
+ * Reads are executed by the PI queue (see #dma_queue_read), which takes care
+ * of any misalignment of the buffer.
+ *
+ * @param[in]  rom
+ *             Cartridge address to read from
+ * @param[out] buf
+ *             Buffer to read into (already prepared with #invalidate_dma_buffer)
+ * @param[in]  len
+ *             Number of bytes to read
+ * @param[in]  cb
+ *             Callback to invoke when the read is complete
+ * @param[in]  ctx
+ *             Opaque pointer passed to the callback
+ *
+ * @return DFS_ESUCCESS on success, or DFS_ENOMEM if too many reads are pending.
+ */
+static int async_read_queue(uint32_t rom, void *buf, int len, dfs_read_cb_t cb, void *ctx)
+{
+    disable_interrupts();
+
+    if(async_count == DFS_MAX_ASYNC_READS)
+    {
+        enable_interrupts();
+        return DFS_ENOMEM;
+    }
+
+    async_read_t *req = &async_reads[(async_head + async_count) % DFS_MAX_ASYNC_READS];
+    req->len = len;
+    req->cb = cb;
+    req->ctx = ctx;
+
+    if(!dma_queue_read(buf, (rom | 0x10000000) & 0x1FFFFFFF, len, DMA_PRIORITY_NORMAL, async_read_done, req))
+    {
+        enable_interrupts();
+        return DFS_ENOMEM;
+    }
+
+    async_count++;
+
+    enable_interrupts();
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Check whether a read can DMA directly into the destination buffer
+ *
+ * If possible, we want to DMA directly into the destination buffer, without
+ * using any intermediate buffers. The rules are convoluted because we try to
+ * squeeze maximum performance here and thus we rely also on undocumented
+ * behaviors of PI DMA. The rules we follow are:
+ *
+ *   * The RDRAM destination pointer must be 8-bytes aligned.
+ *   * The ROM location must be 2-bytes aligned.
+ *   * The length must be either less than 0x7F (all values accepted),
+ *     or even.
+ *
+ * @param[in] loc
+ *            Offset within the file (files always start at an even address)
+ * @param[in] buf
+ *            Destination buffer
+ * @param[in] len
+ *            Number of bytes to read
+ *
+ * @return true if the read can be done with a single DMA into buf
+ */
+static inline bool can_dma_directly(uint32_t loc, void *buf, int len)
+{
+    bool rom_aligned = (loc & 1) == 0;
+    bool ram_aligned = ((uint32_t)buf & 7) == 0;
+    bool len_aligned = (len < 0x7F) || ((len & 1) == 0);
+    return rom_aligned && ram_aligned && len_aligned;
+}
+
+/**
+ * @brief Prepare the data cache for a DMA into the destination buffer
+ *
+ * @param[in] buf
+ *            Destination buffer
+ * @param[in] len
+ *            Number of bytes to read
+ */
+static inline void invalidate_dma_buffer(void *buf, int len)
+{
+    /* 16-byte alignment: we can simply invalidate the buffer.
+     * 8-byte alignment: we need to also writeback in case the partial
+     *  cachelines have hot data to write back. */
+    if ((((uint32_t)buf | len) & 15) == 0)
+        data_cache_hit_invalidate(buf, len);
+    else
+        data_cache_hit_writeback_invalidate(buf, len);
+}
+
+/**
+ * @brief Callback marking the end of a prefetch into a streaming buffer
+ *
+ * @param[in] len
+ *            Number of bytes read
+ * @param[in] ctx
+ *            Pointer to the pending flag of the streaming buffer
+ */
+static void stream_prefetch_done(int len, void *ctx)
+{
+    *(volatile int *)ctx = 0;
+}
+
+/**
+ * @brief Find the streaming buffer containing a file offset
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[in] loc
+ *            Offset within the file
+ *
+ * @return The index of the streaming buffer, or -1 if none contains the offset
+ */
+static int stream_find(open_file_t *file, uint32_t loc)
+{
+    for(int b = 0; b < 2; b++)
+    {
+        if(file->stream_loc[b] != 0xFFFFFFFF && loc - file->stream_loc[b] < file->stream_size)
+        {
+            return b;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Start prefetching a block of a file into a streaming buffer
+ *
+ * Nothing is done if the buffer already contains (or is being filled with)
+ * that block, if it is busy with another prefetch, if the block is past the
+ * end of the file, or if the PI interrupt cannot run.
+ *
+ * @param[in] file
+ *            Open file structure
+ * @param[in] b
+ *            Index of the streaming buffer
+ * @param[in] loc
+ *            Offset within the file of the block to prefetch (8-byte aligned)
+ */
+static void stream_prefetch(open_file_t *file, int b, uint32_t loc)
+{
+    if(loc >= file->size || file->stream_loc[b] == loc || file->stream_pending[b] ||
+       !interrupts_serviced())
+    {
+        /* Without interrupts, the block is read synchronously when needed */
+        return;
+    }
+
+    uint8_t *data = file->stream_data + b * file->stream_size;
+    data_cache_hit_invalidate(data, file->stream_size);
+
+    file->stream_loc[b] = loc;
+    file->stream_pending[b] = 1;
+
+    if(async_read_queue(file->cart_start_loc + loc, data, file->stream_size,
+                        stream_prefetch_done, (void *)&file->stream_pending[b]) != DFS_ESUCCESS)
+    {
+        /* Queue full, we will read it when needed */
+        file->stream_pending[b] = 0;
+        file->stream_loc[b] = 0xFFFFFFFF;
+    }
+}
+
+/**
+ * @brief Read data from a file through its streaming window
+ *
+ * The window is made of two buffers: while one is being consumed, the
+ * following block of the file is prefetched into the other one, so that
+ * sequential reads rarely have to wait for the PI.
+ *
+ * @param[in]  file
+ *             Open file structure with streaming enabled
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  to_read
+ *             Number of bytes to read (already clamped to the file size)
+ *
+ * @return The actual number of bytes read.
+ */
+static int read_streaming(open_file_t *file, uint8_t *buf, int to_read)
+{
+    int did_read = 0;
+
+    while(to_read)
+    {
+        int b = stream_find(file, file->loc);
+
+        if(b < 0)
+        {
+            /* Not in the window (first read, or after a seek): read it now */
+            b = file->stream_pending[0] ? 1 : 0;
+            stream_wait(file, b);
+
+            uint8_t *data = file->stream_data + b * file->stream_size;
+            file->stream_loc[b] = file->loc & ~7;
+            data_cache_hit_invalidate(data, file->stream_size);
+            dma_read((void *)(((uint32_t)data) & 0x1FFFFFFF),
+                file->cart_start_loc + file->stream_loc[b], file->stream_size);
+
+            file->stream_stats.misses++;
+        }
+        else if(file->stream_pending[b])
+        {
+            /* Prefetched, but not arrived yet */
+            stream_wait(file, b);
+            file->stream_stats.waits++;
+        }
+        else
+        {
+            file->stream_stats.hits++;
+        }
+
+        /* Pull as much data as we can from the current buffer */
+        uint32_t offset = file->loc - file->stream_loc[b];
+        int copy = MIN((int)(file->stream_size - offset), to_read);
+
+        memcpy(buf, file->stream_data + b * file->stream_size + offset, copy);
+
+        file->loc += copy;
+        buf += copy;
+        to_read -= copy;
+        did_read += copy;
+
+        /* Keep the following block coming */
+        stream_prefetch(file, b ^ 1, file->stream_loc[b] + file->stream_size);
+    }
+
+    return did_read;
+}
+
+/**
+ * @brief Read data from a file
+ *
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  size
+ *             Size of each element to read
+ * @param[in]  count
+ *             Number of elements to read
+ * @param[in]  handle
+ *             A valid file handle as returned from #dfs_open.
+ *
+ * @return The actual number of bytes read or a negative value on failure.
+ */
+int dfs_read(void * const buf, int size, int count, uint32_t handle)
+{
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
+    /* This is where we do all the work */
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    /* What are they doing? */
+    if(!buf)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    int to_read = size * count;
+    int did_read = 0;
+
+    /* Bounds check to make sure we don't read past the end */
+    if(file->loc + to_read > file->size)
+    {
+        /* It will, lets shorten it */
+        to_read = file->size - file->loc;
+    }
+
+    if (!to_read)
+        return 0;
+
+    if (trace_enabled && file->trace_path)
+        debugf("dfs-trace: read %s %lu %d\n", file->trace_path, file->loc, to_read);
+
+    if (file->chunk_data)
+        return read_compressed(file, buf, to_read);
+
+    /* With streaming enabled, only large aligned reads bypass the window */
+    if (file->stream_data &&
+        (to_read < file->stream_size || !can_dma_directly(file->loc, buf, to_read)))
+        return read_streaming(file, buf, to_read);
+
+    /* Fast-path: DMA directly into the destination buffer. */
+    if (can_dma_directly(file->loc, buf, to_read))
+    {
+        invalidate_dma_buffer(buf, to_read);
+
+        dma_read((void *)(((uint32_t)buf) & 0x1FFFFFFF),
+            file->cart_start_loc + file->loc, to_read);
+
+        file->loc += to_read;
+        return to_read;
+    }
+
+    /* Large misaligned reads: let the DMA layer realign the data in bulk,
+     * rather than copying it through the cached buffer 512 bytes at a time.
+     * dma_read_any uses a global scratch area, so it cannot be used from
+     * interrupt handlers. */
+    if (to_read >= (int)sizeof(file->cached_data) && !in_interrupt_handler())
+    {
+        dma_read_any(buf, ((file->cart_start_loc + file->loc) | 0x10000000) & 0x1FFFFFFF, to_read);
+
+        file->loc += to_read;
+        return to_read;
+    }
+
+    /* Something we can actually increment! */
+    uint8_t *data = buf;
+    const int CACHED_SIZE = sizeof(file->cached_data);
+
+    /* Loop in, reading data in the cached buffer */
+    while(to_read)
+    {
+        /* Check if we need to read into the cached buffer */
+        if (file->loc < file->cached_loc || file->loc >= file->cached_loc+CACHED_SIZE)
+        {
+            /* We need to read from a 8-byte aligned location, so calculate it */
+            file->cached_loc = file->loc & ~7;
+
+            /* Invalidate the cached data. No need to writeback here because
+               CACHE_SIZE is a multiple of 16 bytes and the data is aligned,
+               so the cachelines are not shared with other variables. */
+            data_cache_hit_invalidate(file->cached_data, CACHED_SIZE);
+
+            dma_read((void *)(((uint32_t)file->cached_data) & 0x1FFFFFFF),
+                file->cart_start_loc + file->cached_loc, CACHED_SIZE);
+        }
+
+        /* Pull as much data as we can from the current buffer */
+        int copy = file->cached_loc+CACHED_SIZE - file->loc;
+        if (copy > to_read)
+            copy = to_read;
+
+        memcpy(data, file->cached_data + (file->loc - file->cached_loc), copy);
+
+        file->loc += copy;
+        data += copy;
+        to_read -= copy;
+        did_read += copy;
+    }
+
+    return did_read;
+}
+
+/** @brief A transfer of a vectored read (see #dfs_readv) */
+typedef struct
+{
+    /** @brief Offset within the file */
+    uint32_t loc;
+    /** @brief Number of bytes to read */
+    uint32_t len;
+    /** @brief Buffer to read into */
+    uint8_t *buf;
+} readv_run_t;
+
+/**
+ * @brief Callback counting the completed transfers of a vectored read
+ *
+ * @param[in] len
+ *            Number of bytes read
+ * @param[in] ctx
+ *            Pointer to the counter of pending transfers
+ */
+static void readv_done(int len, void *ctx)
+{
+    (*(volatile int *)ctx)--;
+}
+
+/**
+ * @brief Read multiple ranges of a file
+ *
+ * Each range of the vector specifies an offset within the file, a length, and
+ * the buffer where to store the data.  This is faster than a sequence of
+ * #dfs_seek and #dfs_read, as the ranges are sorted by offset, contiguous
+ * ranges read into contiguous buffers are merged, the cache of all the buffers
+ * is invalidated in one go, and all the DMA transfers are queued back to back
+ * so that the PI never sits idle waiting for the CPU.
+ *
+ * Misaligned ranges are handled by the PI queue (see #dma_queue_read), which
+ * reads through a bounce buffer only the bytes that cannot be transferred
+ * directly.  Ranges past the end of the file are shortened.  The current
+ * location of the file is not changed.
+ *
+ * The PI queue relies on interrupts: if they are disabled, or this function
+ * is called from an interrupt handler, the ranges are read synchronously
+ * via #dfs_read instead.
+ *
+ * @param[in] handle
+ *            A valid file handle as returned from #dfs_open.
+ * @param[in] iov
+ *            Array of ranges to read
+ * @param[in] n
+ *            Number of ranges in iov
+ *
+ * @return The total number of bytes read or a negative value on failure.
+ */
+int dfs_readv(uint32_t handle, fs_iovec_t *iov, int n)
+{
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    if(n < 0 || (n && !iov))
+    {
+        return DFS_EBADINPUT;
+    }
+
+    int total = 0;
+
+    /* Compressed and streaming files have their own buffering, and the PI
+     * queue is driven by interrupts: if they cannot be serviced (disabled, or
+     * we are within a handler), just read each range in turn */
+    if(file->chunk_data || file->stream_data || !interrupts_serviced())
+    {
+        uint32_t loc = file->loc;
+
+        for(int i = 0; i < n; i++)
+        {
+            file->loc = iov[i].offset < file->size ? iov[i].offset : file->size;
+            int len = MIN(iov[i].len, file->size - file->loc);
+
+            int ret = dfs_read(iov[i].buf, 1, len, handle);
+            if(ret < 0)
+            {
+                total = ret;
+                break;
+            }
+
+            total += ret;
+
+            if(ret < len)
+            {
+                /* Short read */
+                break;
+            }
+        }
+
+        file->loc = loc;
+        return total;
+    }
+
+    /* Each range becomes a transfer, unless it can be merged with the previous one */
+    readv_run_t runs_stack[16];
+    int order_stack[16];
+    readv_run_t *runs = runs_stack;
+    int *order = order_stack;
+
+    if(n > 16)
+    {
+        runs = malloc(n * (sizeof(readv_run_t) + sizeof(int)));
+        if(!runs)
+        {
+            return DFS_ENOMEM;
+        }
+        order = (int *)(runs + n);
+    }
+
+    /* Sort the ranges by offset (insertion sort: vectors are short and
+     * usually already sorted) */
+    for(int i = 0; i < n; i++)
+    {
+        int j = i;
+        while(j > 0 && iov[order[j - 1]].offset > iov[i].offset)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    int num_runs = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        fs_iovec_t *v = &iov[order[i]];
+        uint32_t loc = v->offset;
+        uint32_t len = v->len;
+
+        if(loc >= file->size) { continue; }
+        if(len > file->size - loc) { len = file->size - loc; }
+        if(!len) { continue; }
+
+        if(trace_enabled && file->trace_path)
+        {
+            debugf("dfs-trace: read %s %lu %lu\n", file->trace_path, loc, len);
+        }
+
+        total += len;
+
+        if(num_runs)
+        {
+            readv_run_t *prev = &runs[num_runs - 1];
+            if(prev->loc + prev->len == loc && prev->buf + prev->len == (uint8_t *)v->buf)
+            {
+                prev->len += len;
+                continue;
+            }
+        }
+
+        runs[num_runs].loc = loc;
+        runs[num_runs].len = len;
+        runs[num_runs].buf = v->buf;
+        num_runs++;
+    }
+
+    /* Prepare the cache of all the buffers before starting any transfer */
+    for(int r = 0; r < num_runs; r++)
+    {
+        invalidate_dma_buffer(runs[r].buf, runs[r].len);
+    }
+
+    volatile int pending = num_runs;
+
+    for(int r = 0; r < num_runs; r++)
+    {
+        /* If the queue is full, wait for some transfer to finish */
+        while(async_read_queue(file->cart_start_loc + runs[r].loc, runs[r].buf, runs[r].len,
+                               readv_done, (void *)&pending) == DFS_ENOMEM) {}
+    }
+
+    while(pending) {}
+
+    if(runs != runs_stack)
+    {
+        free(runs);
+    }
+
+    return total;
+}
+
+/**
+ * @brief Read data from a file asynchronously
+ *
+ * Queue a read from the current location of the file, and return immediately.
+ * The data is transferred via DMA in the background, while the CPU keeps running;
+ * once the read is complete, the callback is invoked.  Multiple reads (from the
+ * same or different files) can be queued at the same time; they are executed in
+ * order.  The file location is advanced immediately, so that subsequent reads
+ * continue where this one ends.
+ *
+ * Reads are executed by the PI queue (see #dma_queue_read) with normal
+ * priority.  Reads into 8-byte aligned buffers from even offsets DMA directly
+ * into the destination buffer; misaligned reads go partially or entirely
+ * through a bounce buffer, which is slower.  Compressed
+ * files are read and decompressed synchronously, and the callback is invoked
+ * before this function returns.
+ *
+ * @note The callback is invoked from within the PI interrupt handler, so it
+ *       should be short.  It can queue further reads.
+ * @note The contents of the buffer are undefined until the callback is
+ *       invoked.  Do not access it from the CPU meanwhile.
+ *
+ * @param[in]  handle
+ *             A valid file handle as returned from #dfs_open.
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  len
+ *             Number of bytes to read
+ * @param[in]  cb
+ *             Callback to invoke when the read is complete (can be NULL).  It receives
+ *             the number of bytes read and ctx.
+ * @param[in]  ctx
+ *             Opaque pointer passed to the callback
+ *
+ * @return The number of bytes that will be read (shortened at the end of the file),
+ *         or a negative value on failure, in which case the callback is not called.
+ */
+int dfs_read_async(uint32_t handle, void * const buf, int len, dfs_read_cb_t cb, void *ctx)
+{
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
+    open_file_t *file = find_open_file(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    if(!buf || len < 0)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    if(file->chunk_data)
+    {
+        /* Compressed files are decompressed by the CPU anyway */
+        int ret = dfs_read(buf, 1, len, handle);
+        if(ret >= 0 && cb) { cb(ret, ctx); }
+        return ret;
+    }
+
+    int to_read = len;
+
+    /* Bounds check to make sure we don't read past the end */
+    if(file->loc + to_read > file->size)
     {
-        return DFS_EBADHANDLE;
+        to_read = file->size - file->loc;
     }
 
-    /* Closing the handle is easy as zeroing out the file */
-    memset(file, 0, sizeof(open_file_t));
+    if(!to_read)
+    {
+        /* Nothing to do, complete right away */
+        if(cb) { cb(0, ctx); }
+        return 0;
+    }
 
-    return DFS_ESUCCESS;
+    if(trace_enabled && file->trace_path)
+    {
+        debugf("dfs-trace: read %s %lu %d\n", file->trace_path, file->loc, to_read);
+    }
+
+    invalidate_dma_buffer(buf, to_read);
+
+    int ret = async_read_queue(file->cart_start_loc + file->loc, buf, to_read, cb, ctx);
+
+    if(ret != DFS_ESUCCESS)
+    {
+        return ret;
+    }
+
+    file->loc += to_read;
+    return to_read;
 }
 
 /**
- * @brief Seek to an offset in the file
+ * @brief Enable streaming mode on an open file
+ *
+ * Files that are read sequentially in small pieces (eg: parsed with fread)
+ * benefit from streaming mode: reads are served from a window made of two
+ * buffers, and while one buffer is consumed, the following block of the file
+ * is prefetched into the other one via #dfs_read_async machinery.  Reads that
+ * are at least as large as a buffer and satisfy the DMA alignment rules still
+ * go directly into the destination buffer.
+ *
+ * Streaming is not available for compressed files, which are already read in
+ * chunks.
  *
  * @param[in] handle
  *            A valid file handle as returned from #dfs_open.
- * @param[in] offset
- *            A byte offset from the origin to seek from.
- * @param[in] origin
- *            An offset to seek from.  Either `SEEK_SET`, `SEEK_CUR` or `SEEK_END`.
- *  
+ * @param[in] window_size
+ *            Size in bytes of each of the two buffers (rounded up to 16 bytes),
+ *            eg: #DFS_DEFAULT_STREAM_WINDOW, or 0 to disable streaming.
+ *
  * @return DFS_ESUCCESS on success or a negative value on error.
  */
-int dfs_seek(uint32_t handle, int offset, int origin)
+int dfs_stream_enable(uint32_t handle, int window_size)
 {
     open_file_t *file = find_open_file(handle);
 
@@ -837,73 +2443,49 @@ int dfs_seek(uint32_t handle, int offset, int origin)
         return DFS_EBADHANDLE;
     }
 
-    switch(origin)
+    if(window_size < 0 || file->chunk_data)
     {
-        case SEEK_SET:
-            /* From the beginning */
-            if(offset < 0)
-            { 
-                file->loc = 0; 
-            }
-            else
-            {
-                file->loc = offset;
-            }
-
-            break;
-        case SEEK_CUR:
-        {
-            /* From the current position */
-            int new_offset = (int)file->loc + offset;
-
-            if(new_offset < 0)
-            {
-                new_offset = 0;
-            }
-
-            file->loc = new_offset;
-
-            break;
-        }
-        case SEEK_END:
-        {
-            /* From the end of the file */
-            int new_offset = (int)file->size + offset;
-
-            if(new_offset < 0)
-            {
-                new_offset = 0;
-            }
+        return DFS_EBADINPUT;
+    }
 
-            file->loc = new_offset;
+    stream_wait(file, 0);
+    stream_wait(file, 1);
+    free(file->stream_data);
+    file->stream_data = 0;
+    file->stream_size = 0;
 
-            break;
-        }
-        default:
-            /* Impossible */
-            return DFS_EBADINPUT;
+    if(!window_size)
+    {
+        return DFS_ESUCCESS;
     }
 
-    /* Lets get some bounds checking */
-    if(file->loc > file->size)
+    uint32_t size = ROUND_UP(window_size, 16);
+    file->stream_data = memalign(16, size * 2);
+
+    if(!file->stream_data)
     {
-        file->loc = file->size;
+        return DFS_ENOMEM;
     }
 
+    file->stream_size = size;
+    file->stream_loc[0] = file->stream_loc[1] = 0xFFFFFFFF;
+    memset(&file->stream_stats, 0, sizeof(file->stream_stats));
+
     return DFS_ESUCCESS;
 }
 
 /**
- * @brief Return the current offset into a file
+ * @brief Get the streaming statistics of an open file
  *
- * @param[in] handle
- *            A valid file handle as returned from #dfs_open.
+ * @param[in]  handle
+ *             A valid file handle as returned from #dfs_open.
+ * @param[out] stats
+ *             Structure to fill with the statistics
  *
- * @return The current byte offset into a file or a negative error on failure.
+ * @return DFS_ESUCCESS on success or a negative value on error.
  */
-int dfs_tell(uint32_t handle)
+int dfs_stream_get_stats(uint32_t handle, dfs_stream_stats_t *stats)
 {
-    /* The good thing is that the location is always in the file structure */
     open_file_t *file = find_open_file(handle);
 
     if(!file)
@@ -911,26 +2493,55 @@ int dfs_tell(uint32_t handle)
         return DFS_EBADHANDLE;
     }
 
-    return file->loc;
+    *stats = file->stream_stats;
+    return DFS_ESUCCESS;
 }
 
 /**
- * @brief Read data from a file
+ * @brief Enable or disable tracing of file accesses
+ *
+ * While tracing is enabled, every file opened with #dfs_open (or via the
+ * "rom:/" prefix) and every read from it is logged on the debug channel
+ * (see #debugf), with lines like:
+ *
+ *     dfs-trace: open levels/1/map.bin
+ *     dfs-trace: read levels/1/map.bin 0 4096
+ *
+ * where reads report the offset within the file and the length.  The log can
+ * be passed to 'mkdfs --layout' to place the contents of the files in the
+ * image in the order they are accessed.  Only files opened while tracing is
+ * enabled are traced.
+ *
+ * @note Paths are traced as relative to the current directory, which is the
+ *       root for files opened via the "rom:/" prefix.
+ *
+ * @param[in] enable
+ *            true to enable tracing, false to disable it
+ */
+void dfs_trace_enable(bool enable)
+{
+    trace_enabled = enable;
+}
+
+/**
+ * @brief Get the location of the contents of an open file in PI address space
+ *
+ * This is a handle-based alternative to #dfs_rom_addr, for code that wants to
+ * transfer data from ROM by itself (eg: straight into the buffers used by the
+ * RSP or the RDP, avoiding an intermediate copy), using #dfs_extent_read,
+ * #dfs_extent_read_dmem, or the DMA functions directly.
+ *
+ * Compressed files have no extent, as their contents are not stored as is.
  *
- * @param[out] buf
- *             Buffer to read into
- * @param[in]  size
- *             Size of each element to read
- * @param[in]  count
- *             Number of elements to read
  * @param[in]  handle
  *             A valid file handle as returned from #dfs_open.
+ * @param[out] extent
+ *             Structure to fill with the location of the file
  *
- * @return The actual number of bytes read or a negative value on failure.
+ * @return DFS_ESUCCESS on success or a negative value on error.
  */
-int dfs_read(void * const buf, int size, int count, uint32_t handle)
+int dfs_extent(uint32_t handle, dfs_extent_t *extent)
 {
-    /* This is where we do all the work */
     open_file_t *file = find_open_file(handle);
 
     if(!file)
@@ -938,92 +2549,159 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
         return DFS_EBADHANDLE;
     }
 
-    /* What are they doing? */
-    if(!buf)
+    if(file->chunk_data)
     {
         return DFS_EBADINPUT;
     }
 
-    int to_read = size * count;
-    int did_read = 0;
+    extent->pi_address = (file->cart_start_loc | 0x10000000) & 0x1FFFFFFF;
+    extent->size = file->size;
 
-    /* Bounds check to make sure we don't read past the end */
-    if(file->loc + to_read > file->size)
+    /* Files start at a sector boundary within the image, which is itself aligned in ROM */
+    extent->alignment = extent->pi_address & -extent->pi_address;
+    if(extent->alignment > SECTOR_SIZE)
     {
-        /* It will, lets shorten it */
-        to_read = file->size - file->loc;
+        extent->alignment = SECTOR_SIZE;
     }
 
-    if (!to_read)
-        return 0;
+    return DFS_ESUCCESS;
+}
 
-    /* Fast-path. If possibly, we want to DMA directly into the destination
-     * buffer, without using any intermediate buffers. The rules are convoluted
-     * because we try to squeeze maximum performance here and thus we rely also
-     * on undocumented behaviors of PI DMA.
-     * The rules we follow are:
-     *
-     *   * The RDRAM destination pointer must be 8-bytes aligned.
-     *   * The ROM location must be 2-bytes aligned.
-     *   * The length must be either less than 0x7F (all values accepted),
-     *     or even.
-     */
-    bool rom_aligned = (file->loc & 1) == 0;
-    bool ram_aligned = ((uint32_t)buf & 7) == 0;
-    bool len_aligned = (to_read < 0x7F) || ((to_read & 1) == 0);
-    if (rom_aligned && ram_aligned && len_aligned)
-    {
-        /* 16-byte alignment: we can simply invalidate the buffer.
-         * 8-byte alignment: we need to also writeback in case the partial
-         *  cachelines have hot data to write back. */
-        if ((((uint32_t)buf | to_read) & 15) == 0)
-            data_cache_hit_invalidate(buf, to_read);
-        else
-            data_cache_hit_writeback_invalidate(buf, to_read);
+/**
+ * @brief Read a range of a file extent into RDRAM
+ *
+ * The data is transferred with a single PI DMA straight into the buffer, which
+ * can be for instance the buffer of a surface or a sample buffer.  The buffer
+ * must have the same 2-byte alignment as the PI address being read
+ * (`extent->pi_address + offset`); 8-byte aligned buffers and even offsets are
+ * the fastest option.
+ *
+ * @param[in]  extent
+ *             Extent as returned by #dfs_extent
+ * @param[in]  offset
+ *             Offset within the file of the first byte to read
+ * @param[out] buf
+ *             Buffer to read into
+ * @param[in]  len
+ *             Number of bytes to read
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_extent_read(const dfs_extent_t *extent, uint32_t offset, void *buf, uint32_t len)
+{
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
 
-        dma_read((void *)(((uint32_t)buf) & 0x1FFFFFFF),
-            file->cart_start_loc + file->loc, to_read);
+    if(offset > extent->size || len > extent->size - offset)
+    {
+        return DFS_EBADINPUT;
+    }
 
-        file->loc += to_read;
-        return to_read;
+    uint32_t pi_address = extent->pi_address + offset;
+
+    if((pi_address ^ (uint32_t)buf) & 1)
+    {
+        /* The PI cannot shift data by one byte */
+        return DFS_EBADINPUT;
     }
 
-    /* Something we can actually increment! */
-    uint8_t *data = buf;
-    const int CACHED_SIZE = sizeof(file->cached_data);
+    if(!len)
+    {
+        return DFS_ESUCCESS;
+    }
 
-    /* Loop in, reading data in the cached buffer */
-    while(to_read)
+    data_cache_hit_writeback_invalidate(buf, len);
+    dma_read(buf, pi_address, len);
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Read a range of a file extent into RSP DMEM
+ *
+ * The PI can only transfer data to RDRAM, so the data is read into a staging
+ * buffer provided by the caller, and then a DMA to DMEM is enqueued in the RSP
+ * queue via #rspq_dma_to_dmem.  The transfer to DMEM thus happens in order
+ * with the other commands in the queue.
+ *
+ * @note The staging buffer must stay valid until the RSP has executed the
+ *       transfer (eg: until a following #rspq_syncpoint_new is reached).
+ *
+ * @param[in]  extent
+ *             Extent as returned by #dfs_extent
+ * @param[in]  offset
+ *             Offset within the file of the first byte to read (must be even)
+ * @param[in]  dmem_addr
+ *             DMEM address where to store the data (must be 8-byte aligned)
+ * @param[in]  len
+ *             Number of bytes to read (the DMA to DMEM is rounded up to 8 bytes)
+ * @param[in]  staging
+ *             RDRAM buffer of at least len bytes rounded up to 8 (must be 8-byte aligned)
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_extent_read_dmem(const dfs_extent_t *extent, uint32_t offset, uint32_t dmem_addr,
+                         uint32_t len, void *staging)
+{
+    if(((uint32_t)staging & 7) || (dmem_addr & 7) || (offset & 1) || !len)
     {
-        /* Check if we need to read into the cached buffer */
-        if (file->loc < file->cached_loc || file->loc >= file->cached_loc+CACHED_SIZE)
-        {
-            /* We need to read from a 8-byte aligned location, so calculate it */
-            file->cached_loc = file->loc & ~7;
+        return DFS_EBADINPUT;
+    }
 
-            /* Invalidate the cached data. No need to writeback here because
-               CACHE_SIZE is a multiple of 16 bytes and the data is aligned,
-               so the cachelines are not shared with other variables. */
-            data_cache_hit_invalidate(file->cached_data, CACHED_SIZE);
+    int ret = dfs_extent_read(extent, offset, staging, len);
 
-            dma_read((void *)(((uint32_t)file->cached_data) & 0x1FFFFFFF),
-                file->cart_start_loc + file->cached_loc, CACHED_SIZE);
-        }
+    if(ret != DFS_ESUCCESS)
+    {
+        return ret;
+    }
 
-        /* Pull as much data as we can from the current buffer */
-        int copy = file->cached_loc+CACHED_SIZE - file->loc;
-        if (copy > to_read)
-            copy = to_read;
+    rspq_dma_to_dmem(dmem_addr, staging, ROUND_UP(len, 8), false);
 
-        memcpy(data, file->cached_data + (file->loc - file->cached_loc), copy);
+    return DFS_ESUCCESS;
+}
 
-        file->loc += copy;
-        data += copy;
-        to_read -= copy;
-        did_read += copy;
+/**
+ * @brief Read pixel data from a file extent into a surface
+ *
+ * The file is expected to contain `surface->height` rows of packed pixels
+ * (in the format of the surface) starting at the specified offset.  Each row
+ * is transferred straight into the surface buffer, honoring its stride; when
+ * the stride matches the packed row size, the whole image is read with a
+ * single DMA.
+ *
+ * @param[in]  extent
+ *             Extent as returned by #dfs_extent
+ * @param[in]  offset
+ *             Offset within the file of the first pixel
+ * @param[out] surface
+ *             Surface to fill
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_extent_read_surface(const dfs_extent_t *extent, uint32_t offset, surface_t *surface)
+{
+    uint32_t row = TEX_FORMAT_PIX2BYTES(surface_get_format(surface), surface->width);
+
+    if(row == surface->stride)
+    {
+        return dfs_extent_read(extent, offset, surface->buffer, row * surface->height);
     }
 
-    return did_read;
+    if(offset > extent->size || row * surface->height > extent->size - offset)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    for(int y = 0; y < surface->height; y++)
+    {
+        int ret = dfs_extent_read(extent, offset + y * row, (uint8_t*)surface->buffer + y * surface->stride, row);
+
+        if(ret != DFS_ESUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    return DFS_ESUCCESS;
 }
 
 /**
@@ -1062,14 +2740,16 @@ int dfs_size(uint32_t handle)
  *            Name of the file
  *
  * @return A pointer to the physical address of the file body, or 0
- *         if the file was not found.
+ *         if the file was not found or is compressed.
  * 
  */
 uint32_t dfs_rom_addr(const char *path)
 {
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
     /* Try to find file */
     directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    int ret = find_file(path, &dirent);
 
     if(ret != DFS_ESUCCESS)
     {
@@ -1081,6 +2761,12 @@ uint32_t dfs_rom_addr(const char *path)
     directory_entry_t t_node;
     grab_sector(dirent, &t_node);
 
+    if(get_flags(&t_node) & FLAGS_COMPRESSED)
+    {
+        /* The contents of compressed files cannot be accessed directly */
+        return 0;
+    }
+
     /* Return the starting location in ROM */
     return get_start_location(&t_node);
 }
@@ -1214,6 +2900,23 @@ static int __close( void *file )
     return dfs_close( (uint32_t)file );
 }
 
+/**
+ * @brief Newlib-compatible vectored read
+ *
+ * @param[in] file
+ *            File pointer as returned by #__open
+ * @param[in] iov
+ *            Array of ranges to read
+ * @param[in] iovcnt
+ *            Number of ranges in iov
+ *
+ * @return The total number of bytes read or a negative value on failure.
+ */
+static int __readv( void *file, fs_iovec_t *iov, int iovcnt )
+{
+    return dfs_readv( (uint32_t)file, iov, iovcnt );
+}
+
 /**
  * @brief Newlib-compatible findfirst
  *
@@ -1299,7 +3002,8 @@ static filesystem_t dragon_fs = {
     __close,
     0,
     __findfirst,
-    __findnext
+    __findnext,
+    __readv
 };
 
 /**
@@ -1353,9 +3057,47 @@ static void __dfs_check_emulation(void)
  */
 int dfs_init(uint32_t base_fs_loc)
 {
+    return dfs_init_ex( base_fs_loc, NULL );
+}
+
+/**
+ * @brief Initialize the filesystem with a custom configuration.
+ *
+ * This is like #dfs_init, but allows to configure DragonFS, for instance to
+ * allow more files to be open at the same time.  Any file open on a
+ * previously initialized image is closed.
+ *
+ * @param[in] base_fs_loc
+ *            Virtual address in cartridge space at which to find the filesystem, or
+ *            DFS_DEFAULT_LOCATION to automatically search for the filesystem in the
+ *            cartridge (using the rompak).
+ * @param[in] config
+ *            Configuration, or NULL to use the defaults.
+ *
+ * @return DFS_ESUCCESS on success or a negative error otherwise.
+ */
+int dfs_init_ex(uint32_t base_fs_loc, const dfs_config_t *config)
+{
+    DMA_STATS_TAG_SCOPE(DMA_TAG_DFS);
+
+    int max_files = (config && config->max_open_files) ? config->max_open_files : DFS_DEFAULT_MAX_OPEN_FILES;
+
+    if( max_files < 0 || max_files > DFS_MAX_OPEN_FILES_LIMIT )
+    {
+        return DFS_EBADINPUT;
+    }
+
+    max_open_files = max_files;
+
     /* Detect if we are running on emulator accurate enough to emulate DragonFS. */
     __dfs_check_emulation();
 
+    if( !sector_cache_configured )
+    {
+        /* Allocate the default sector cache, unless the application chose a size */
+        dfs_set_sector_cache( DFS_DEFAULT_SECTOR_CACHE_SIZE );
+    }
+
     if( base_fs_loc == DFS_DEFAULT_LOCATION )
     {
         /* Search for the DFS image location in the ROM */
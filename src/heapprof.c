@@ -0,0 +1,317 @@
+/**
+ * @file heapprof.c
+ * @brief Heap profiler
+ * @ingroup lowlevel
+ *
+ * The profiler is implemented by wrapping the reentrant heap functions of
+ * newlib (_malloc_r, _free_r, ...) at link time (ld --wrap). All the public
+ * heap functions funnel into them, and so do newlib internal allocations
+ * (eg: stdio buffers, strdup). The wrappers forward to the real functions,
+ * and when the profiler is active they update the global counters and, for
+ * sampled allocations, record the call site via #backtrace.
+ *
+ * Sampled allocations are tracked in an open-addressing hash table keyed by
+ * pointer, so that a free can be attributed back to the site that allocated
+ * the memory. All the profiler memory is static: the profiler never allocates
+ * from the heap it is observing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <malloc.h>
+#include <reent.h>
+#include "heapprof.h"
+#include "backtrace.h"
+#include "debug.h"
+
+/** @brief Size of the table of live sampled allocations (power of 2) */
+#define HEAPPROF_MAX_SAMPLES        2048
+/** @brief Stack frames of the profiler itself (sample_add, track_alloc, wrapper) */
+#define HEAPPROF_SKIP_FRAMES        3
+
+/** @brief A call site that allocated memory */
+typedef struct {
+    void *frames[HEAPPROF_SITE_DEPTH];  ///< Call stack of the site
+    uint32_t num_allocs;                ///< Sampled allocations made by the site
+    uint32_t live_bytes;                ///< Sampled bytes currently allocated by the site
+    uint32_t peak_bytes;                ///< Value of live_bytes when the heap usage peaked
+} heapprof_site_t;
+
+/** @brief A live sampled allocation */
+typedef struct {
+    void *ptr;                          ///< Pointer returned to the caller (NULL: empty entry)
+    uint32_t size;                      ///< Usable size of the allocation
+    int site;                           ///< Index of the site in #sites
+} heapprof_sample_t;
+
+void *__real__malloc_r(struct _reent *r, size_t size);
+void *__real__calloc_r(struct _reent *r, size_t num, size_t size);
+void *__real__realloc_r(struct _reent *r, void *ptr, size_t size);
+void *__real__memalign_r(struct _reent *r, size_t align, size_t size);
+void __real__free_r(struct _reent *r, void *ptr);
+
+/** @brief True if the profiler is active */
+static bool enabled;
+/** @brief Nesting level of the wrappers: the real functions call each other
+ *         (eg: _realloc_r might call _malloc_r), which must not be accounted twice */
+static int nested;
+/** @brief True while the profiler itself is running (disables sampling) */
+static bool busy;
+/** @brief Sampling rate */
+static int sample_rate;
+/** @brief Allocations left before the next sample */
+static int sample_countdown;
+/** @brief Global statistics */
+static heapprof_stats_t stats;
+/** @brief Known call sites */
+static heapprof_site_t sites[HEAPPROF_MAX_SITES];
+/** @brief Number of used entries in #sites */
+static int num_sites;
+/** @brief Live sampled allocations */
+static heapprof_sample_t samples[HEAPPROF_MAX_SAMPLES];
+
+/** @brief Hash a pointer into the sample table */
+static inline int sample_hash(void *ptr)
+{
+    return ((uint32_t)ptr >> 3) * 2654435761u >> (32 - __builtin_ctz(HEAPPROF_MAX_SAMPLES));
+}
+
+/** @brief Find the site with the given call stack, or create it */
+static int site_lookup(void **frames)
+{
+    for (int i = 0; i < num_sites; i++)
+        if (!memcmp(sites[i].frames, frames, sizeof(sites[i].frames)))
+            return i;
+    if (num_sites == HEAPPROF_MAX_SITES)
+        return -1;
+    heapprof_site_t *s = &sites[num_sites];
+    memcpy(s->frames, frames, sizeof(s->frames));
+    s->num_allocs = s->live_bytes = s->peak_bytes = 0;
+    return num_sites++;
+}
+
+/** @brief Record a sampled allocation */
+__attribute__((noinline))
+static void sample_add(void *ptr, uint32_t size)
+{
+    void *frames[HEAPPROF_SKIP_FRAMES+HEAPPROF_SITE_DEPTH] = {0};
+    backtrace(frames, HEAPPROF_SKIP_FRAMES+HEAPPROF_SITE_DEPTH);
+
+    int site = site_lookup(frames+HEAPPROF_SKIP_FRAMES);
+    if (site < 0) {
+        stats.num_dropped++;
+        return;
+    }
+
+    int idx = sample_hash(ptr);
+    for (int i = 0; i < HEAPPROF_MAX_SAMPLES; i++) {
+        heapprof_sample_t *s = &samples[(idx+i) & (HEAPPROF_MAX_SAMPLES-1)];
+        if (!s->ptr) {
+            s->ptr = ptr;
+            s->size = size;
+            s->site = site;
+            sites[site].num_allocs++;
+            sites[site].live_bytes += size;
+            stats.num_sampled++;
+            return;
+        }
+    }
+    stats.num_dropped++;
+}
+
+/** @brief Remove a sampled allocation (if the pointer was sampled) */
+static void sample_remove(void *ptr)
+{
+    int mask = HEAPPROF_MAX_SAMPLES-1;
+    int idx = sample_hash(ptr);
+    for (int i = 0; i < HEAPPROF_MAX_SAMPLES; i++, idx = (idx+1) & mask) {
+        heapprof_sample_t *s = &samples[idx];
+        if (!s->ptr)
+            return;
+        if (s->ptr != ptr)
+            continue;
+
+        sites[s->site].live_bytes -= s->size;
+        s->ptr = NULL;
+
+        // Backward-shift deletion: move back the following entries of the
+        // cluster that would not be reachable anymore from their home slot.
+        int hole = idx;
+        for (int j = (idx+1) & mask; samples[j].ptr; j = (j+1) & mask) {
+            int home = sample_hash(samples[j].ptr);
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                samples[hole] = samples[j];
+                samples[j].ptr = NULL;
+                hole = j;
+            }
+        }
+        return;
+    }
+}
+
+/** @brief Account a new allocation */
+__attribute__((noinline))
+static void track_alloc(void *ptr)
+{
+    if (!ptr) return;
+    uint32_t usable = malloc_usable_size(ptr);
+    stats.num_allocs++;
+    stats.live_bytes += usable;
+
+    if (!busy && --sample_countdown == 0) {
+        sample_countdown = sample_rate;
+        busy = true;
+        sample_add(ptr, usable);
+        busy = false;
+    }
+
+    if (stats.live_bytes > stats.peak_bytes) {
+        // Snapshot the ownership of the heap at peak
+        stats.peak_bytes = stats.live_bytes;
+        for (int i = 0; i < num_sites; i++)
+            sites[i].peak_bytes = sites[i].live_bytes;
+    }
+}
+
+/** @brief Account the release of an allocation */
+static void track_free(void *ptr)
+{
+    if (!ptr) return;
+    stats.num_frees++;
+    stats.live_bytes -= malloc_usable_size(ptr);
+    sample_remove(ptr);
+}
+
+/** @cond */
+void *__wrap__malloc_r(struct _reent *r, size_t size)
+{
+    nested++;
+    void *ptr = __real__malloc_r(r, size);
+    nested--;
+    if (enabled && !nested) track_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap__calloc_r(struct _reent *r, size_t num, size_t size)
+{
+    nested++;
+    void *ptr = __real__calloc_r(r, num, size);
+    nested--;
+    if (enabled && !nested) track_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap__memalign_r(struct _reent *r, size_t align, size_t size)
+{
+    nested++;
+    void *ptr = __real__memalign_r(r, align, size);
+    nested--;
+    if (enabled && !nested) track_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap__realloc_r(struct _reent *r, void *ptr, size_t size)
+{
+    if (!enabled || nested) {
+        nested++;
+        void *newptr = __real__realloc_r(r, ptr, size);
+        nested--;
+        return newptr;
+    }
+
+    // Account the reallocation as a free followed by an allocation. The old
+    // usable size must be read before the block is released.
+    if (ptr) track_free(ptr);
+    nested++;
+    void *newptr = __real__realloc_r(r, ptr, size);
+    nested--;
+    if (!newptr && ptr && size) {
+        // The original block is still valid: account it back (unattributed)
+        stats.num_frees--;
+        stats.live_bytes += malloc_usable_size(ptr);
+        return NULL;
+    }
+    track_alloc(newptr);
+    return newptr;
+}
+
+void __wrap__free_r(struct _reent *r, void *ptr)
+{
+    if (enabled && !nested) track_free(ptr);
+    nested++;
+    __real__free_r(r, ptr);
+    nested--;
+}
+/** @endcond */
+
+void heapprof_init(int sample_rate_)
+{
+    assertf(sample_rate_ >= 1, "invalid sample rate: %d", sample_rate_);
+
+    enabled = false;
+    memset(&stats, 0, sizeof(stats));
+    memset(samples, 0, sizeof(samples));
+    num_sites = 0;
+    sample_rate = sample_countdown = sample_rate_;
+
+    // Start from the current heap usage, so that frees of memory allocated
+    // before the profiler was started are accounted correctly.
+    stats.live_bytes = stats.peak_bytes = mallinfo().uordblks;
+    enabled = true;
+}
+
+void heapprof_close(void)
+{
+    enabled = false;
+}
+
+void heapprof_get_stats(heapprof_stats_t *out)
+{
+    *out = stats;
+}
+
+void heapprof_dump(void)
+{
+    // Do not sample allocations made by stdio while printing the report
+    busy = true;
+
+    fprintf(stderr, "heapprof: live %lu bytes, peak %lu bytes, %lu allocs, %lu frees\n",
+        stats.live_bytes, stats.peak_bytes, stats.num_allocs, stats.num_frees);
+    fprintf(stderr, "heapprof: %lu sampled allocations (1 every %d), %lu dropped, %d sites\n",
+        stats.num_sampled, sample_rate, stats.num_dropped, num_sites);
+
+    // Sort the sites by ownership at peak
+    uint16_t order[HEAPPROF_MAX_SITES];
+    for (int i = 0; i < num_sites; i++)
+        order[i] = i;
+    int cmp(const void *a, const void *b) {
+        const heapprof_site_t *sa = &sites[*(const uint16_t*)a];
+        const heapprof_site_t *sb = &sites[*(const uint16_t*)b];
+        if (sa->peak_bytes != sb->peak_bytes)
+            return sa->peak_bytes < sb->peak_bytes ? 1 : -1;
+        return sa->live_bytes < sb->live_bytes ? 1 : sa->live_bytes > sb->live_bytes ? -1 : 0;
+    }
+    qsort(order, num_sites, sizeof(order[0]), cmp);
+
+    fprintf(stderr, "   at peak      live    allocs  site\n");
+    for (int i = 0; i < num_sites; i++) {
+        heapprof_site_t *s = &sites[order[i]];
+        fprintf(stderr, "%10lu%10lu%10lu  ", s->peak_bytes, s->live_bytes, s->num_allocs);
+
+        int depth = 0;
+        while (depth < HEAPPROF_SITE_DEPTH && s->frames[depth]) depth++;
+
+        bool first = true;
+        void cb(void *arg, backtrace_frame_t *frame) {
+            if (!first) fprintf(stderr, "%34s", "<- ");
+            backtrace_frame_print_compact(frame, stderr, 60);
+            fprintf(stderr, "\n");
+            first = false;
+        }
+        backtrace_symbols_cb(s->frames, depth, 0, cb, NULL);
+        if (first) fprintf(stderr, "\n");
+    }
+
+    busy = false;
+}
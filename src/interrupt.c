@@ -944,6 +944,27 @@ interrupt_state_t get_interrupts_state()
     }
 }
 
+/**
+ * @brief Check whether the caller is running within an interrupt or exception handler
+ *
+ * Handlers run with interrupts masked in the CPU, without touching the
+ * disable_interrupts() nesting level, so #get_interrupts_state reports
+ * #INTERRUPTS_ENABLED within them. Code that waits for an interrupt to be
+ * serviced must check this function as well, otherwise it would deadlock
+ * when called from a handler.
+ *
+ * @return true if called from an interrupt or exception handler, false otherwise
+ */
+bool in_interrupt_handler(void)
+{
+    if( __interrupt_depth < 0 ) { return false; }
+
+    /* If interrupts are disabled, the IE bit that was active at the time
+       has been saved by disable_interrupts(). */
+    uint32_t sr = __interrupt_depth > 0 ? __interrupt_sr : C0_STATUS();
+    return !(sr & C0_STATUS_IE);
+}
+
 
 /** 
  * @brief Check whether the RESET button was pressed and how long we are into
@@ -61,7 +61,10 @@
  *    one, the RSP loads the new overlay into IMEM/DMEM. Before doing so, it
  *    also saves the current overlay's state back into RDRAM (this is a portion
  *    of DMEM specified by the overlay itself as "state", that is preserved
- *    across overlay switching).
+ *    across overlay switching). Only the descriptor of the current overlay
+ *    is kept in DMEM: the one of the new overlay is first fetched from
+ *    RDRAM (#rspq_overlay_descriptors), so switching costs one more small
+ *    DMA, but DMEM usage does not depend on the number of overlays.
  * 5. The RSP uses the command index to fetch the "command descriptor", a small
  *    structure that contains a pointer to the function in IMEM that executes
  *    the command, and the size of the command in word.
@@ -124,7 +127,11 @@
  * RSPQ_BLOCK_MIN_SIZE. If the buffer becomes full, a new buffer is allocated
  * with double the size (to achieve exponential growth), and it is linked
  * to the previous buffer via a RSPQ_CMD_JUMP. So a block can end up being
- * defined by multiple memory buffers linked via jumps.
+ * defined by multiple memory buffers linked via jumps. The smaller buffers
+ * are allocated from per-size pools, to avoid fragmenting the heap.
+ * 
+ * #rspq_block_finalize can later compact a block into a single buffer of
+ * the exact size, removing the jumps.
  * 
  * Calling a block requires some work because of the nesting calls we want
  * to support. To make the RSP ucode as short as possible, the two internal
@@ -143,6 +150,11 @@
  * is then used as call slot in both all future calls to the block, and by
  * the RSPQ_CMD_RET command placed at the end of the block itself.
  * 
+ * Blocks can also be called from the highpri queue, which might preempt
+ * lowpri while it is running a block. To avoid overwriting the save slots of
+ * the preempted block, the RSP relocates the slots used by RSPQ_CMD_CALL and
+ * RSPQ_CMD_RET into a second range while SP_STATUS_SIG_HIGHPRI_RUNNING is set.
+ * 
  * ## Highpri queue
  * 
  * The high priority queue is implemented as an alternative couple of buffers,
@@ -164,6 +176,16 @@
  * Some careful tricks are necessary to allow multiple highpri queues to be
  * pending, see #rspq_highpri_begin for details.
  * 
+ * ## Command stream capture
+ * 
+ * #rspq_write is inlined in the caller, so the capture (see #rspq_capture_start)
+ * does not intercept the writes. Instead, the words written in the current
+ * buffer are copied into the capture ring buffer lazily, every time the
+ * write pointer leaves the buffer (#rspq_switch_buffer, #rspq_switch_context)
+ * and before recording a marker (block creation, syncpoints, frames).
+ * Since commands are written contiguously, this captures every command with
+ * no overhead on the write path.
+ * 
  */
 
 #include "rsp.h"
@@ -173,11 +195,13 @@
 #include "utils.h"
 #include "n64sys.h"
 #include "debug.h"
+#include "allocator.h"
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <malloc.h>
+#include <stdio.h>
 
 /**
  * RSPQ internal commands (overlay 0)
@@ -336,9 +360,13 @@ typedef struct rspq_overlay_header_t {
 /** @brief A pre-built block of commands */
 typedef struct rspq_block_s {
     uint32_t nesting_level;     ///< Nesting level of the block
+    uint32_t finalized;         ///< True if the block was compacted by #rspq_block_finalize
     uint32_t cmds[];            ///< Block contents (commands)
 } rspq_block_t;
 
+/** @brief Number of size classes of block chunks that are allocated from pools */
+#define RSPQ_BLOCK_POOL_CLASSES     5
+
 /** @brief RSPQ overlays */
 rsp_ucode_t *rspq_overlay_ucodes[RSPQ_MAX_OVERLAY_COUNT];
 
@@ -359,14 +387,15 @@ _Static_assert(sizeof(rspq_overlay_t) == RSPQ_OVERLAY_DESC_SIZE);
 /**
  * @brief The overlay table in DMEM. 
  *
- * This structure is defined in DMEM by rsp_queue.S, and contains the descriptors
- * for the overlays, used by the queue engine to load each overlay when needed.
+ * This structure is defined in DMEM by rsp_queue.S, and maps each overlay ID
+ * to the index of its descriptor. The descriptors themselves are kept in RDRAM
+ * (#rspq_overlay_descriptors), and the queue engine fetches the descriptor
+ * of an overlay only when it needs to load it, so that the number of overlays
+ * does not affect DMEM usage.
  */
 typedef struct rspq_overlay_tables_s {
     /** @brief Table mapping overlay ID to overlay index (used for the descriptors) */
     uint8_t overlay_table[RSPQ_OVERLAY_TABLE_SIZE];
-    /** @brief Descriptor for each overlay, indexed by the previous table. */
-    rspq_overlay_t overlay_descriptors[RSPQ_MAX_OVERLAY_COUNT];
 } rspq_overlay_tables_t;
 
 /**
@@ -377,16 +406,26 @@ typedef struct rspq_overlay_tables_s {
  */
 typedef struct rsp_queue_s {
     rspq_overlay_tables_t tables;        ///< Overlay table
+    rspq_overlay_t current_ovl_desc;     ///< Descriptor of the currently loaded overlay
+    uint32_t overlay_descriptors;        ///< Address of #rspq_overlay_descriptors in RDRAM
     /** @brief Pointer stack used by #RSPQ_CMD_CALL and #RSPQ_CMD_RET. */
     uint32_t rspq_pointer_stack[RSPQ_MAX_BLOCK_NESTING_LEVEL];
     uint32_t rspq_dram_lowpri_addr;      ///< Address of the lowpri queue (special slot in the pointer stack)
     uint32_t rspq_dram_highpri_addr;     ///< Address of the highpri queue  (special slot in the pointer stack)
+    /** @brief Pointer stack used by #RSPQ_CMD_CALL and #RSPQ_CMD_RET in highpri mode. */
+    uint32_t rspq_highpri_pointer_stack[RSPQ_MAX_BLOCK_NESTING_LEVEL];
     uint32_t rspq_dram_addr;             ///< Current RDRAM address being processed
     int16_t current_ovl;                 ///< Current overlay index
 } __attribute__((aligned(16), packed)) rsp_queue_t;
 
 /** @brief Address of the RSPQ data header in DMEM (see #rsp_queue_t) */
 #define RSPQ_DATA_ADDRESS                32
+/** @brief Address of the RSPQ banner in DMEM, right after #rsp_queue_t */
+#define RSPQ_BANNER_ADDRESS              ROUND_UP(RSPQ_DATA_ADDRESS + sizeof(rsp_queue_t), 16)
+/** @brief Address of the RSPQ command buffer in DMEM (RSPQ_DMEM_BUFFER in rsp_queue.inc) */
+#define RSPQ_DMEM_BUFFER_ADDRESS         (RSPQ_BANNER_ADDRESS + (RSPQ_DEBUG ? 0xC0 : 0x20))
+/** @brief Address of the profiling data in DMEM (see #rspq_profile_get) */
+#define RSPQ_PROFILE_ADDRESS             (RSPQ_DMEM_BUFFER_ADDRESS + RSPQ_DMEM_BUFFER_SIZE)
 
 /**
  * @brief RSP queue building context
@@ -437,6 +476,9 @@ volatile uint32_t *rspq_cur_sentinel;   ///< Copy of the current write sentinel
 /** @brief RSP queue data in DMEM. */
 static rsp_queue_t rspq_data;
 
+/** @brief Descriptors of the overlays, indexed by the overlay table. Fetched by RSP on demand. */
+static rspq_overlay_t rspq_overlay_descriptors[RSPQ_MAX_OVERLAY_COUNT] __attribute__((aligned(16)));
+
 /** @brief True if the queue system has been initialized. */
 static bool rspq_initialized = 0;
 
@@ -444,21 +486,126 @@ static bool rspq_initialized = 0;
 static rspq_block_t *rspq_block;
 /** @brief Size of the current block memory buffer (in 32-bit words). */
 static int rspq_block_size;
+/** @brief Pools for block chunks, one per size class (see #rspq_block_chunk_alloc). */
+static pool_t rspq_block_pools[RSPQ_BLOCK_POOL_CLASSES];
+/** @brief True if #rspq_block_pools have been initialized. */
+static bool rspq_block_pools_initialized;
 
 /** @brief ID that will be used for the next syncpoint that will be created. */
 static int rspq_syncpoints_genid;
 /** @brief ID of the last syncpoint reached by RSP. */
 static volatile int rspq_syncpoints_done;
 
+/** @brief A callback waiting for a syncpoint (see #rspq_syncpoint_callback). */
+typedef struct {
+    rspq_syncpoint_t sync_id;           ///< Syncpoint to wait for
+    void (*cb)(void *ctx);              ///< Callback function
+    void *ctx;                          ///< Callback argument
+} rspq_syncpoint_cb_t;
+
+/** @brief Callbacks waiting for a syncpoint, in registration order. */
+static rspq_syncpoint_cb_t rspq_syncpoint_cbs[RSPQ_MAX_SYNCPOINT_CALLBACKS];
+/** @brief Number of entries in #rspq_syncpoint_cbs. */
+static int rspq_syncpoint_num_cbs;
+
 /** @brief True if the RSP queue engine is running in the RSP. */
 static bool rspq_is_running;
 
 /** @brief Dummy state used for overlay 0 */
 static uint64_t dummy_overlay_state;
 
+/** @brief Capture ring buffer (see #rspq_capture_start), or NULL if not capturing. */
+static uint32_t *rspq_capture_buf;
+/** @brief Size of #rspq_capture_buf in 32-bit words. */
+static int rspq_capture_size;
+/** @brief Index of the oldest record in #rspq_capture_buf. */
+static int rspq_capture_tail;
+/** @brief Number of used words in #rspq_capture_buf. */
+static int rspq_capture_used;
+/** @brief Capture image flags (RSPQ_CAPTURE_FLAG_*). */
+static uint32_t rspq_capture_flags;
+/** @brief First word of the current buffer that has not been captured yet. */
+static volatile uint32_t *rspq_capture_ptr;
+
+/** @brief State of the measurement of the current highpri submission (see #rspq_highpri_stats_get) */
+static volatile enum {
+    RSPQ_HIGHPRI_LAT_IDLE,              ///< No highpri submission is pending
+    RSPQ_HIGHPRI_LAT_REQUESTED,         ///< Highpri mode was requested, RSP has not started it yet
+    RSPQ_HIGHPRI_LAT_RUNNING,           ///< RSP is running the highpri queue
+} rspq_highpri_lat_state;
+/** @brief Time at which highpri mode was requested (in ticks) */
+static uint32_t rspq_highpri_lat_t0;
+/** @brief Highpri latency statistics (see #rspq_highpri_stats_get) */
+static rspq_highpri_stats_t rspq_highpri_stats;
+
 static void rspq_flush_internal(void);
 
-/** @brief RSP interrupt handler, used for syncpoints. */
+/** @brief Account a latency (in ticks) into the highpri statistics */
+static void rspq_highpri_lat_record(uint32_t ticks, uint32_t *hist, uint32_t *max_us, uint64_t *total_us)
+{
+    uint32_t us = (uint64_t)ticks * 1000000 / TICKS_PER_SECOND;
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= RSPQ_HIGHPRI_HIST_BUCKETS)
+        bucket = RSPQ_HIGHPRI_HIST_BUCKETS-1;
+    hist[bucket]++;
+    *total_us += us;
+    if (*max_us < us)
+        *max_us = us;
+}
+
+/**
+ * @brief Advance the measurement of the current highpri submission
+ * 
+ * Called by the SP interrupt handler (the RSP raises an interrupt when it
+ * starts and finishes running the highpri queue), and by #rspq_highpri_sync.
+ * Must be called with interrupts disabled.
+ * 
+ * @param[in]  status   Current value of SP_STATUS
+ */
+static void rspq_highpri_lat_update(uint32_t status)
+{
+    if (rspq_highpri_lat_state == RSPQ_HIGHPRI_LAT_IDLE)
+        return;
+
+    uint32_t elapsed = TICKS_SINCE(rspq_highpri_lat_t0);
+    bool pending = status & (SP_STATUS_SIG_HIGHPRI_REQUESTED | SP_STATUS_SIG_HIGHPRI_RUNNING);
+
+    // If both signals are clear, the RSP has already run the whole queue,
+    // so we account it as started now.
+    if (rspq_highpri_lat_state == RSPQ_HIGHPRI_LAT_REQUESTED &&
+        (!pending || (status & SP_STATUS_SIG_HIGHPRI_RUNNING))) {
+        rspq_highpri_lat_record(elapsed, rspq_highpri_stats.start_hist,
+            &rspq_highpri_stats.start_max_us, &rspq_highpri_stats.start_total_us);
+        rspq_highpri_lat_state = RSPQ_HIGHPRI_LAT_RUNNING;
+    }
+    if (rspq_highpri_lat_state == RSPQ_HIGHPRI_LAT_RUNNING && !pending) {
+        rspq_highpri_lat_record(elapsed, rspq_highpri_stats.complete_hist,
+            &rspq_highpri_stats.complete_max_us, &rspq_highpri_stats.complete_total_us);
+        rspq_highpri_stats.count++;
+        rspq_highpri_lat_state = RSPQ_HIGHPRI_LAT_IDLE;
+    }
+}
+
+/** 
+ * @brief Run the callbacks whose syncpoint has been reached.
+ * 
+ * Called from the SP interrupt handler. Pending callbacks are compacted
+ * in place so that the registration order is preserved.
+ */
+static void rspq_syncpoint_run_callbacks(void)
+{
+    int j = 0;
+    for (int i = 0; i < rspq_syncpoint_num_cbs; i++) {
+        rspq_syncpoint_cb_t *cb = &rspq_syncpoint_cbs[i];
+        if (rspq_syncpoint_check(cb->sync_id))
+            cb->cb(cb->ctx);
+        else
+            rspq_syncpoint_cbs[j++] = *cb;
+    }
+    rspq_syncpoint_num_cbs = j;
+}
+
+/** @brief RSP interrupt handler, used for syncpoints and highpri latency measurement. */
 static void rspq_sp_interrupt(void) 
 {
     uint32_t status = *SP_STATUS;
@@ -469,24 +616,78 @@ static void rspq_sp_interrupt(void)
     if (status & SP_STATUS_SIG_SYNCPOINT) {
         wstatus |= SP_WSTATUS_CLEAR_SIG_SYNCPOINT;
         ++rspq_syncpoints_done;
+        rspq_syncpoint_run_callbacks();
     }
 
+    rspq_highpri_lat_update(status);
+
     MEMORY_BARRIER();
 
     if (wstatus)
         *SP_STATUS = wstatus;
 }
 
+/** @brief Append a record to the capture ring buffer, dropping the oldest records if needed */
+static void rspq_capture_record(int type, const volatile uint32_t *data, int n)
+{
+    assert(n < rspq_capture_size);
+    while (rspq_capture_size - rspq_capture_used < n+1) {
+        int len = 1 + (rspq_capture_buf[rspq_capture_tail] & 0xFFFFFF);
+        rspq_capture_tail = (rspq_capture_tail + len) % rspq_capture_size;
+        rspq_capture_used -= len;
+        rspq_capture_flags |= RSPQ_CAPTURE_FLAG_DROPPED;
+    }
+
+    int head = (rspq_capture_tail + rspq_capture_used) % rspq_capture_size;
+    rspq_capture_buf[head] = (type << 24) | n;
+    for (int i = 0; i < n; i++) {
+        if (++head == rspq_capture_size) head = 0;
+        rspq_capture_buf[head] = data[i];
+    }
+    rspq_capture_used += n+1;
+}
+
+/** @brief Capture the words written in the current buffer since the last capture */
+static void rspq_capture_pending(void)
+{
+    if (!rspq_capture_buf)
+        return;
+
+    int n = rspq_cur_pointer - rspq_capture_ptr;
+    if (n > 0) {
+        int type = rspq_ctx == &lowpri ? RSPQ_CAPTURE_REC_LOWPRI :
+                   rspq_ctx == &highpri ? RSPQ_CAPTURE_REC_HIGHPRI : RSPQ_CAPTURE_REC_BLOCK;
+        rspq_capture_record(type, rspq_capture_ptr, n);
+    }
+    rspq_capture_ptr = rspq_cur_pointer;
+}
+
+/** @brief Record a marker in the capture ring buffer, after the pending words */
+static void rspq_capture_marker(int type, int n, uint32_t arg0, uint32_t arg1)
+{
+    if (!rspq_capture_buf)
+        return;
+
+    rspq_capture_pending();
+    uint32_t args[2] = { arg0, arg1 };
+    rspq_capture_record(type, args, n);
+}
+
+/** @brief Get the name of the overlay with the specified index */
+static const char* rspq_get_ovl_name(int ovl_idx)
+{
+    if (ovl_idx == 0)
+        return "builtin";
+    if (ovl_idx < RSPQ_MAX_OVERLAY_COUNT && rspq_overlay_ucodes[ovl_idx])
+        return rspq_overlay_ucodes[ovl_idx]->name;
+    return "?";
+}
+
 /** @brief Extract the current overlay index and name from the RSP queue state */
 static void rspq_get_current_ovl(rsp_queue_t *rspq, int *ovl_idx, const char **ovl_name)
 {
     *ovl_idx = rspq->current_ovl / sizeof(rspq_overlay_t);
-    if (*ovl_idx == 0)
-        *ovl_name = "builtin";
-    else if (*ovl_idx < RSPQ_MAX_OVERLAY_COUNT && rspq_overlay_ucodes[*ovl_idx])
-        *ovl_name = rspq_overlay_ucodes[*ovl_idx]->name;
-    else
-        *ovl_name = "?";
+    *ovl_name = rspq_get_ovl_name(*ovl_idx);
 }
 
 /** @brief RSPQ crash handler. This shows RSPQ-specific info the in RSP crash screen. */
@@ -494,7 +695,7 @@ static void rspq_crash_handler(rsp_snapshot_t *state)
 {
     rsp_queue_t *rspq = (rsp_queue_t*)(state->dmem + RSPQ_DATA_ADDRESS);
     uint32_t cur = rspq->rspq_dram_addr + state->gpr[28];
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x1A0 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDRESS;
 
     int ovl_idx; const char *ovl_name;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_name);
@@ -535,8 +736,7 @@ static void rspq_assert_invalid_command(rsp_snapshot_t *state)
     int ovl_idx; const char *ovl_name;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_name);
 
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x1A0 : 0x100;
-    uint32_t cur = dmem_buffer + state->gpr[28];
+    uint32_t cur = RSPQ_DMEM_BUFFER_ADDRESS + state->gpr[28];
     printf("Invalid command\nCommand %02x not found in overlay %s (0x%01x)\n", state->dmem[cur], ovl_name, ovl_idx);
 }
 
@@ -576,6 +776,8 @@ static void rspq_assert_handler(rsp_snapshot_t *state, uint16_t assert_code)
 __attribute__((noinline))
 static void rspq_switch_context(rspq_ctx_t *new)
 {
+    rspq_capture_pending();
+
     if (rspq_ctx) {
         // Save back the external pointers into the context structure, where
         // they belong.
@@ -588,12 +790,14 @@ static void rspq_switch_context(rspq_ctx_t *new)
     rspq_ctx = new;
     rspq_cur_pointer = rspq_ctx ? rspq_ctx->cur : NULL;
     rspq_cur_sentinel = rspq_ctx ? rspq_ctx->sentinel : NULL;
+    rspq_capture_ptr = rspq_cur_pointer;
 }
 
 /** @brief Switch the current write buffer */
 static volatile uint32_t* rspq_switch_buffer(uint32_t *new, int size, bool clear)
 {
     volatile uint32_t* prev = rspq_cur_pointer;
+    rspq_capture_pending();
 
     // Notice that the buffer must have been cleared before, as the
     // command queue are expected to always contain 0 on unwritten data.
@@ -604,6 +808,7 @@ static volatile uint32_t* rspq_switch_buffer(uint32_t *new, int size, bool clear
     // Switch to the new buffer, and calculate the new sentinel.
     rspq_cur_pointer = new;
     rspq_cur_sentinel = new + size - RSPQ_MAX_SHORT_COMMAND_SIZE;
+    rspq_capture_ptr = rspq_cur_pointer;
 
     // Return a pointer to the previous buffer
     return prev;
@@ -697,7 +902,7 @@ void rspq_init(void)
     rspq_switch_context(&lowpri);
 
     // Verify consistency of state
-    int banner_offset = ROUND_UP(RSPQ_DATA_ADDRESS + sizeof(rsp_queue_t), 16);
+    int banner_offset = RSPQ_BANNER_ADDRESS;
     assertf(!memcmp(rsp_queue.data + banner_offset, "Dragon RSP Queue", 16),
         "rsp_queue_t does not seem to match DMEM; did you forget to update it?");
 
@@ -706,16 +911,32 @@ void rspq_init(void)
     rspq_data.rspq_dram_lowpri_addr = PhysicalAddr(lowpri.cur);
     rspq_data.rspq_dram_highpri_addr = PhysicalAddr(highpri.cur);
     rspq_data.rspq_dram_addr = rspq_data.rspq_dram_lowpri_addr;
-    rspq_data.tables.overlay_descriptors[0].state = PhysicalAddr(&dummy_overlay_state);
-    rspq_data.tables.overlay_descriptors[0].data_size = sizeof(uint64_t);
+    memset(rspq_overlay_descriptors, 0, sizeof(rspq_overlay_descriptors));
+    rspq_overlay_descriptors[0].state = PhysicalAddr(&dummy_overlay_state);
+    rspq_overlay_descriptors[0].data_size = sizeof(uint64_t);
+    data_cache_hit_writeback(rspq_overlay_descriptors, sizeof(rspq_overlay_descriptors));
+    rspq_data.overlay_descriptors = PhysicalAddr(rspq_overlay_descriptors);
+    rspq_data.current_ovl_desc = rspq_overlay_descriptors[0];
     rspq_data.current_ovl = 0;
     
     // Init syncpoints
     rspq_syncpoints_genid = 0;
     rspq_syncpoints_done = 0;
+    rspq_syncpoint_num_cbs = 0;
+
+    // Init highpri latency statistics
+    rspq_highpri_lat_state = RSPQ_HIGHPRI_LAT_IDLE;
+    memset(&rspq_highpri_stats, 0, sizeof(rspq_highpri_stats));
 
-    // Init blocks
+    // Init blocks. The pools are never closed, as blocks might outlive a
+    // rspq_close / rspq_init cycle. Each pool grabs about 4 KiB at a time.
     rspq_block = NULL;
+    if (!rspq_block_pools_initialized) {
+        for (int i = 0; i < RSPQ_BLOCK_POOL_CLASSES; i++)
+            pool_init(&rspq_block_pools[i], sizeof(rspq_block_t) + (RSPQ_BLOCK_MIN_SIZE << i)*sizeof(uint32_t),
+                MAX(1, 16 >> i), ALLOC_UNCACHED);
+        rspq_block_pools_initialized = true;
+    }
     rspq_is_running = false;
 
     // Activate SP interrupt (used for syncpoints)
@@ -743,6 +964,9 @@ void rspq_close(void)
     
     rspq_initialized = 0;
 
+    // Syncpoints that were not reached will never be, so drop their callbacks
+    rspq_syncpoint_num_cbs = 0;
+
     rspq_close_context(&highpri);
     rspq_close_context(&lowpri);
 
@@ -780,7 +1004,7 @@ static uint32_t rspq_find_new_overlay_index(void)
 {
     for (uint32_t i = 1; i < RSPQ_MAX_OVERLAY_COUNT; i++)
     {
-        if (rspq_data.tables.overlay_descriptors[i].code == 0) {
+        if (rspq_overlay_descriptors[i].code == 0) {
             return i;
         }
     }
@@ -875,7 +1099,7 @@ static uint32_t rspq_overlay_register_internal(rsp_ucode_t *overlay_ucode, uint3
     // Check if the overlay has been registered already
     for (uint32_t i = 0; i < RSPQ_MAX_OVERLAY_COUNT; i++)
     {
-        assertf(rspq_data.tables.overlay_descriptors[i].code != PhysicalAddr(overlay_code),
+        assertf(rspq_overlay_descriptors[i].code != PhysicalAddr(overlay_code),
             "Overlay %s is already registered!", overlay_ucode->name);
     }
 
@@ -904,12 +1128,13 @@ static uint32_t rspq_overlay_register_internal(rsp_ucode_t *overlay_ucode, uint3
     }
 
     // Write overlay info into descriptor table
-    rspq_overlay_t *overlay = &rspq_data.tables.overlay_descriptors[overlay_index];
+    rspq_overlay_t *overlay = &rspq_overlay_descriptors[overlay_index];
     overlay->code = PhysicalAddr(overlay_code);
     overlay->data = PhysicalAddr(overlay_data);
     overlay->state = PhysicalAddr(rspq_overlay_get_state(overlay_ucode));
     overlay->code_size = ((uint8_t*)overlay_ucode->code_end - overlay_ucode->code) - rspq_text_size - 1;
     overlay->data_size = ((uint8_t*)overlay_ucode->data_end - overlay_ucode->data) - rspq_data_size - 1;
+    data_cache_hit_writeback(overlay, sizeof(rspq_overlay_t));
 
     // Let the assigned ids point at the overlay
     for (uint32_t i = 0; i < slot_count; i++)
@@ -951,27 +1176,66 @@ void rspq_overlay_unregister(uint32_t overlay_id)
     uint32_t overlay_index = rspq_data.tables.overlay_table[unshifted_id] / sizeof(rspq_overlay_t);
     assertf(overlay_index != 0, "No overlay is registered at id %#lx!", overlay_id);
 
-    rspq_overlay_t *overlay = &rspq_data.tables.overlay_descriptors[overlay_index];
+    rspq_overlay_t *overlay = &rspq_overlay_descriptors[overlay_index];
     assertf(overlay->code != 0, "No overlay is registered at id %#lx!", overlay_id);
 
     rspq_overlay_header_t *overlay_header = (rspq_overlay_header_t*)(overlay->data | 0x80000000);
     uint32_t command_count = rspq_overlay_get_command_count(overlay_header);
     uint32_t slot_count = (command_count + 15) / 16;
 
-    // Reset the overlay descriptor
-    memset(overlay, 0, sizeof(rspq_overlay_t));
-
     // Remove all registered ids
-    for (uint32_t i = unshifted_id; i < slot_count; i++)
+    for (uint32_t i = unshifted_id; i < unshifted_id + slot_count; i++)
     {
         rspq_data.tables.overlay_table[i] = 0;
     }
 
+    rspq_update_tables(false);
+
+    // The RSP fetches the descriptor from RDRAM when it loads the overlay,
+    // so it must not be reset (and possibly reused by a new overlay) until
+    // the commands already enqueued for this overlay have run.
+    rspq_wait();
+
+    // Reset the overlay descriptor
+    memset(overlay, 0, sizeof(rspq_overlay_t));
+    data_cache_hit_writeback(overlay, sizeof(rspq_overlay_t));
+    rspq_overlay_ucodes[overlay_index] = NULL;
+
     // Reset the command base in the overlay header
     overlay_header->command_base = 0;
     data_cache_hit_writeback_invalidate(overlay_header, sizeof(rspq_overlay_header_t));
+}
 
-    rspq_update_tables(false);
+/**
+ * @brief Allocate a chunk of a block
+ * 
+ * Chunks are always a power of two multiple of #RSPQ_BLOCK_MIN_SIZE. The
+ * smaller size classes are allocated from pools, so that building and
+ * freeing many small blocks does not fragment the heap; larger chunks come
+ * from the heap. Every chunk has room for the #rspq_block_t header, though
+ * only the first chunk of a block uses it.
+ * 
+ * @param size      Size of the chunk in 32-bit words
+ * @return          Pointer to the chunk (in the uncached segment)
+ */
+static void* rspq_block_chunk_alloc(int size)
+{
+    int cls = __builtin_ctz(size / RSPQ_BLOCK_MIN_SIZE);
+    void *chunk = cls < RSPQ_BLOCK_POOL_CLASSES ?
+        pool_alloc(&rspq_block_pools[cls]) :
+        malloc_uncached(sizeof(rspq_block_t) + size*sizeof(uint32_t));
+    assertf(chunk, "out of memory allocating a block");
+    return chunk;
+}
+
+/** @brief Free a chunk allocated by #rspq_block_chunk_alloc */
+static void rspq_block_chunk_free(void *chunk, int size)
+{
+    int cls = __builtin_ctz(size / RSPQ_BLOCK_MIN_SIZE);
+    if (cls < RSPQ_BLOCK_POOL_CLASSES)
+        pool_free(&rspq_block_pools[cls], chunk);
+    else
+        free_uncached(chunk);
 }
 
 /**
@@ -998,7 +1262,7 @@ void rspq_next_buffer(void) {
         if (rspq_block_size < RSPQ_BLOCK_MAX_SIZE) rspq_block_size *= 2;
 
         // Allocate a new chunk of the block and switch to it.
-        uint32_t *rspq2 = malloc_uncached(rspq_block_size*sizeof(uint32_t));
+        uint32_t *rspq2 = rspq_block_chunk_alloc(rspq_block_size);
         volatile uint32_t *prev = rspq_switch_buffer(rspq2, rspq_block_size, true);
 
         // Terminate the previous chunk with a JUMP op to the new chunk.
@@ -1037,6 +1301,16 @@ void rspq_next_buffer(void) {
     rspq_flush_internal();
 }
 
+/** @brief Slow path of #rspq_reserve: switch buffer until there is space for the reservation */
+void rspq_reserve_next_buffer(int size) {
+    assertf(size <= RSPQ_MAX_RESERVE_SIZE, "cannot reserve %d words (max: %d)", size, RSPQ_MAX_RESERVE_SIZE);
+
+    // Block chunks start small, so more than one switch might be needed.
+    do {
+        rspq_next_buffer();
+    } while (rspq_cur_pointer > rspq_cur_sentinel - size);
+}
+
 __attribute__((noinline))
 static void rspq_flush_internal(void)
 {
@@ -1107,10 +1381,23 @@ void rspq_highpri_begin(void)
     // add a command in case the previous epilog was skipped. Otherwise,
     // a dummy SIG_HIGHPRI_REQUESTED could stay on and eventually highpri
     // mode would enter once again.
+    // The interrupt notifies that highpri is running, for the latency statistics.
     rspq_append1(rspq_cur_pointer, RSPQ_CMD_WRITE_STATUS,
-        SP_WSTATUS_CLEAR_SIG_HIGHPRI_REQUESTED | SP_WSTATUS_SET_SIG_HIGHPRI_RUNNING);
+        SP_WSTATUS_CLEAR_SIG_HIGHPRI_REQUESTED | SP_WSTATUS_SET_SIG_HIGHPRI_RUNNING |
+        SP_WSTATUS_SET_INTR);
     MEMORY_BARRIER();
+
+    // Start measuring the latency, unless a previous submission is still
+    // pending: in that case, this one is merged into it.
+    disable_interrupts();
     *SP_STATUS = SP_WSTATUS_SET_SIG_HIGHPRI_REQUESTED;
+    if (rspq_highpri_lat_state == RSPQ_HIGHPRI_LAT_IDLE) {
+        rspq_highpri_lat_t0 = TICKS_READ();
+        rspq_highpri_lat_state = RSPQ_HIGHPRI_LAT_REQUESTED;
+    } else {
+        rspq_highpri_stats.merged++;
+    }
+    enable_interrupts();
     rspq_flush_internal();
 }
 
@@ -1123,9 +1410,10 @@ void rspq_highpri_end(void)
     // from RDRAM in case the epilog has been overwritten by a new highpri
     // queue (see rspq_highpri_begin).
     rspq_append1(rspq_cur_pointer, RSPQ_CMD_JUMP, PhysicalAddr(rspq_cur_pointer+1));
+    // The interrupt notifies the end of highpri, for the latency statistics.
     rspq_append3(rspq_cur_pointer, RSPQ_CMD_SWAP_BUFFERS,
         RSPQ_LOWPRI_CALL_SLOT<<2, RSPQ_HIGHPRI_CALL_SLOT<<2,
-        SP_WSTATUS_CLEAR_SIG_HIGHPRI_RUNNING);
+        SP_WSTATUS_CLEAR_SIG_HIGHPRI_RUNNING | SP_WSTATUS_SET_INTR);
     rspq_flush_internal();
     rspq_switch_context(&lowpri);
 }
@@ -1138,6 +1426,47 @@ void rspq_highpri_sync(void)
         if (!(*SP_STATUS & (SP_STATUS_SIG_HIGHPRI_REQUESTED | SP_STATUS_SIG_HIGHPRI_RUNNING)))
             break;
     }
+
+    // Complete the latency measurement, in case the interrupt was not
+    // processed yet.
+    disable_interrupts();
+    rspq_highpri_lat_update(*SP_STATUS);
+    enable_interrupts();
+}
+
+/**
+ * @brief Walk all the chunks of a block
+ * 
+ * The callback is invoked for each chunk, with the chunk memory and size
+ * (as passed to #rspq_block_chunk_alloc), the pointer to its commands, and
+ * the number of used words including the terminator (a JUMP to the next
+ * chunk, or the final RET), plus the opaque ctx pointer. The callback is
+ * allowed to free the chunk.
+ */
+static void rspq_block_walk(rspq_block_t *block, void (*cb)(void *ctx, void *chunk, int size, uint32_t *cmds, int used), void *ctx)
+{
+    // Start from the commands in the first chunk of the block
+    int size = RSPQ_BLOCK_MIN_SIZE;
+    void *start = block;
+    uint32_t *cmds = block->cmds;
+    while (1) {
+        // Rollback until we find a non-zero command
+        uint32_t *ptr = cmds + size;
+        while (*--ptr == 0x00) {}
+        uint32_t cmd = *ptr;
+
+        // The last command is either a JUMP to the next chunk or the final RET.
+        // Anything else means this is not a valid chunk of a block, better assert.
+        assertf(cmd>>24 == RSPQ_CMD_JUMP || cmd>>24 == RSPQ_CMD_RET,
+            "invalid terminator command in block: %08lx\n", cmd);
+        cb(ctx, start, size, cmds, ptr - cmds + 1);
+        if (cmd>>24 == RSPQ_CMD_RET)
+            return;
+
+        // Get the pointer to the next chunk
+        start = cmds = UncachedAddr(0x80000000 | (cmd & 0xFFFFFF));
+        if (size < RSPQ_BLOCK_MAX_SIZE) size *= 2;
+    }
 }
 
 void rspq_block_begin(void)
@@ -1147,13 +1476,15 @@ void rspq_block_begin(void)
 
     // Allocate a new block (at minimum size) and initialize it.
     rspq_block_size = RSPQ_BLOCK_MIN_SIZE;
-    rspq_block = malloc_uncached(sizeof(rspq_block_t) + rspq_block_size*sizeof(uint32_t));
+    rspq_block = rspq_block_chunk_alloc(rspq_block_size);
     rspq_block->nesting_level = 0;
+    rspq_block->finalized = false;
 
     // Switch to the block buffer. From now on, all rspq_writes will
     // go into the block.
     rspq_switch_context(NULL);
     rspq_switch_buffer(rspq_block->cmds, rspq_block_size, true);
+    rspq_capture_marker(RSPQ_CAPTURE_REC_BLOCK_BEGIN, 0, 0, 0);
 }
 
 rspq_block_t* rspq_block_end(void)
@@ -1166,6 +1497,7 @@ rspq_block_t* rspq_block_end(void)
 
     // Switch back to the normal display list
     rspq_switch_context(&lowpri);
+    rspq_capture_marker(RSPQ_CAPTURE_REC_BLOCK_END, 1, PhysicalAddr(rspq_block->cmds), 0);
 
     // Return the created block
     rspq_block_t *b = rspq_block;
@@ -1173,51 +1505,73 @@ rspq_block_t* rspq_block_end(void)
     return b;
 }
 
-void rspq_block_free(rspq_block_t *block)
+/** @brief #rspq_block_walk callback: free a chunk */
+static void rspq_block_free_chunk(void *ctx, void *chunk, int size, uint32_t *cmds, int used)
 {
-    // Start from the commands in the first chunk of the block
-    int size = RSPQ_BLOCK_MIN_SIZE;
-    void *start = block;
-    uint32_t *ptr = block->cmds + size;
-    while (1) {
-        // Rollback until we find a non-zero command
-        while (*--ptr == 0x00) {}
-        uint32_t cmd = *ptr;
+    rspq_block_chunk_free(chunk, size);
+}
 
-        // If the last command is a JUMP
-        if (cmd>>24 == RSPQ_CMD_JUMP) {
-            // Free the memory of the current chunk.
-            free_uncached(start);
-            // Get the pointer to the next chunk
-            start = UncachedAddr(0x80000000 | (cmd & 0xFFFFFF));
-            if (size < RSPQ_BLOCK_MAX_SIZE) size *= 2;
-            ptr = (uint32_t*)start + size;
-            continue;
-        }
-        // If the last command is a RET
-        if (cmd>>24 == RSPQ_CMD_RET) {
-            // This is the last chunk, free it and exit
-            free_uncached(start);
-            return;
-        }
-        // The last command is neither a JUMP nor a RET:
-        // this is an invalid chunk of a block, better assert.
-        assertf(0, "invalid terminator command in block: %08lx\n", cmd);
+/** @brief #rspq_block_walk callback: count the words of a chunk, without the JUMP (ctx: int total) */
+static void rspq_block_count_chunk(void *ctx, void *chunk, int size, uint32_t *cmds, int used)
+{
+    *(int*)ctx += used - 1;
+}
+
+/** @brief #rspq_block_walk callback: append a chunk, without the JUMP (ctx: uint32_t *dst) */
+static void rspq_block_copy_chunk(void *ctx, void *chunk, int size, uint32_t *cmds, int used)
+{
+    uint32_t **dst = ctx;
+    memcpy(*dst, cmds, used*sizeof(uint32_t));
+    *dst += used - 1;
+}
+
+void rspq_block_free(rspq_block_t *block)
+{
+    // A finalized block is a single contiguous buffer
+    if (block->finalized) {
+        free_uncached(block);
+        return;
     }
+
+    rspq_block_walk(block, rspq_block_free_chunk, NULL);
 }
 
-void rspq_block_run(rspq_block_t *block)
+rspq_block_t* rspq_block_finalize(rspq_block_t *block)
 {
-    // TODO: add support for block execution in highpri mode. This would be
-    // possible by allocating another range of nesting levels (eg: 8-16) to use
-    // in highpri mode (to avoid stepping on the call stack of lowpri). This
-    // would basically mean that a block can either work in highpri or in lowpri
-    // mode, but it might be an acceptable limitation.
-    assertf(rspq_ctx != &highpri, "block run is not supported in highpri mode");
+    assertf(block != rspq_block, "cannot finalize a block while it is being created");
+    if (block->finalized)
+        return block;
+
+    // Count the commands in all the chunks. The JUMPs that link the chunks
+    // are dropped, so each chunk but the last contributes one word less.
+    int total = 0;
+    rspq_block_walk(block, rspq_block_count_chunk, &total);
+    total += 1;
+
+    // Allocate a tightly sized buffer and concatenate the chunks into it
+    rspq_block_t *fblock = malloc_uncached(sizeof(rspq_block_t) + total*sizeof(uint32_t));
+    assertf(fblock, "out of memory finalizing a block");
+    fblock->nesting_level = block->nesting_level;
+    fblock->finalized = true;
+
+    uint32_t *dst = fblock->cmds;
+    rspq_block_walk(block, rspq_block_copy_chunk, &dst);
+    assert(dst == fblock->cmds + total - 1);
+
+    rspq_capture_marker(RSPQ_CAPTURE_REC_BLOCK_MOVE, 2, PhysicalAddr(block->cmds), PhysicalAddr(fblock->cmds));
+    rspq_block_free(block);
+    return fblock;
+}
 
+void rspq_block_run(rspq_block_t *block)
+{
     // Write the CALL op. The second argument is the nesting level
     // which is used as stack slot in the RSP to save the current
-    // pointer position.
+    // pointer position. In highpri mode, the RSP relocates the slot
+    // into a separate range (starting at RSPQ_HIGHPRI_CALL_BASE), so
+    // that it does not step on the call stack of a preempted lowpri
+    // block. This is transparent to the block, so the same block can
+    // be run in both modes.
     rspq_int_write(RSPQ_CMD_CALL, PhysicalAddr(block->cmds), block->nesting_level << 2);
 
     // If this is CALL within the creation of a block, update
@@ -1242,6 +1596,7 @@ rspq_syncpoint_t rspq_syncpoint_new(void)
     rspq_int_write(RSPQ_CMD_TEST_WRITE_STATUS, 
         SP_WSTATUS_SET_INTR | SP_WSTATUS_SET_SIG_SYNCPOINT,
         SP_STATUS_SIG_SYNCPOINT);
+    rspq_capture_marker(RSPQ_CAPTURE_REC_SYNCPOINT, 1, rspq_syncpoints_genid+1, 0);
     return ++rspq_syncpoints_genid;
 }
 
@@ -1271,6 +1626,27 @@ void rspq_syncpoint_wait(rspq_syncpoint_t sync_id)
     }
 }
 
+void rspq_syncpoint_callback(rspq_syncpoint_t sync_id, void (*cb)(void *ctx), void *ctx)
+{
+    assertf(cb, "syncpoint callback cannot be NULL");
+
+    disable_interrupts();
+    if (rspq_syncpoint_check(sync_id)) {
+        enable_interrupts();
+        cb(ctx);
+        return;
+    }
+    assertf(rspq_syncpoint_num_cbs < RSPQ_MAX_SYNCPOINT_CALLBACKS,
+        "too many pending syncpoint callbacks (max: %d)", RSPQ_MAX_SYNCPOINT_CALLBACKS);
+    rspq_syncpoint_cbs[rspq_syncpoint_num_cbs++] = (rspq_syncpoint_cb_t){
+        .sync_id = sync_id, .cb = cb, .ctx = ctx,
+    };
+    enable_interrupts();
+
+    // Make sure the RSP will eventually reach the syncpoint.
+    rspq_flush_internal();
+}
+
 void rspq_signal(uint32_t signal)
 {
     const uint32_t allowed_mask = SP_WSTATUS_CLEAR_SIG0|SP_WSTATUS_SET_SIG0|SP_WSTATUS_CLEAR_SIG1|SP_WSTATUS_SET_SIG1;
@@ -1299,3 +1675,214 @@ void rspq_dma_to_dmem(uint32_t dmem_addr, void *rdram_addr, uint32_t len, bool i
 extern inline rspq_write_t rspq_write_begin(uint32_t ovl_id, uint32_t cmd_id, int size);
 extern inline void rspq_write_arg(rspq_write_t *w, uint32_t value);
 extern inline void rspq_write_end(rspq_write_t *w);
+extern inline volatile uint32_t* rspq_reserve(int size);
+extern inline void rspq_reserve_end(volatile uint32_t *ptr);
+
+/** @brief Totals of the profiling data since the last #rspq_profile_reset */
+static rspq_profile_data_t rspq_profile_data;
+/** @brief Last snapshot of the profiling counters in DMEM (see #rspq_profile_get) */
+static struct {
+    uint32_t cycles[RSPQ_PROFILE_SLOTS];
+    uint16_t counts[RSPQ_PROFILE_SLOTS];
+} rspq_profile_last __attribute__((aligned(16)));
+
+/** @brief Fetch the profiling counters from DMEM and accumulate them into #rspq_profile_data */
+static void rspq_profile_fetch(void)
+{
+    assertf(RSPQ_PROFILE, "RSP profiling is not enabled (set RSPQ_PROFILE in rspq_constants.h)");
+
+    // The counters in DMEM are never reset: they are free-running and wrap
+    // around, so we accumulate the difference with the previous snapshot.
+    static uint8_t snapshot[sizeof(rspq_profile_last)] __attribute__((aligned(16)));
+    data_cache_hit_writeback_invalidate(snapshot, sizeof(snapshot));
+    rspq_dma_to_rdram(snapshot, RSPQ_PROFILE_ADDRESS, sizeof(snapshot), false);
+    rspq_wait();
+
+    uint32_t *cycles = (uint32_t*)snapshot;
+    uint16_t *counts = (uint16_t*)(snapshot + sizeof(rspq_profile_last.cycles));
+    for (int i = 0; i < RSPQ_PROFILE_SLOTS; i++) {
+        uint32_t dc = cycles[i] - rspq_profile_last.cycles[i];
+        rspq_profile_data.commands[i].cycles += dc;
+        rspq_profile_data.commands[i].count += (uint16_t)(counts[i] - rspq_profile_last.counts[i]);
+        rspq_profile_data.total_cycles += dc;
+    }
+    memcpy(&rspq_profile_last, snapshot, sizeof(snapshot));
+}
+
+void rspq_profile_get(rspq_profile_data_t *data)
+{
+    rspq_profile_fetch();
+    *data = rspq_profile_data;
+}
+
+void rspq_profile_reset(void)
+{
+    rspq_profile_fetch();
+    memset(&rspq_profile_data, 0, sizeof(rspq_profile_data));
+}
+
+void rspq_profile_dump(void)
+{
+    rspq_profile_fetch();
+
+    // Sort the command IDs by total cycles
+    uint8_t order[RSPQ_PROFILE_SLOTS];
+    for (int i = 0; i < RSPQ_PROFILE_SLOTS; i++)
+        order[i] = i;
+    int cmp(const void *a, const void *b) {
+        uint64_t ca = rspq_profile_data.commands[*(const uint8_t*)a].cycles;
+        uint64_t cb = rspq_profile_data.commands[*(const uint8_t*)b].cycles;
+        return ca < cb ? 1 : ca > cb ? -1 : 0;
+    }
+    qsort(order, RSPQ_PROFILE_SLOTS, sizeof(order[0]), cmp);
+
+    uint64_t total = rspq_profile_data.total_cycles;
+    debugf("RSPQ profile: %llu RCP cycles\n", total);
+    debugf("  cmd overlay             count         cycles  avg/call      %%\n");
+    for (int i = 0; i < RSPQ_PROFILE_SLOTS; i++) {
+        int id = order[i];
+        rspq_profile_slot_t *slot = &rspq_profile_data.commands[id];
+        if (!slot->count && !slot->cycles)
+            break;
+
+        // Find out the overlay of the command through the overlay table
+        int ovl_idx = rspq_data.tables.overlay_table[id >> 4] / sizeof(rspq_overlay_t);
+        int pct = total ? slot->cycles * 1000 / total : 0;
+        debugf("  %02x  %-16s %8lu %14llu %9llu %3d.%d%s\n", id, rspq_get_ovl_name(ovl_idx),
+            slot->count, slot->cycles, slot->count ? slot->cycles / slot->count : 0,
+            pct / 10, pct % 10, id == 0 ? " (idle)" : "");
+    }
+}
+
+void rspq_highpri_stats_get(rspq_highpri_stats_t *stats)
+{
+    disable_interrupts();
+    *stats = rspq_highpri_stats;
+    enable_interrupts();
+}
+
+void rspq_highpri_stats_reset(void)
+{
+    disable_interrupts();
+    memset(&rspq_highpri_stats, 0, sizeof(rspq_highpri_stats));
+    enable_interrupts();
+}
+
+void rspq_highpri_stats_dump(void)
+{
+    rspq_highpri_stats_t stats;
+    rspq_highpri_stats_get(&stats);
+
+    debugf("RSPQ highpri latency: %lu submissions (%lu merged)\n", stats.count, stats.merged);
+    if (!stats.count)
+        return;
+    debugf("  start:    avg %llu us, max %lu us\n", stats.start_total_us / stats.count, stats.start_max_us);
+    debugf("  complete: avg %llu us, max %lu us\n", stats.complete_total_us / stats.count, stats.complete_max_us);
+    debugf("  range (us)         start  complete\n");
+    for (int i = 0; i < RSPQ_HIGHPRI_HIST_BUCKETS; i++) {
+        if (!stats.start_hist[i] && !stats.complete_hist[i])
+            continue;
+        uint32_t lo = i ? 1 << (i-1) : 0;
+        if (i == RSPQ_HIGHPRI_HIST_BUCKETS-1)
+            debugf("  %6lu+         %8lu  %8lu\n", lo, stats.start_hist[i], stats.complete_hist[i]);
+        else
+            debugf("  %6lu-%-6lu    %8lu  %8lu\n", lo, (uint32_t)(1 << i), stats.start_hist[i], stats.complete_hist[i]);
+    }
+}
+
+void rspq_capture_start(int size)
+{
+    assertf(rspq_initialized, "rspq_capture_start must be called after rspq_init");
+    assertf(!rspq_block, "cannot start a capture while creating a block");
+    assertf(size >= RSPQ_CAPTURE_MIN_SIZE, "capture buffer too small: %d (min: %d)", size, RSPQ_CAPTURE_MIN_SIZE);
+
+    free(rspq_capture_buf);
+    rspq_capture_buf = malloc(size);
+    assertf(rspq_capture_buf, "out of memory allocating the capture buffer");
+    rspq_capture_size = size / sizeof(uint32_t);
+    rspq_capture_tail = 0;
+    rspq_capture_used = 0;
+    rspq_capture_flags = 0;
+    rspq_capture_ptr = rspq_cur_pointer;
+}
+
+void rspq_capture_stop(void)
+{
+    free(rspq_capture_buf);
+    rspq_capture_buf = NULL;
+}
+
+void rspq_capture_frame(void)
+{
+    rspq_capture_marker(RSPQ_CAPTURE_REC_FRAME, 1, TICKS_READ(), 0);
+}
+
+void* rspq_capture_get_image(int *size)
+{
+    assertf(rspq_capture_buf, "command stream capture is not active");
+    rspq_capture_pending();
+
+    int img_size = RSPQ_CAPTURE_HEADER_SIZE + rspq_capture_used * sizeof(uint32_t);
+    uint8_t *img = malloc(img_size);
+    assertf(img, "out of memory allocating the capture image");
+    memset(img, 0, RSPQ_CAPTURE_HEADER_SIZE);
+
+    memcpy(img, RSPQ_CAPTURE_MAGIC, 8);
+    ((uint32_t*)img)[2] = rspq_capture_flags;
+    ((uint32_t*)img)[3] = rspq_capture_used;
+    uint8_t *cmd_sizes = img + 16;
+    uint8_t *ovl_bases = cmd_sizes + 256;
+    char *ovl_names = (char*)ovl_bases + RSPQ_OVERLAY_ID_COUNT;
+
+    // Describe the command sizes of all the overlays, so that the stream can
+    // be decoded offline. The sizes of the internal commands are read from
+    // the internal command table, which follows the banner in DMEM.
+    uint32_t rspq_data_size = rsp_queue_data_end - rsp_queue_data_start;
+    uint16_t *internal_cmds = (uint16_t*)(rsp_queue.data + RSPQ_BANNER_ADDRESS + 32);
+    uint8_t *table = rspq_data.tables.overlay_table;
+    for (int id = 0; id < RSPQ_OVERLAY_ID_COUNT; id++) {
+        int ovl_idx = table[id] / sizeof(rspq_overlay_t);
+        if (id != 0 && ovl_idx == 0) {
+            ovl_bases[id] = 0xFF;
+            continue;
+        }
+
+        // Overlays with more than 16 commands span multiple consecutive IDs
+        int base = id;
+        while (base > 0 && table[base-1] == table[id]) base--;
+        ovl_bases[id] = base;
+        strncpy(ovl_names + id*16, rspq_get_ovl_name(ovl_idx), 15);
+
+        rspq_overlay_header_t *header = NULL;
+        int count = RSPQ_CMD_TEST_WRITE_STATUS + 1;
+        if (ovl_idx != 0) {
+            header = (rspq_overlay_header_t*)(rspq_overlay_ucodes[ovl_idx]->data + rspq_data_size);
+            count = rspq_overlay_get_command_count(header);
+        }
+        for (int i = 0; i < 16; i++) {
+            int cmd = (id - base) * 16 + i;
+            if (cmd < count)
+                cmd_sizes[id*16 + i] = (header ? header->commands[cmd] : internal_cmds[cmd]) >> 10;
+        }
+    }
+
+    uint32_t *words = (uint32_t*)(img + RSPQ_CAPTURE_HEADER_SIZE);
+    for (int i = 0; i < rspq_capture_used; i++)
+        words[i] = rspq_capture_buf[(rspq_capture_tail + i) % rspq_capture_size];
+
+    *size = img_size;
+    return img;
+}
+
+bool rspq_capture_save(const char *fn)
+{
+    int size;
+    void *img = rspq_capture_get_image(&size);
+
+    FILE *f = fopen(fn, "wb");
+    bool ok = f && fwrite(img, 1, size, f) == size;
+    if (f && fclose(f) != 0)
+        ok = false;
+    free(img);
+    return ok;
+}
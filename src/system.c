@@ -126,32 +126,43 @@ typedef struct
     char *prefix;
     /** @brief Filesystem callback pointers */
     filesystem_t *fs;
+    /** @brief Hash of the prefix (see #__prefix_hash) */
+    uint32_t hash;
 } fs_mapping_t;
 
 /**
  * @brief Filesystem open handle structure
  *
  * This is used to look up the correct filesystem function to call
- * when working with an open file handle
+ * when working with an open file handle.  The table of handles is
+ * indexed directly by the file handle returned to newlib (minus
+ * #FIRST_FILENO), so that the lookup is O(1).
  */
 typedef struct
 {
+    /** @brief Filesystem callback pointers, or null if the slot is free */
+    filesystem_t *fs;
     /** @brief Index into `filesystems` array. */
     int fs_mapping;
     /** @brief The handle assigned to this open file as returned by the 
      *         filesystem code called to handle the open operation.  Will
      *         be passed to all subsequent file operations on the file. */
     void *handle;
-    /** @brief The handle assigned by the filesystem code that will be returned
-     *         to newlib.  All subsequent newlib calls will use this handle which
-     *         will be used to look up the internal reference. */
-    int fileno;
 } fs_handle_t;
 
+/** @brief First file handle given out (past STDIN, STDOUT, STDERR) */
+#define FIRST_FILENO        3
+/** @brief Number of buckets of the prefix hash table (power of two, larger than #MAX_FILESYSTEMS) */
+#define FS_HASH_SIZE        16
+
 /** @brief Array of filesystems registered */
 static fs_mapping_t filesystems[MAX_FILESYSTEMS] = { { 0 } };
-/** @brief Array of open handles tracked */
+/** @brief Hash table of the registered prefixes (index into `filesystems`, or -1 if empty) */
+static int8_t fs_hash[FS_HASH_SIZE] = { [0 ... FS_HASH_SIZE-1] = -1 };
+/** @brief Array of open handles tracked, indexed by file handle */
 static fs_handle_t handles[MAX_OPEN_HANDLES] = { { 0 } };
+/** @brief Lowest index in `handles` that might be free */
+static int handles_free = 0;
 /** @brief Current stdio hook structure */
 static stdio_t stdio_hooks = { 0 };
 /** @brief Function to provide the current time */
@@ -279,24 +290,61 @@ static int __strcmp( const char * const a, const char * const b )
 }
 
 /**
- * @brief Return a unique filesystem handle
+ * @brief Hash the prefix of a fully qualified filename
+ *
+ * The prefix is everything up to and including the first ":/".
+ *
+ * @param[in]  name
+ *             Filename, or registered prefix
+ * @param[out] len
+ *             Length of the prefix, or 0 if name has no prefix
  *
- * @return A unique 32-bit value usable as a filesystem handle
+ * @return The hash of the prefix.
  */
-static int __get_new_handle()
+static uint32_t __prefix_hash( const char * const name, int *len )
 {
-    /* Start past STDIN, STDOUT, STDERR file handles */
-    static int handle = 3;
-    int newhandle;
+    /* FNV-1a */
+    uint32_t hash = 0x811C9DC5;
 
-    disable_interrupts();
+    for( int i = 0; name[i]; i++ )
+    {
+        hash = (hash ^ (uint8_t)name[i]) * 0x01000193;
 
-    /* Always give out a nonzero handle unique to the system */
-    newhandle = handle++;
+        if( name[i] == ':' && name[i + 1] == '/' )
+        {
+            hash = (hash ^ '/') * 0x01000193;
+            *len = i + 2;
+            return hash;
+        }
+    }
 
-    enable_interrupts();
+    *len = 0;
+    return 0;
+}
 
-    return newhandle;
+/**
+ * @brief Rebuild the prefix hash table after a filesystem was attached or detached
+ */
+static void __rebuild_fs_hash( void )
+{
+    for( int i = 0; i < FS_HASH_SIZE; i++ )
+    {
+        fs_hash[i] = -1;
+    }
+
+    for( int i = 0; i < MAX_FILESYSTEMS; i++ )
+    {
+        if( filesystems[i].prefix )
+        {
+            /* Linear probing, the table is never full */
+            uint32_t b = filesystems[i].hash & (FS_HASH_SIZE - 1);
+            while( fs_hash[b] >= 0 )
+            {
+                b = (b + 1) & (FS_HASH_SIZE - 1);
+            }
+            fs_hash[b] = i;
+        }
+    }
 }
 
 /**
@@ -332,10 +380,12 @@ int attach_filesystem( const char * const prefix, filesystem_t *filesystem )
         return -1; 
     }
 
-    /* Make sure prefix is valid */
+    /* Make sure prefix is valid: it must end with the first ":/" */
     int len = __strlen( prefix );
+    int hash_len;
+    uint32_t hash = __prefix_hash( prefix, &hash_len );
 
-    if( len < 3 || prefix[len - 1] != '/' || prefix[len - 2] != ':' )
+    if( len < 3 || hash_len != len )
     {
         errno = EINVAL;
         return -1;
@@ -379,6 +429,8 @@ int attach_filesystem( const char * const prefix, filesystem_t *filesystem )
 
     /* Attach the inputted filesystem */
     filesystems[handle].fs = filesystem;
+    filesystems[handle].hash = hash;
+    __rebuild_fs_hash();
 
     /* All went well */
     return 0;
@@ -415,9 +467,9 @@ int detach_filesystem( const char * const prefix )
                 /* We found the filesystem, now go through and close every open file handle */
                 for( int j = 0; j < MAX_OPEN_HANDLES; j++ )
                 {
-                    if( handles[j].fileno > 0 && handles[j].fs_mapping == i )
+                    if( handles[j].fs && handles[j].fs_mapping == i )
                     {
-                        close( handles[j].fileno );
+                        close( j + FIRST_FILENO );
                     }
                 }
 
@@ -425,6 +477,7 @@ int detach_filesystem( const char * const prefix )
                 free( filesystems[i].prefix );
                 filesystems[i].prefix = 0;
                 filesystems[i].fs = 0;
+                __rebuild_fs_hash();
 
                 /* All went well */
                 return 0;
@@ -437,6 +490,27 @@ int detach_filesystem( const char * const prefix )
     return -2;
 }
 
+/**
+ * @brief Get the open handle structure of a file handle
+ *
+ * @param[in] fileno
+ *            File handle
+ *
+ * @return Pointer to the open handle structure or null if the handle is not open.
+ */
+static inline fs_handle_t *__get_fs_slot( int fileno )
+{
+    unsigned int idx = fileno - FIRST_FILENO;
+
+    /* Also rejects STDIN, STDOUT, STDERR and negative handles */
+    if( idx >= MAX_OPEN_HANDLES || !handles[idx].fs )
+    {
+        return 0;
+    }
+
+    return &handles[idx];
+}
+
 /**
  * @brief Get a filesystem pointer by handle
  *
@@ -449,23 +523,9 @@ int detach_filesystem( const char * const prefix )
  */
 static filesystem_t *__get_fs_pointer_by_handle( int fileno )
 {
-    /* Invalid */
-    if( fileno <= 0 )
-    {
-        return 0;
-    }
-
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++ )
-    {
-        if( handles[i].fileno == fileno )
-        {
-            /* Found it */
-            return filesystems[handles[i].fs_mapping].fs;
-        }
-    }
+    fs_handle_t *slot = __get_fs_slot( fileno );
 
-    /* Couldn't find it */
-    return 0;
+    return slot ? slot->fs : 0;
 }
 
 /**
@@ -484,15 +544,23 @@ static int __get_fs_link_by_name( const char * const name )
         return -1;
     }
 
-    for( int i = 0; i < MAX_FILESYSTEMS; i++ )
+    int len;
+    uint32_t hash = __prefix_hash( name, &len );
+
+    if( !len )
     {
-        if( filesystems[i].prefix )
+        /* No prefix */
+        return -1;
+    }
+
+    for( uint32_t b = hash & (FS_HASH_SIZE - 1); fs_hash[b] >= 0; b = (b + 1) & (FS_HASH_SIZE - 1) )
+    {
+        int i = fs_hash[b];
+
+        if( filesystems[i].hash == hash && __strncmp( filesystems[i].prefix, name, len ) == 0 )
         {
-            if( __strncmp( filesystems[i].prefix, name, __strlen( filesystems[i].prefix ) ) == 0 )
-            {
-                /* Found it */
-                return i;
-            }
+            /* Found it */
+            return i;
         }
     }
 
@@ -533,23 +601,9 @@ static filesystem_t *__get_fs_pointer_by_name( const char * const name )
  */
 static void *__get_fs_handle( int fileno )
 {
-    /* Invalid */
-    if( fileno <= 0 )
-    {
-        return 0;
-    }
+    fs_handle_t *slot = __get_fs_slot( fileno );
 
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++ )
-    {
-        if( handles[i].fileno == fileno )
-        {
-            /* Found it */
-            return handles[i].handle;
-        }
-    }
-
-    /* Couldn't find it */
-    return 0;
+    return slot ? slot->handle : 0;
 }
 
 /**
@@ -593,14 +647,14 @@ int close( int fildes )
     }
 
     /* Free the open file handle */
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++)
+    int idx = fildes - FIRST_FILENO;
+    handles[idx].fs = 0;
+    handles[idx].fs_mapping = 0;
+    handles[idx].handle = NULL;
+
+    if( idx < handles_free )
     {
-        if( handles[i].fileno == fildes )
-        {
-            handles[i].fs_mapping = 0;
-            handles[i].handle = NULL;
-            handles[i].fileno = 0;
-        }
+        handles_free = idx;
     }
 
     if( fs->close == 0 )
@@ -856,14 +910,16 @@ int lseek( int file, int ptr, int dir )
  */
 int open( const char *file, int flags, ... )
 {
-    filesystem_t *fs = __get_fs_pointer_by_name( file );
+    int mapping = __get_fs_link_by_name( file );
 
-    if( fs == 0 )
+    if( mapping < 0 )
     {
         errno = EINVAL;
         return -1;
     }
 
+    filesystem_t *fs = filesystems[mapping].fs;
+
     if( fs->open == 0 )
     {
         /* Filesystem doesn't support open */
@@ -882,21 +938,13 @@ int open( const char *file, int flags, ... )
         va_end (ap);
     }
 
-    /* Do we have room for a new file? */
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++ )
+    /* Do we have room for a new file? Like POSIX, give out the lowest free handle */
+    for( int i = handles_free; i < MAX_OPEN_HANDLES; i++ )
     {
-        if( handles[i].fileno == 0 )
+        if( !handles[i].fs )
         {
-            /* Yes, we have room, try the open */
-            int mapping = __get_fs_link_by_name( file );
-
-            if( mapping < 0 )
-            {
-                errno = ENOMEM;
-                return -1;
-            }
-
-            /* Cast away const from the file name.
+            /* Yes, we have room, try the open.
+               Cast away const from the file name.
                open used to mistakenly take a char* instead of a const char*,
                and we don't want to break existing code for filesystem_t.open,
                so filesystem_t.open still takes char* */
@@ -905,12 +953,13 @@ int open( const char *file, int flags, ... )
             if( ptr )
             {
                 /* Create new internal handle */
-                handles[i].fileno = __get_new_handle();
+                handles[i].fs = fs;
                 handles[i].handle = ptr;
                 handles[i].fs_mapping = mapping;
+                handles_free = i + 1;
 
                 /* Return our own handle */
-                return handles[i].fileno;
+                return i + FIRST_FILENO;
             }
             else
             {
@@ -983,6 +1032,69 @@ int read( int file, char *ptr, int len )
     }
 }
 
+/**
+ * @brief Read multiple ranges of a file
+ *
+ * Each range specifies the offset within the file and the buffer to read into.
+ * The current position of the file is not changed.  Filesystems that support
+ * it (like DragonFS) perform all the transfers in one batch; for the others,
+ * each range is read with a seek and a read.
+ *
+ * @param[in] file
+ *            File handle
+ * @param[in] iov
+ *            Array of ranges to read
+ * @param[in] iovcnt
+ *            Number of ranges in iov
+ *
+ * @return Total number of bytes read or a negative value on error.
+ */
+int fs_readv( int file, fs_iovec_t *iov, int iovcnt )
+{
+    filesystem_t *fs = __get_fs_pointer_by_handle( file );
+    void *handle = __get_fs_handle( file );
+
+    if( fs == 0 || iovcnt < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( fs->readv )
+    {
+        return fs->readv( handle, iov, iovcnt );
+    }
+
+    if( fs->read == 0 || fs->lseek == 0 )
+    {
+        /* Filesystem doesn't support read */
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Emulate it with a sequence of seeks and reads */
+    int pos = fs->lseek( handle, 0, SEEK_CUR );
+    int total = 0;
+
+    for( int i = 0; i < iovcnt; i++ )
+    {
+        fs->lseek( handle, iov[i].offset, SEEK_SET );
+
+        int ret = fs->read( handle, iov[i].buf, iov[i].len );
+        if( ret < 0 )
+        {
+            total = ret;
+            break;
+        }
+
+        total += ret;
+    }
+
+    fs->lseek( handle, pos, SEEK_SET );
+
+    return total;
+}
+
 /**
  * @brief Read a link
  *
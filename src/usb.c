@@ -290,6 +290,7 @@ static inline u32 usb_io_read(u32 pi_address)
         #endif
         return value;
     #else
+        DMA_STATS_TAG_SCOPE(DMA_TAG_DEBUG);
         return io_read(pi_address);
     #endif
 }
@@ -312,6 +313,7 @@ static inline void usb_io_write(u32 pi_address, u32 value)
             osPiWriteIo(pi_address, value);
         #endif
     #else
+        DMA_STATS_TAG_SCOPE(DMA_TAG_DEBUG);
         io_write(pi_address, value);
     #endif
 }
@@ -338,6 +340,7 @@ static inline void usb_dma_read(void *ram_address, u32 pi_address, size_t size)
             osRecvMesg(&dmaMessageQ, NULL, OS_MESG_BLOCK);
         #endif
     #else
+        DMA_STATS_TAG_SCOPE(DMA_TAG_DEBUG);
         data_cache_hit_writeback_invalidate(ram_address, size);
         dma_read(ram_address, pi_address, size);
     #endif
@@ -364,6 +367,7 @@ static inline void usb_dma_write(void *ram_address, u32 pi_address, size_t size)
             osRecvMesg(&dmaMessageQ, NULL, OS_MESG_BLOCK);
         #endif
     #else
+        DMA_STATS_TAG_SCOPE(DMA_TAG_DEBUG);
         data_cache_hit_writeback(ram_address, size);
         dma_write(ram_address, pi_address, size);
     #endif
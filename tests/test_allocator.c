@@ -0,0 +1,105 @@
+
+void test_allocator_pool(TestContext *ctx) {
+	pool_t pool;
+	pool_init(&pool, 20, 8, 0);
+	DEFER(pool_close(&pool));
+
+	// Randomly allocate and free elements, filling each element with a
+	// pattern to check that no two live elements overlap.
+	#define NUM_SLOTS 128
+	uint32_t *slots[NUM_SLOTS] = {0};
+	int live = 0;
+	for (int i = 0; i < 4096; i++) {
+		int idx = RANDN(NUM_SLOTS);
+		if (slots[idx]) {
+			for (int j = 0; j < 5; j++)
+				ASSERT_EQUAL_HEX(slots[idx][j], idx*0x01010101, "element %d corrupted", idx);
+			pool_free(&pool, slots[idx]);
+			slots[idx] = NULL;
+			live--;
+		} else {
+			slots[idx] = pool_alloc(&pool);
+			ASSERT(slots[idx], "allocation failed");
+			ASSERT_EQUAL_HEX((uint32_t)slots[idx] & 7, 0, "element not aligned");
+			for (int j = 0; j < 5; j++)
+				slots[idx][j] = idx*0x01010101;
+			live++;
+		}
+	}
+
+	alloc_stats_t stats;
+	pool_get_stats(&pool, &stats);
+	ASSERT_EQUAL_UNSIGNED(stats.used, live*24, "invalid used memory");
+	ASSERT(stats.peak <= NUM_SLOTS*24, "invalid peak");
+	ASSERT(stats.capacity >= stats.peak, "capacity smaller than peak");
+	ASSERT_EQUAL_UNSIGNED(stats.num_failures, 0, "unexpected failures");
+
+	// Freed elements are reused before growing the pool
+	for (int i = 0; i < NUM_SLOTS; i++) {
+		pool_free(&pool, slots[i]);
+		slots[i] = NULL;
+	}
+	size_t capacity = stats.capacity;
+	for (int i = 0; i < stats.peak / 24; i++)
+		slots[i] = pool_alloc(&pool);
+	pool_get_stats(&pool, &stats);
+	ASSERT_EQUAL_UNSIGNED(stats.capacity, capacity, "pool grew while free elements were available");
+	for (int i = 0; i < NUM_SLOTS; i++)
+		pool_free(&pool, slots[i]);
+	#undef NUM_SLOTS
+}
+
+void test_allocator_arena(TestContext *ctx) {
+	arena_t arena;
+	arena_init(&arena, 1024, 0);
+	DEFER(arena_close(&arena));
+
+	// Allocations are contiguous and aligned
+	uint8_t *a = arena_alloc(&arena, 3);
+	uint8_t *b = arena_alloc(&arena, 8);
+	ASSERT_EQUAL_HEX((uint32_t)a & 7, 0, "allocation not aligned");
+	ASSERT(b == a + 8, "allocations not contiguous");
+	uint8_t *c = arena_alloc_aligned(&arena, 16, 64);
+	ASSERT_EQUAL_HEX((uint32_t)c & 63, 0, "allocation not aligned");
+
+	// Fill the arena until it is exhausted
+	int count = 0;
+	while (arena_alloc(&arena, 64)) count++;
+	ASSERT(count > 0 && count < 16, "invalid number of allocations: %d", count);
+
+	alloc_stats_t stats;
+	arena_get_stats(&arena, &stats);
+	ASSERT_EQUAL_UNSIGNED(stats.capacity, 1024, "invalid capacity");
+	ASSERT_EQUAL_UNSIGNED(stats.num_failures, 1, "invalid number of failures");
+	ASSERT_EQUAL_UNSIGNED(stats.num_allocs, count+3, "invalid number of allocations");
+	ASSERT(stats.used > 1024-64, "arena not filled");
+
+	// Reset releases everything at once
+	arena_reset(&arena);
+	ASSERT(arena_alloc(&arena, 3) == a, "reset did not rewind the arena");
+	arena_get_stats(&arena, &stats);
+	ASSERT_EQUAL_UNSIGNED(stats.used, 8, "invalid used memory after reset");
+	ASSERT(stats.peak > 1024-64, "peak lost after reset");
+}
+
+void test_allocator_uncached(TestContext *ctx) {
+	pool_t pool;
+	pool_init(&pool, 20, 4, ALLOC_UNCACHED);
+	DEFER(pool_close(&pool));
+	arena_t arena;
+	arena_init(&arena, 256, ALLOC_UNCACHED);
+	DEFER(arena_close(&arena));
+
+	// Memory is returned in the uncached segment, covering whole cachelines
+	for (int i = 0; i < 8; i++) {
+		uint32_t *p = pool_alloc(&pool);
+		ASSERT_EQUAL_HEX((uint32_t)p & 0xE000000F, 0xA0000000, "invalid uncached element");
+		uint32_t *q = arena_alloc(&arena, 4);
+		ASSERT_EQUAL_HEX((uint32_t)q & 0xE000000F, 0xA0000000, "invalid uncached allocation");
+		*p = *q = i;
+	}
+
+	alloc_stats_t stats;
+	pool_get_stats(&pool, &stats);
+	ASSERT_EQUAL_UNSIGNED(stats.used, 8*32, "invalid used memory");
+}
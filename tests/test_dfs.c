@@ -1,3 +1,4 @@
+#include <system.h>
 
 void test_dfs_read(TestContext *ctx) {
 	int fh = dfs_open("counter.dat");
@@ -88,3 +89,316 @@ void test_dfs_rom_addr(TestContext *ctx) {
 
 	ASSERT_EQUAL_MEM(buf1, buf2, 128, "DMA ROM access is different");
 }
+
+void test_dfs_open_paths(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	int size = dfs_size(fh);
+	dfs_close(fh);
+
+	// These are resolved through the path hash table or by walking
+	// directories: the results must be the same.
+	const char *paths[] = { "/counter.dat", "//counter.dat", "./counter.dat", "/./counter.dat" };
+	for (int i=0;i<sizeof(paths)/sizeof(paths[0]);i++) {
+		fh = dfs_open(paths[i]);
+		ASSERT(fh >= 0, "%s not found", paths[i]);
+		ASSERT_EQUAL_SIGNED(dfs_size(fh), size, "wrong size for %s", paths[i]);
+		dfs_close(fh);
+	}
+
+	ASSERT_EQUAL_SIGNED(dfs_open("missing.dat"), DFS_ENOFILE, "missing file found");
+	ASSERT_EQUAL_SIGNED(dfs_open("/counter.dat/x"), DFS_ENOFILE, "file used as directory");
+	// Not in the image, but it has the same path hash and leaf name as counter.dat
+	ASSERT_EQUAL_SIGNED(dfs_open("GVajaalK/counter.dat"), DFS_ENOFILE, "path hash collision not detected");
+	ASSERT_EQUAL_HEX(dfs_rom_addr("/missing.dat"), 0, "missing file found by dfs_rom_addr");
+	ASSERT(dfs_rom_addr("/counter.dat") == dfs_rom_addr("./counter.dat"), "dfs_rom_addr mismatch");
+}
+
+void test_dfs_sector_cache(TestContext *ctx) {
+	char name[MAX_FILENAME_LEN+1];
+	dfs_cache_stats_t stats;
+	DEFER(dfs_set_sector_cache(DFS_DEFAULT_SECTOR_CACHE_SIZE));
+
+	// Listing the same directory twice must be served from the cache
+	dfs_set_sector_cache(DFS_DEFAULT_SECTOR_CACHE_SIZE);
+	dfs_reset_cache_stats();
+	ASSERT(dfs_dir_findfirst("/", name) >= 0, "cannot list root directory");
+	dfs_get_cache_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.hits, 0, "unexpected cache hits");
+	uint32_t misses = stats.misses;
+	ASSERT(misses > 0, "no sector read");
+
+	ASSERT(dfs_dir_findfirst("/", name) >= 0, "cannot list root directory");
+	dfs_get_cache_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.misses, misses, "unexpected cache misses");
+	ASSERT_EQUAL_UNSIGNED(stats.hits, misses, "unexpected cache hits");
+
+	// With the cache disabled, everything is read again
+	dfs_set_sector_cache(0);
+	dfs_reset_cache_stats();
+	ASSERT(dfs_dir_findfirst("/", name) >= 0, "cannot list root directory");
+	ASSERT(dfs_dir_findfirst("/", name) >= 0, "cannot list root directory");
+	dfs_get_cache_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.hits, 0, "cache hits with disabled cache");
+	ASSERT_EQUAL_UNSIGNED(stats.misses, misses*2, "wrong number of misses");
+}
+
+static volatile int dfs_async_done;
+static volatile int dfs_async_bytes;
+
+static void dfs_async_cb(int len, void *ctx) {
+	dfs_async_done++;
+	dfs_async_bytes += len;
+	// Completions must come in order
+	*(int*)ctx = dfs_async_done;
+}
+
+void test_dfs_read_async(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	uint8_t abuf[1024] __attribute__((aligned(16)));
+	uint8_t ubuf[1024+3] __attribute__((aligned(16)));
+	int order[4] = {0};
+
+	dfs_async_done = 0;
+	dfs_async_bytes = 0;
+	memset(abuf, 0xAA, sizeof(abuf));
+	memset(ubuf, 0xAA, sizeof(ubuf));
+
+	// Aligned (direct DMA), then unaligned buffer and offset (bounce buffer),
+	// then another aligned one: all queued together.
+	ASSERT_EQUAL_SIGNED(dfs_read_async(fh, abuf, 512, dfs_async_cb, &order[0]), 512, "invalid async read");
+	dfs_seek(fh, 3, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(dfs_read_async(fh, ubuf+1, 1000, dfs_async_cb, &order[1]), 1000, "invalid async read");
+	dfs_seek(fh, 4096-16, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(dfs_read_async(fh, abuf+512, 64, dfs_async_cb, &order[2]), 16, "async read not clamped");
+	ASSERT_EQUAL_SIGNED(dfs_tell(fh), 4096, "location not advanced");
+
+	unsigned long time_start = get_ticks_ms();
+	while (dfs_async_done < 3) {
+		ASSERT(get_ticks_ms() - time_start < 100, "async reads not completed (%d/3)", dfs_async_done);
+	}
+
+	ASSERT_EQUAL_SIGNED(dfs_async_bytes, 512+1000+16, "wrong number of bytes read");
+	ASSERT(order[0] == 1 && order[1] == 2 && order[2] == 3, "completions out of order");
+
+	for (int i=0;i<512;i++)
+		ASSERT_EQUAL_HEX(abuf[i], i & 0xFF, "invalid aligned data at %d", i);
+	for (int i=0;i<1000;i++)
+		ASSERT_EQUAL_HEX(ubuf[i+1], (i+3) & 0xFF, "invalid unaligned data at %d", i);
+	ASSERT_EQUAL_HEX(ubuf[0], 0xAA, "unaligned buffer underflow");
+	ASSERT_EQUAL_HEX(ubuf[1001], 0xAA, "unaligned buffer overflow");
+	for (int i=0;i<16;i++)
+		ASSERT_EQUAL_HEX(abuf[512+i], (4096-16+i) & 0xFF, "invalid tail data at %d", i);
+}
+
+void test_dfs_compressed(TestContext *ctx) {
+	int fh = dfs_open("compressed.dat");
+	ASSERT(fh >= 0, "compressed.dat not found");
+	DEFER(dfs_close(fh));
+
+	ASSERT_EQUAL_SIGNED(dfs_size(fh), 40000, "wrong uncompressed size");
+	ASSERT_EQUAL_HEX(dfs_rom_addr("compressed.dat"), 0, "compressed file has a ROM address");
+
+	static uint8_t buf[40000+2];
+
+	// Whole file at once
+	memset(buf, 0xAA, sizeof(buf));
+	ASSERT_EQUAL_SIGNED(dfs_read(buf, 1, 40000, fh), 40000, "short read");
+	for (int i=0;i<40000;i++)
+		ASSERT_EQUAL_HEX(buf[i], (i/7)&0xFF, "invalid data at %d", i);
+	ASSERT_EQUAL_HEX(buf[40000], 0xAA, "buffer overflow");
+	ASSERT(dfs_eof(fh), "not at EOF");
+
+	// Random seeks, including reads that cross chunk boundaries
+	for (int i=0;i<64;i++) {
+		int seek = RANDN(40000);
+		int len = RANDN(9000)+1;
+		uint8_t *ubuf = buf+RANDN(2);
+
+		dfs_seek(fh, seek, SEEK_SET);
+		int read = dfs_read(ubuf, 1, len, fh);
+		if (seek+len > 40000) len = 40000-seek;
+		ASSERT_EQUAL_SIGNED(read, len, "short read at %d", seek);
+		for (int j=0;j<len;j++)
+			ASSERT_EQUAL_HEX(ubuf[j], ((seek+j)/7)&0xFF, "invalid data at %d+%d", seek, j);
+	}
+}
+
+void test_dfs_compressed_open(TestContext *ctx) {
+	// Initialize again on the test ROM image, which is built by mkdfs with
+	// a path hash table and with compressed.dat stored compressed.
+	ASSERT_EQUAL_SIGNED(dfs_init(DFS_DEFAULT_LOCATION), DFS_ESUCCESS, "cannot initialize DFS");
+	ASSERT_EQUAL_HEX(dfs_rom_addr("compressed.dat"), 0, "compressed.dat not stored compressed");
+
+	// Open through the path hash table, by walking directories, and through stdio
+	const char *paths[] = { "compressed.dat", "/./compressed.dat" };
+	uint8_t buf[64];
+	for (int i=0;i<sizeof(paths)/sizeof(paths[0]);i++) {
+		int fh = dfs_open(paths[i]);
+		ASSERT(fh >= 0, "%s not found: %d", paths[i], fh);
+		memset(buf, 0xAA, sizeof(buf));
+		int read = dfs_read(buf, 1, sizeof(buf), fh);
+		dfs_close(fh);
+		ASSERT_EQUAL_SIGNED(read, sizeof(buf), "short read on %s", paths[i]);
+		for (int j=0;j<sizeof(buf);j++)
+			ASSERT_EQUAL_HEX(buf[j], (j/7)&0xFF, "invalid data at %d on %s", j, paths[i]);
+	}
+
+	FILE *f = fopen("rom:/compressed.dat", "rb");
+	ASSERT(f, "cannot fopen compressed.dat");
+	DEFER(fclose(f));
+	fseek(f, 20000, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(fread(buf, 1, sizeof(buf), f), sizeof(buf), "short fread");
+	for (int j=0;j<sizeof(buf);j++)
+		ASSERT_EQUAL_HEX(buf[j], ((20000+j)/7)&0xFF, "invalid data at %d via stdio", 20000+j);
+}
+
+void test_dfs_stream(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	ASSERT_EQUAL_SIGNED(dfs_stream_enable(fh, 512), DFS_ESUCCESS, "cannot enable streaming");
+
+	uint8_t buf[16] __attribute__((aligned(16)));
+
+	// Sequential small reads, like a parser would do
+	for (int pos=0; pos<4096; ) {
+		uint8_t *ubuf = buf + 1 + RANDN(2);
+		int len = 1 + RANDN(7);
+		int read = dfs_read(ubuf, 1, len, fh);
+		if (pos+len > 4096) len = 4096-pos;
+		ASSERT_EQUAL_SIGNED(read, len, "short read at %d", pos);
+		for (int i=0;i<len;i++)
+			ASSERT_EQUAL_HEX(ubuf[i], (pos+i)&0xFF, "invalid data at %d", pos+i);
+		pos += len;
+	}
+
+	dfs_stream_stats_t stats;
+	dfs_stream_get_stats(fh, &stats);
+	LOG("stream stats: hits:%ld waits:%ld misses:%ld\n", stats.hits, stats.waits, stats.misses);
+	ASSERT_EQUAL_UNSIGNED(stats.misses, 1, "only the first read should miss");
+	ASSERT(stats.hits + stats.waits > 4096/8, "too few reads from the window");
+
+	// A seek outside of the window misses again
+	dfs_seek(fh, 100, SEEK_SET);
+	dfs_read(buf+1, 1, 4, fh);
+	ASSERT_EQUAL_MEM(buf+1, (uint8_t*)"\x64\x65\x66\x67", 4, "invalid data after seek");
+	dfs_stream_get_stats(fh, &stats);
+	ASSERT_EQUAL_UNSIGNED(stats.misses, 2, "seek should miss");
+}
+
+void test_dfs_extent(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	dfs_extent_t ext;
+	ASSERT_EQUAL_SIGNED(dfs_extent(fh, &ext), DFS_ESUCCESS, "cannot get extent");
+	ASSERT_EQUAL_UNSIGNED(ext.size, 4096, "invalid extent size");
+	ASSERT_EQUAL_HEX(ext.pi_address, dfs_rom_addr("counter.dat") & 0x1FFFFFFF, "invalid extent address");
+	ASSERT(ext.alignment >= 2, "invalid extent alignment");
+
+	// Sub-range into RDRAM
+	uint8_t buf[64] __attribute__((aligned(16)));
+	ASSERT_EQUAL_SIGNED(dfs_extent_read(&ext, 100, buf, 50), DFS_ESUCCESS, "cannot read extent");
+	for (int i=0;i<50;i++)
+		ASSERT_EQUAL_HEX(buf[i], (100+i)&0xFF, "invalid data at %d", i);
+	ASSERT_EQUAL_SIGNED(dfs_extent_read(&ext, 4000, buf, 200), DFS_EBADINPUT, "read past the end");
+	ASSERT_EQUAL_SIGNED(dfs_extent_read(&ext, 100, buf+1, 8), DFS_EBADINPUT, "misaligned read");
+
+	// Into a surface with padded stride
+	uint16_t pixels[4*8] __attribute__((aligned(16)));
+	memset(pixels, 0, sizeof(pixels));
+	surface_t surf = surface_make(pixels, FMT_RGBA16, 3, 4, 8*2);
+	ASSERT_EQUAL_SIGNED(dfs_extent_read_surface(&ext, 256, &surf), DFS_ESUCCESS, "cannot read surface");
+	for (int y=0;y<4;y++) {
+		uint8_t *row = (uint8_t*)pixels + y*16;
+		for (int x=0;x<6;x++)
+			ASSERT_EQUAL_HEX(row[x], (y*6+x)&0xFF, "invalid pixel data at %d,%d", x, y);
+		ASSERT_EQUAL_HEX(row[6], 0, "stride padding overwritten at row %d", y);
+	}
+
+	// Compressed files have no extent
+	int fhc = dfs_open("compressed.dat");
+	ASSERT(fhc >= 0, "compressed.dat not found");
+	DEFER(dfs_close(fhc));
+	ASSERT_EQUAL_SIGNED(dfs_extent(fhc, &ext), DFS_EBADINPUT, "compressed file has an extent");
+}
+
+void test_dfs_handles(TestContext *ctx) {
+	static int fhs[DFS_DEFAULT_MAX_OPEN_FILES];
+	int n = 0;
+	DEFER(for (int i=0;i<n;i++) dfs_close(fhs[i]));
+
+	// Fill the table: it must grow up to the configured maximum
+	for (n=0; n<DFS_DEFAULT_MAX_OPEN_FILES; n++) {
+		fhs[n] = dfs_open("counter.dat");
+		ASSERT(fhs[n] > 0, "cannot open file #%d: %d", n, fhs[n]);
+	}
+	ASSERT_EQUAL_SIGNED(dfs_open("counter.dat"), DFS_ENOMEM, "too many files open");
+
+	// Every handle refers to its own file position
+	for (int i=0;i<n;i++)
+		dfs_seek(fhs[i], i, SEEK_SET);
+	for (int i=0;i<n;i++) {
+		uint8_t b;
+		ASSERT_EQUAL_SIGNED(dfs_read(&b, 1, 1, fhs[i]), 1, "short read on file #%d", i);
+		ASSERT_EQUAL_HEX(b, i, "invalid data on file #%d", i);
+	}
+
+	// Stale handles are rejected even when the slot is reused
+	int old = fhs[5];
+	ASSERT_EQUAL_SIGNED(dfs_close(old), DFS_ESUCCESS, "cannot close file");
+	fhs[5] = dfs_open("counter.dat");
+	ASSERT(fhs[5] > 0, "cannot reopen file");
+	ASSERT(fhs[5] != old, "handle reused");
+	ASSERT_EQUAL_SIGNED(dfs_tell(old), DFS_EBADHANDLE, "stale handle accepted");
+	ASSERT_EQUAL_SIGNED(dfs_close(old), DFS_EBADHANDLE, "stale handle closed");
+	ASSERT_EQUAL_SIGNED(dfs_tell(fhs[5]), 0, "invalid position of reopened file");
+}
+
+void test_dfs_readv(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	static uint8_t buf[1024] __attribute__((aligned(16)));
+	memset(buf, 0xAA, sizeof(buf));
+
+	fs_iovec_t iov[] = {
+		{ buf+512, 2000, 100 },     // out of order
+		{ buf+0,   0,    64  },     // header
+		{ buf+64,  64,   192 },     // contiguous with the header: merged
+		{ buf+257, 301,  17  },     // unaligned: bounce buffer
+		{ buf+768, 4090, 100 },     // shortened at EOF
+		{ buf+900, 5000, 16  },     // past EOF
+	};
+
+	dfs_seek(fh, 123, SEEK_SET);
+	int ret = dfs_readv(fh, iov, sizeof(iov)/sizeof(iov[0]));
+	ASSERT_EQUAL_SIGNED(ret, 100+64+192+17+6, "invalid readv result");
+	ASSERT_EQUAL_SIGNED(dfs_tell(fh), 123, "readv moved the file position");
+
+	for (int i=0;i<4;i++) {
+		uint8_t *data = iov[i].buf;
+		for (int j=0;j<iov[i].len;j++)
+			ASSERT_EQUAL_HEX(data[j], (iov[i].offset+j)&0xFF, "invalid data in range %d at %d", i, j);
+	}
+	ASSERT_EQUAL_MEM(buf+768, (uint8_t*)"\xFA\xFB\xFC\xFD\xFE\xFF\xAA", 7, "invalid data at EOF");
+	ASSERT_EQUAL_HEX(buf[256], 0xAA, "overflow before unaligned range");
+	ASSERT_EQUAL_HEX(buf[257+17], 0xAA, "overflow after unaligned range");
+	ASSERT_EQUAL_HEX(buf[900], 0xAA, "read past EOF");
+
+	// Same through the newlib hook
+	int fd = open("rom:/counter.dat", O_RDONLY);
+	ASSERT(fd >= 0, "cannot open rom:/counter.dat");
+	DEFER(close(fd));
+	memset(buf, 0xAA, sizeof(buf));
+	ASSERT_EQUAL_SIGNED(fs_readv(fd, iov, 2), 164, "invalid fs_readv result");
+	for (int j=0;j<64;j++)
+		ASSERT_EQUAL_HEX(buf[j], j, "invalid data at %d", j);
+}
@@ -27,3 +27,125 @@ void test_dma_read_misalign(TestContext *ctx) {
 		}
 	}
 }
+
+void test_dma_queue(TestContext *ctx) {
+	uint32_t rom = PhysicalAddr(dfs_rom_addr("counter.dat"));
+	static uint8_t ram[4][1100] __attribute__((aligned(16)));
+	static volatile int order[6]; static volatile int done;
+
+	void cb(void *arg) { order[done++] = (int)arg; }
+
+	// Any alignment, including RAM/ROM with different 2-byte phase
+	static const int offsets[][3] = {
+		{ 0, 0, 1024 }, { 3, 5, 1000 }, { 2, 1, 777 }, { 8, 7, 1 },
+	};
+	memset(ram, 0xAA, sizeof(ram));
+	data_cache_hit_writeback_invalidate(ram, sizeof(ram));
+	done = 0;
+	for (int i=0;i<4;i++) {
+		bool ok = dma_queue_read(ram[i]+offsets[i][0], rom+offsets[i][1], offsets[i][2],
+			DMA_PRIORITY_NORMAL, cb, (void*)i);
+		ASSERT(ok, "cannot queue read %d", i);
+	}
+	dma_queue_wait();
+	ASSERT_EQUAL_SIGNED(done, 4, "missing callbacks");
+	for (int i=0;i<4;i++) {
+		ASSERT_EQUAL_SIGNED(order[i], i, "reads completed out of order");
+		uint8_t *data = ram[i]+offsets[i][0];
+		for (int j=0;j<offsets[i][2];j++)
+			ASSERT_EQUAL_HEX(data[j], (offsets[i][1]+j)&0xFF, "invalid data in read %d at %d", i, j);
+		ASSERT_EQUAL_HEX(data[offsets[i][2]], 0xAA, "overflow in read %d", i);
+		if (offsets[i][0])
+			ASSERT_EQUAL_HEX(data[-1], 0xAA, "underflow in read %d", i);
+	}
+
+	// A high priority read queued behind bulk reads completes first
+	static uint8_t bulk[2][32768] __attribute__((aligned(16)));
+	data_cache_hit_writeback_invalidate(bulk, sizeof(bulk));
+	data_cache_hit_writeback_invalidate(ram, sizeof(ram));
+	done = 0;
+	disable_interrupts();
+	dma_queue_read(bulk[0], rom, 32768, DMA_PRIORITY_LOW, cb, (void*)0);
+	dma_queue_read(bulk[1], rom, 32768, DMA_PRIORITY_LOW, cb, (void*)1);
+	dma_queue_read(ram[0], rom, 64, DMA_PRIORITY_HIGH, cb, (void*)2);
+	enable_interrupts();
+	dma_queue_wait();
+	ASSERT_EQUAL_SIGNED(done, 3, "missing callbacks");
+	ASSERT_EQUAL_SIGNED(order[0], 2, "high priority read not first");
+	ASSERT_EQUAL_SIGNED(order[1], 0, "bulk reads out of order");
+	ASSERT_EQUAL_SIGNED(order[2], 1, "bulk reads out of order");
+}
+
+void test_dma_read_any(TestContext *ctx) {
+	uint32_t rom = PhysicalAddr(dfs_rom_addr("random.dat"));
+	static uint8_t rom_copy[8192] __attribute__((aligned(16)));
+	static uint8_t ram[8192+64] __attribute__((aligned(16)));
+
+	data_cache_hit_writeback_invalidate(rom_copy, sizeof(rom_copy));
+	dma_read(rom_copy, rom, 8192);
+
+	static const uint8_t expAA[16] = { 0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA, };
+
+	void run(int ram_offset, int rom_offset, int length) {
+		memset(ram, 0xAA, sizeof(ram));
+		dma_read_any(ram+ram_offset, rom+rom_offset, length);
+
+		ASSERT_EQUAL_MEM(ram+ram_offset-16, expAA, 16, "invalid prefix [%d/%d/%d]", ram_offset, rom_offset, length);
+		ASSERT_EQUAL_MEM(ram+ram_offset, rom_copy+rom_offset, length, "invalid data [%d/%d/%d]", ram_offset, rom_offset, length);
+		ASSERT_EQUAL_MEM(ram+ram_offset+length, expAA, 16, "invalid suffix [%d/%d/%d]", ram_offset, rom_offset, length);
+	}
+
+	// Both phases, all RDRAM misalignments, short and multi-chunk lengths
+	static const int lengths[] = { 1, 2, 7, 8, 9, 127, 128, 1000, 4093, 4094, 4095, 8000 };
+	for (int i=16; i<24; i++) {
+		for (int j=0; j<2; j++) {
+			for (int k=0; k<sizeof(lengths)/sizeof(lengths[0]); k++) {
+				run(i, j, lengths[k]);
+				if (ctx->result == TEST_FAILED)
+					return;
+			}
+		}
+	}
+
+	// Throughput of a large transfer with different phase
+	uint32_t t0 = TICKS_READ();
+	dma_read_any(ram+17, rom, 8000);
+	uint32_t t1 = TICKS_READ();
+	dma_read(rom_copy, rom, 8000);
+	uint32_t t2 = TICKS_READ();
+	LOG("dma_read_any: %ld ticks, aligned dma_read: %ld ticks (8000 bytes)\n",
+		TICKS_DISTANCE(t0, t1), TICKS_DISTANCE(t1, t2));
+}
+
+void test_dma_stats(TestContext *ctx) {
+	uint32_t rom = PhysicalAddr(dfs_rom_addr("random.dat"));
+	static uint8_t ram[1024] __attribute__((aligned(16)));
+	dma_stats_t stats;
+
+	dma_stats_reset();
+	{
+		DMA_STATS_TAG_SCOPE(DMA_TAG_USER0);
+		data_cache_hit_writeback_invalidate(ram, sizeof(ram));
+		dma_read(ram, rom, 1024);
+		dma_read(ram, rom, 512);
+		io_read(rom);
+	}
+	dma_read(ram, rom, 64);
+	dma_stats_get(&stats);
+
+	dma_tag_stats_t *user = &stats.tags[DMA_TAG_USER0];
+	ASSERT_EQUAL_UNSIGNED(user->dma_transfers, 2, "wrong number of transfers");
+	ASSERT_EQUAL_UNSIGNED(user->read_bytes, 1024+512+4, "wrong number of bytes read");
+	ASSERT_EQUAL_UNSIGNED(user->write_bytes, 0, "unexpected writes");
+	ASSERT_EQUAL_UNSIGNED(user->io_accesses, 1, "wrong number of io accesses");
+	ASSERT(user->stall_ticks > 0, "no stall time accounted");
+
+	// The tag scope was closed: further transfers go back to the previous tag
+	dma_tag_stats_t *other = &stats.tags[DMA_TAG_OTHER];
+	ASSERT_EQUAL_UNSIGNED(other->dma_transfers, 1, "tag not restored");
+	ASSERT_EQUAL_UNSIGNED(other->read_bytes, 64, "tag not restored");
+
+	dma_stats_reset();
+	dma_stats_get(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.tags[DMA_TAG_USER0].dma_transfers, 0, "reset failed");
+}
@@ -0,0 +1,47 @@
+
+void test_heapprof(TestContext *ctx) {
+	heapprof_init(1);
+	DEFER(heapprof_close());
+
+	heapprof_stats_t start, stats;
+	heapprof_get_stats(&start);
+
+	void *alloc_site(int size) {
+		return malloc(size);
+	}
+
+	// Allocate from a known site, and check that it is accounted
+	void *bufs[8];
+	for (int i = 0; i < 8; i++)
+		bufs[i] = alloc_site(1024);
+	void *ubuf = malloc_uncached(4096);
+	heapprof_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.num_allocs - start.num_allocs, 9, "invalid number of allocations");
+	ASSERT(stats.live_bytes - start.live_bytes >= 8*1024+4096, "live bytes not accounted");
+	ASSERT(stats.peak_bytes >= stats.live_bytes, "invalid peak");
+	ASSERT_EQUAL_UNSIGNED(stats.num_sampled, 9, "allocations not sampled");
+	uint32_t peak = stats.peak_bytes;
+
+	// Frees and reallocations
+	for (int i = 0; i < 8; i++)
+		free(bufs[i]);
+	free_uncached(ubuf);
+	void *r = realloc(NULL, 100);
+	r = realloc(r, 2000);
+	free(r);
+	heapprof_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.live_bytes, start.live_bytes, "live bytes not released");
+	ASSERT_EQUAL_UNSIGNED(stats.num_frees - start.num_frees, 11, "invalid number of frees");
+	ASSERT_EQUAL_UNSIGNED(stats.peak_bytes, peak, "peak changed");
+
+	// Allocations made within the C library are accounted too
+	char *s = strdup("heapprof");
+	heapprof_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.num_allocs - start.num_allocs, 12, "strdup not accounted");
+	free(s);
+	heapprof_get_stats(&stats);
+	ASSERT_EQUAL_UNSIGNED(stats.live_bytes, start.live_bytes, "strdup not released");
+
+	if (ctx->result != TEST_FAILED)
+		heapprof_dump();
+}
@@ -437,6 +437,55 @@ void test_rspq_rapid_sync(TestContext *ctx)
     }
 }
 
+static volatile int syncpoint_cb_order[8];
+static volatile int syncpoint_cb_count;
+
+static void syncpoint_cb(void *arg)
+{
+    syncpoint_cb_order[syncpoint_cb_count++] = (int)arg;
+}
+
+void test_rspq_syncpoint_callback(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    syncpoint_cb_count = 0;
+
+    // Callbacks are called in order, without waiting on the CPU
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 50; j++)
+            rspq_test_4(1);
+        rspq_syncpoint_callback(rspq_syncpoint_new(), syncpoint_cb, (void*)(i+1));
+    }
+
+    unsigned long time_start = get_ticks_ms();
+    while (syncpoint_cb_count < 4 && get_ticks_ms() - time_start < rspq_timeout) {}
+
+    ASSERT_EQUAL_SIGNED(syncpoint_cb_count, 4, "not all callbacks were called");
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQUAL_SIGNED(syncpoint_cb_order[i], i+1, "callbacks called out of order");
+
+    // A syncpoint that was already reached calls the callback immediately
+    rspq_syncpoint_t sp = rspq_syncpoint_new();
+    rspq_syncpoint_wait(sp);
+    rspq_syncpoint_callback(sp, syncpoint_cb, (void*)5);
+    ASSERT_EQUAL_SIGNED(syncpoint_cb_count, 5, "callback of reached syncpoint not called");
+    ASSERT_EQUAL_SIGNED(syncpoint_cb_order[4], 5, "wrong callback argument");
+
+    // Multiple callbacks on the same syncpoint
+    sp = rspq_syncpoint_new();
+    rspq_syncpoint_callback(sp, syncpoint_cb, (void*)6);
+    rspq_syncpoint_callback(sp, syncpoint_cb, (void*)7);
+    rspq_syncpoint_wait(sp);
+    ASSERT_EQUAL_SIGNED(syncpoint_cb_count, 7, "callbacks on the same syncpoint not called");
+    ASSERT_EQUAL_SIGNED(syncpoint_cb_order[5], 6, "callbacks called out of order");
+    ASSERT_EQUAL_SIGNED(syncpoint_cb_order[6], 7, "callbacks called out of order");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
 void test_rspq_block(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -508,6 +557,181 @@ void test_rspq_block(TestContext *ctx)
     TEST_RSPQ_EPILOG(0, rspq_timeout);
 }
 
+void test_rspq_block_finalize(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    // A block spanning several chunks
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 512; i++)
+        rspq_test_8(1);
+    rspq_block_t *b512 = rspq_block_finalize(rspq_block_end());
+    DEFER(rspq_block_free(b512));
+
+    // A block calling a finalized block, finalized as well
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 4; i++)
+        rspq_block_run(b512);
+    rspq_test_8(1);
+    rspq_block_t *b2049 = rspq_block_finalize(rspq_block_end());
+    DEFER(rspq_block_free(b2049));
+
+    // An empty block
+    rspq_block_begin();
+    rspq_block_t *bempty = rspq_block_finalize(rspq_block_end());
+    DEFER(rspq_block_free(bempty));
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_reset();
+    rspq_block_run(b512);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, 512, "sum #1 is not correct");
+    data_cache_hit_invalidate(actual_sum, 16);
+
+    rspq_test_reset();
+    rspq_block_run(bempty);
+    rspq_block_run(b2049);
+    rspq_test_8(1);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, 2050, "sum #2 is not correct");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+void test_rspq_profile(TestContext *ctx)
+{
+    if (!RSPQ_PROFILE)
+        SKIP("RSPQ_PROFILE is not enabled");
+
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_profile_reset();
+    for (int i = 0; i < 100; i++)
+        rspq_test_8(1);
+
+    rspq_profile_data_t data;
+    rspq_profile_get(&data);
+    int id = (test_ovl_id >> 24) + 0x1;
+    ASSERT_EQUAL_UNSIGNED(data.commands[id].count, 100, "invalid number of calls");
+    ASSERT(data.commands[id].cycles > 0, "no cycles accounted");
+    ASSERT(data.total_cycles >= data.commands[id].cycles, "invalid total cycles");
+
+    rspq_profile_dump();
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+void test_rspq_capture(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_capture_start(RSPQ_CAPTURE_MIN_SIZE);
+    DEFER(rspq_capture_stop());
+
+    rspq_block_begin();
+    for (int i = 0; i < 3; i++)
+        rspq_test_8(1);
+    rspq_block_t *block = rspq_block_end();
+    DEFER(rspq_block_free(block));
+
+    // Write enough commands to switch buffer a few times
+    for (int i = 0; i < RSPQ_DRAM_LOWPRI_BUFFER_SIZE; i++)
+        rspq_test_8(1);
+    rspq_block_run(block);
+    rspq_syncpoint_new();
+    rspq_capture_frame();
+
+    int size;
+    uint8_t *img = rspq_capture_get_image(&size);
+    DEFER(free(img));
+    ASSERT(!memcmp(img, RSPQ_CAPTURE_MAGIC, 8), "invalid magic");
+    int id = (test_ovl_id >> 24) + 0x1;
+    ASSERT_EQUAL_UNSIGNED(img[16 + id], 2, "invalid command size");
+    uint32_t nwords = ((uint32_t*)img)[3];
+    ASSERT_EQUAL_UNSIGNED(size, RSPQ_CAPTURE_HEADER_SIZE + nwords*4, "invalid image size");
+
+    // Walk the records and count the captured commands
+    uint32_t *words = (uint32_t*)(img + RSPQ_CAPTURE_HEADER_SIZE);
+    int counts[16] = {0};
+    int block_cmds = 0, lowpri_cmds = 0;
+    for (int i = 0; i < nwords; ) {
+        int type = words[i] >> 24, len = words[i] & 0xFFFFFF;
+        ASSERT(type > 0 && type < 16, "invalid record type %d", type);
+        counts[type]++;
+        for (int j = 1; j <= len && type <= RSPQ_CAPTURE_REC_BLOCK; j++) {
+            if (words[i+j] >> 24 != id) continue;
+            if (type == RSPQ_CAPTURE_REC_BLOCK) block_cmds++;
+            else lowpri_cmds++;
+            j++;
+        }
+        i += 1 + len;
+    }
+
+    ASSERT_EQUAL_SIGNED(block_cmds, 3, "invalid number of commands in the block");
+    ASSERT_EQUAL_SIGNED(lowpri_cmds, RSPQ_DRAM_LOWPRI_BUFFER_SIZE, "invalid number of commands");
+    ASSERT(counts[RSPQ_CAPTURE_REC_LOWPRI] > 2, "buffer switches not captured");
+    ASSERT_EQUAL_SIGNED(counts[RSPQ_CAPTURE_REC_BLOCK_BEGIN], 1, "block begin not captured");
+    ASSERT_EQUAL_SIGNED(counts[RSPQ_CAPTURE_REC_BLOCK_END], 1, "block end not captured");
+    ASSERT_EQUAL_SIGNED(counts[RSPQ_CAPTURE_REC_SYNCPOINT], 1, "syncpoint not captured");
+    ASSERT_EQUAL_SIGNED(counts[RSPQ_CAPTURE_REC_FRAME], 1, "frame not captured");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+// Benchmark the cost of switching overlay at every command
+void test_rspq_overlay_pingpong(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    const int num = 1000;
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_reset();
+    rspq_wait();
+
+    // Commands of a single overlay
+    uint32_t t0 = TICKS_READ();
+    for (int i = 0; i < num; i++) {
+        rspq_test_4(1);
+        rspq_test_4(1);
+    }
+    rspq_wait();
+    uint32_t same = TICKS_SINCE(t0);
+
+    // Same number of commands, alternating two overlays
+    t0 = TICKS_READ();
+    for (int i = 0; i < num; i++) {
+        rspq_test_4(1);
+        rspq_test2(i, i);
+    }
+    rspq_wait();
+    uint32_t pingpong = TICKS_SINCE(t0);
+
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, num*3, "commands were not executed");
+
+    int64_t per_switch = ((int64_t)pingpong - same) * 1000000 / TICKS_PER_SECOND * 1000 / (num*2);
+    debugf("rspq: %d commands: single overlay %lu us, ping-pong %lu us (%lld ns per overlay switch)\n",
+        num*2, same * 1000 / (TICKS_PER_SECOND/1000), pingpong * 1000 / (TICKS_PER_SECOND/1000), per_switch);
+    ASSERT(pingpong > same, "switching overlays should be slower");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
 void test_rspq_wait_sync_in_block(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -699,6 +923,144 @@ void test_rspq_highpri_overlay(TestContext *ctx)
     TEST_RSPQ_EPILOG(0, rspq_timeout);
 }
 
+void test_rspq_highpri_block(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 4096; i++) {
+        rspq_test_8(1);
+        if (i%256 == 0)
+            rspq_test_wait(0x10);
+    }
+    rspq_block_t *b4096 = rspq_block_end();
+    DEFER(rspq_block_free(b4096));
+
+    // Nested blocks for highpri. The inner block uses the same nesting
+    // level of the lowpri block, so its save slot must be relocated.
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 16; i++)
+        rspq_test_high(1);
+    rspq_block_t *inner = rspq_block_end();
+    DEFER(rspq_block_free(inner));
+
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 4; i++)
+        rspq_block_run(inner);
+    rspq_block_t *outer = rspq_block_end();
+    DEFER(rspq_block_free(outer));
+
+    rspq_test_reset();
+    rspq_wait();
+
+    // Preempt the lowpri block with a highpri block
+    rspq_block_run(b4096);
+    rspq_flush();
+
+    rspq_highpri_begin();
+        rspq_block_run(outer);
+        rspq_test_output(actual_sum);
+    rspq_highpri_end();
+    rspq_highpri_sync();
+
+    ASSERT(actual_sum[0] < 4096, "lowpri sum is not correct");
+    ASSERT_EQUAL_UNSIGNED(actual_sum[1], 64, "highpri sum is not correct");
+    data_cache_hit_invalidate(actual_sum, 16);
+
+    // The lowpri block must resume correctly
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(actual_sum[0], 4096, "lowpri sum is not correct");
+    ASSERT_EQUAL_UNSIGNED(actual_sum[1], 64, "highpri sum is not correct");
+
+    // Latency of a highpri sequence: re-emitted commands vs prerecorded block
+    const int num = 32;
+    uint32_t t0 = TICKS_READ();
+    for (int i = 0; i < num; i++) {
+        rspq_highpri_begin();
+            for (int j = 0; j < 64; j++)
+                rspq_test_high(1);
+        rspq_highpri_end();
+        rspq_highpri_sync();
+    }
+    uint32_t emitted = TICKS_SINCE(t0);
+
+    t0 = TICKS_READ();
+    for (int i = 0; i < num; i++) {
+        rspq_highpri_begin();
+            rspq_block_run(outer);
+        rspq_highpri_end();
+        rspq_highpri_sync();
+    }
+    uint32_t prerecorded = TICKS_SINCE(t0);
+
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(actual_sum[1], 64 + num*64*2, "highpri sum is not correct");
+
+    debugf("rspq: highpri latency (64 commands): re-emitted %lu us, block %lu us\n",
+        emitted * 1000 / (TICKS_PER_SECOND/1000) / num, prerecorded * 1000 / (TICKS_PER_SECOND/1000) / num);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
+void test_rspq_highpri_latency(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_block_begin();
+    for (uint32_t i = 0; i < 4096; i++) {
+        rspq_test_8(1);
+        if (i%256 == 0)
+            rspq_test_wait(0x10);
+    }
+    rspq_block_t *b4096 = rspq_block_end();
+    DEFER(rspq_block_free(b4096));
+
+    rspq_highpri_stats_reset();
+
+    // Request highpri while lowpri is busy
+    rspq_block_run(b4096);
+    rspq_flush();
+    for (int i = 0; i < 8; i++) {
+        rspq_highpri_begin();
+            rspq_test_high(1);
+        rspq_highpri_end();
+        rspq_highpri_sync();
+    }
+    rspq_wait();
+
+    rspq_highpri_stats_t stats;
+    rspq_highpri_stats_get(&stats);
+    ASSERT_EQUAL_UNSIGNED(stats.count, 8, "wrong number of highpri submissions");
+    ASSERT_EQUAL_UNSIGNED(stats.merged, 0, "unexpected merged submissions");
+    ASSERT(stats.complete_max_us >= stats.start_max_us, "completion before start");
+    ASSERT(stats.complete_total_us >= stats.start_total_us, "completion before start");
+
+    uint32_t start_count = 0, complete_count = 0;
+    for (int i = 0; i < RSPQ_HIGHPRI_HIST_BUCKETS; i++) {
+        start_count += stats.start_hist[i];
+        complete_count += stats.complete_hist[i];
+    }
+    ASSERT_EQUAL_UNSIGNED(start_count, 8, "wrong start histogram");
+    ASSERT_EQUAL_UNSIGNED(complete_count, 8, "wrong completion histogram");
+
+    rspq_highpri_stats_dump();
+
+    rspq_highpri_stats_reset();
+    rspq_highpri_stats_get(&stats);
+    ASSERT_EQUAL_UNSIGNED(stats.count, 0, "statistics not reset");
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
+
 void test_rspq_big_command(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -744,3 +1106,68 @@ void test_rspq_big_command(TestContext *ctx)
     
     ASSERT_EQUAL_MEM((uint8_t*)output, (uint8_t*)expected, 128, "Output does not match!");
 }
+
+RSPQ_DECLARE_COMMAND(TEST_CMD_4, 0x0, 1);
+RSPQ_DECLARE_COMMAND(TEST_CMD_8, 0x1, 2);
+
+void test_rspq_reserve(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_reset();
+
+    // Reserve more than a buffer in total, to go through buffer switches
+    const int batch = RSPQ_MAX_RESERVE_SIZE / TEST_CMD_8_SIZE;
+    for (int i = 0; i < 32; i++) {
+        volatile uint32_t *ptr = rspq_reserve(batch * TEST_CMD_8_SIZE);
+        for (int j = 0; j < batch; j++)
+            rspq_put(ptr, test_ovl_id, TEST_CMD_8, 1, 0x02000000 | SP_WSTATUS_SET_SIG0);
+        rspq_reserve_end(ptr);
+    }
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, batch*32, "Sum is incorrect!");
+
+    // Benchmark: record the same commands in a block with rspq_write and
+    // with rspq_reserve, to measure the CPU cost only.
+    const int num = 4096;
+    rspq_block_begin();
+    uint32_t t0 = TICKS_READ();
+    for (int i = 0; i < num; i++)
+        rspq_write(test_ovl_id, TEST_CMD_4_ID, 1);
+    uint32_t write_ticks = TICKS_SINCE(t0);
+    rspq_block_t *b_write = rspq_block_end();
+    DEFER(rspq_block_free(b_write));
+
+    const int batch4 = RSPQ_MAX_RESERVE_SIZE / TEST_CMD_4_SIZE;
+    rspq_block_begin();
+    t0 = TICKS_READ();
+    for (int i = 0; i < num; i += batch4) {
+        int n = num - i < batch4 ? num - i : batch4;
+        volatile uint32_t *ptr = rspq_reserve(n * TEST_CMD_4_SIZE);
+        for (int j = 0; j < n; j++)
+            rspq_put(ptr, test_ovl_id, TEST_CMD_4, 1);
+        rspq_reserve_end(ptr);
+    }
+    uint32_t reserve_ticks = TICKS_SINCE(t0);
+    rspq_block_t *b_reserve = rspq_block_end();
+    DEFER(rspq_block_free(b_reserve));
+
+    rspq_test_reset();
+    rspq_block_run(b_write);
+    rspq_block_run(b_reserve);
+    rspq_test_output(actual_sum);
+    rspq_wait();
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, num*2, "Sum is incorrect!");
+
+    debugf("rspq: commands per second: rspq_write %llu, rspq_reserve %llu\n",
+        (uint64_t)num * TICKS_PER_SECOND / (write_ticks ? write_ticks : 1),
+        (uint64_t)num * TICKS_PER_SECOND / (reserve_ticks ? reserve_ticks : 1));
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+}
@@ -0,0 +1,79 @@
+#include <system.h>
+
+static int long_prefix_handle;
+
+static void *long_prefix_open(char *name, int flags) {
+	return strcmp(name, "file") == 0 ? &long_prefix_handle : NULL;
+}
+
+static int long_prefix_close(void *file) {
+	return 0;
+}
+
+
+void test_system_fds(TestContext *ctx) {
+	int fd1 = open("rom:/counter.dat", O_RDONLY);
+	ASSERT(fd1 >= 3, "cannot open rom:/counter.dat");
+	DEFER(close(fd1));
+	int fd2 = open("rom:/random.dat", O_RDONLY);
+	ASSERT(fd2 >= 3, "cannot open rom:/random.dat");
+
+	// Handles are independent
+	uint8_t b;
+	lseek(fd1, 10, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(read(fd1, &b, 1), 1, "short read");
+	ASSERT_EQUAL_HEX(b, 10, "invalid data");
+
+	// The lowest free handle is reused
+	ASSERT_EQUAL_SIGNED(close(fd2), 0, "cannot close");
+	ASSERT_EQUAL_SIGNED(read(fd2, &b, 1), -1, "closed handle accepted");
+	int fd3 = open("rom:/counter.dat", O_RDONLY);
+	DEFER(close(fd3));
+	ASSERT_EQUAL_SIGNED(fd3, fd2, "lowest free handle not reused");
+
+	// Unknown prefixes and invalid handles
+	ASSERT_EQUAL_SIGNED(open("nope:/counter.dat", O_RDONLY), -1, "unknown prefix accepted");
+	ASSERT_EQUAL_SIGNED(open("rom", O_RDONLY), -1, "missing prefix accepted");
+	ASSERT_EQUAL_SIGNED(read(1000, &b, 1), -1, "invalid handle accepted");
+}
+
+void test_system_long_prefix(TestContext *ctx) {
+	static filesystem_t fs = { .open = long_prefix_open, .close = long_prefix_close };
+	const char *prefix = "a_filesystem_prefix_longer_than_thirty_two_characters:/";
+
+	ASSERT_EQUAL_SIGNED(attach_filesystem(prefix, &fs), 0, "cannot attach filesystem");
+	DEFER(detach_filesystem(prefix));
+
+	int fd = open("a_filesystem_prefix_longer_than_thirty_two_characters:/file", O_RDONLY);
+	ASSERT(fd >= 3, "cannot open file with a long prefix");
+	ASSERT_EQUAL_SIGNED(close(fd), 0, "cannot close");
+	ASSERT_EQUAL_SIGNED(open("a_filesystem_prefix_longer_than_thirty_two_characters:/nope", O_RDONLY), -1, "missing file opened");
+}
+
+void test_system_read_overhead(TestContext *ctx) {
+	int fd = open("rom:/counter.dat", O_RDONLY);
+	ASSERT(fd >= 3, "cannot open rom:/counter.dat");
+	DEFER(close(fd));
+
+	// Single-byte reads are served from the DragonFS cached buffer,
+	// so this mostly measures the newlib dispatch overhead.
+	const int N = 4096;
+	uint8_t b;
+	uint32_t t0 = TICKS_READ();
+	for (int i=0;i<N;i++)
+		read(fd, &b, 1);
+	uint32_t t1 = TICKS_READ();
+	ASSERT_EQUAL_HEX(b, (N-1)&0xFF, "invalid data");
+
+	// Same reads, bypassing newlib
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+	uint32_t t2 = TICKS_READ();
+	for (int i=0;i<N;i++)
+		dfs_read(&b, 1, 1, fh);
+	uint32_t t3 = TICKS_READ();
+
+	LOG("read(): %ld ticks/call, dfs_read(): %ld ticks/call\n",
+		TICKS_DISTANCE(t0, t1) / N, TICKS_DISTANCE(t2, t3) / N);
+}
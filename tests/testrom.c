@@ -2,12 +2,19 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // Activate this when running under emulators such as cen64
 #ifndef IN_EMULATOR
 #define IN_EMULATOR  0
 #endif
 
+// Set when the heap functions are wrapped for the heap profiler (testrom_heapprof)
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE 0
+#endif
+
 /**********************************************************************
  * SIMPLE TEST FRAMEWORK
  **********************************************************************/
@@ -205,6 +212,11 @@ int assert_equal_mem(TestContext *ctx, const char *file, int line, const uint8_t
 #include "test_constructors.c"
 #include "test_backtrace.c"
 #include "test_rspq.c"
+#include "test_system.c"
+#include "test_allocator.c"
+#if HEAP_PROFILE
+#include "test_heapprof.c"
+#endif
 
 /**********************************************************************
  * MAIN
@@ -241,10 +253,31 @@ static const struct Testsuite
 	TEST_FUNC(test_irq_reentrancy,           230, TEST_FLAGS_RESET_COUNT),
 	TEST_FUNC(test_dfs_read,                 948, TEST_FLAGS_IO),
 	TEST_FUNC(test_dfs_rom_addr,              25, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_open_paths,             0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_sector_cache,           0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_read_async,             0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_compressed,             0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_compressed_open,        0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_stream,                 0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_extent,                 0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_handles,                0, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_readv,                  0, TEST_FLAGS_IO),
+	TEST_FUNC(test_system_fds,                 0, TEST_FLAGS_IO),
+	TEST_FUNC(test_system_long_prefix,         0, TEST_FLAGS_NONE),
+	TEST_FUNC(test_system_read_overhead,       0, TEST_FLAGS_IO),
 	TEST_FUNC(test_eepromfs,                   0, TEST_FLAGS_IO),
 	TEST_FUNC(test_cache_invalidate,        1763, TEST_FLAGS_NONE),
 	TEST_FUNC(test_debug_sdfs,                 0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_dma_read_misalign,       7003, TEST_FLAGS_NONE),
+	TEST_FUNC(test_dma_queue,                  0, TEST_FLAGS_NONE),
+	TEST_FUNC(test_dma_read_any,               0, TEST_FLAGS_NONE),
+	TEST_FUNC(test_dma_stats,                  0, TEST_FLAGS_NONE),
+	TEST_FUNC(test_allocator_pool,             0, TEST_FLAGS_NONE),
+	TEST_FUNC(test_allocator_arena,            0, TEST_FLAGS_NONE),
+	TEST_FUNC(test_allocator_uncached,         0, TEST_FLAGS_NONE),
+#if HEAP_PROFILE
+	TEST_FUNC(test_heapprof,                   0, TEST_FLAGS_NO_BENCHMARK),
+#endif
 	TEST_FUNC(test_cop1_denormalized_float,    0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_backtrace_analyze,          0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_backtrace_basic,            0, TEST_FLAGS_NO_BENCHMARK),
@@ -264,14 +297,22 @@ static const struct Testsuite
 	TEST_FUNC(test_rspq_multiple_flush,        0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_wait,                  0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_rapid_sync,            0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_syncpoint_callback,    0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_flush,                 0, TEST_FLAGS_NO_BENCHMARK | TEST_FLAGS_NO_EMULATOR),
 	TEST_FUNC(test_rspq_rapid_flush,           0, TEST_FLAGS_NO_BENCHMARK | TEST_FLAGS_NO_EMULATOR),
 	TEST_FUNC(test_rspq_block,                 0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_block_finalize,        0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_profile,               0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_capture,               0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_overlay_pingpong,      0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_wait_sync_in_block,    0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_basic,         0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_multiple,      0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_overlay,       0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_highpri_block,         0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_highpri_latency,       0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_big_command,           0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rspq_reserve,               0, TEST_FLAGS_NO_BENCHMARK),
 };
 
 int main() {
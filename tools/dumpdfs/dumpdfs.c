@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
 
@@ -99,6 +100,91 @@ static inline uint8_t* get_file_location(uint32_t cart_start_loc, uint32_t loc)
     return (uint8_t*)(base_ptr + SWAPLONG(cart_start_loc) + loc);
 }
 
+/* Decompress a LZ4 block, return the number of bytes written or -1 on error */
+static int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_len)
+{
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dst, *oend = dst + dst_len;
+
+    while(op < oend)
+    {
+        if(ip >= iend) { return -1; }
+
+        int token = *ip++;
+        int len = token >> 4;
+
+        if(len == 15)
+        {
+            int b;
+            do {
+                if(ip >= iend) { return -1; }
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > oend - op || len > iend - ip) { return -1; }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        if(op == oend) { break; }
+        if(iend - ip < 2) { return -1; }
+
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op - dst) { return -1; }
+
+        len = token & 15;
+        if(len == 15)
+        {
+            int b;
+            do {
+                if(ip >= iend) { return -1; }
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        len += 4;
+
+        if(len > oend - op) { return -1; }
+        const uint8_t *match = op - offset;
+        while(len--) { *op++ = *match++; }
+    }
+
+    return op - dst;
+}
+
+/* Decompress a whole compressed file */
+static uint8_t *decompress_file(uint32_t cart_start_loc, uint32_t size)
+{
+    compressed_header_t *header = (compressed_header_t *)get_file_location(cart_start_loc, 0);
+    uint32_t chunk_log2 = SWAPLONG(header->chunk_log2);
+    uint32_t num_chunks = SWAPLONG(header->num_chunks);
+    uint8_t *data = malloc(size);
+
+    for(uint32_t i = 0; i < num_chunks; i++)
+    {
+        uint32_t start = i << chunk_log2;
+        uint32_t len = MIN(1u << chunk_log2, size - start);
+        uint32_t comp_start = SWAPLONG(header->offsets[i]);
+        uint32_t comp_len = SWAPLONG(header->offsets[i+1]) - comp_start;
+        uint8_t *comp = get_file_location(cart_start_loc, comp_start);
+
+        if(comp_len == ((len + 1) & ~1))
+        {
+            memcpy(data + start, comp, len);
+        }
+        else if(lz4_decompress(comp, comp_len, data + start, len) != len)
+        {
+            free(data);
+            return NULL;
+        }
+    }
+
+    return data;
+}
+
 /* For directory stack */
 static inline void clear_directory()
 {
@@ -532,6 +618,18 @@ int dfs_open(const char * const path)
     file->cart_start_loc = t_node.file_pointer;
     file->cached_loc = 0xFFFFFFFF;
 
+    if(get_flags(&t_node) & FLAGS_COMPRESSED)
+    {
+        /* Decompress everything on open, memory is not an issue here */
+        file->chunk_data = decompress_file(file->cart_start_loc, file->size);
+
+        if(!file->chunk_data)
+        {
+            memset(file, 0, sizeof(open_file_t));
+            return DFS_EBADFS;
+        }
+    }
+
     return file->handle;
 }
 
@@ -547,6 +645,7 @@ int dfs_close(uint32_t handle)
     }
 
     /* Closing the handle is easy as zeroing out the file */
+    free(file->chunk_data);
     memset(file, 0, sizeof(open_file_t));
 
     return DFS_ESUCCESS;
@@ -652,7 +751,14 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
         to_read = file->size - file->loc;
     }
 
-    memcpy(buf, get_file_location(file->cart_start_loc, file->loc), to_read);
+    if(file->chunk_data)
+    {
+        memcpy(buf, file->chunk_data + file->loc, to_read);
+    }
+    else
+    {
+        memcpy(buf, get_file_location(file->cart_start_loc, file->loc), to_read);
+    }
     file->loc += to_read;
 
     /* Return the count */
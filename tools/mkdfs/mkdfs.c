@@ -2,11 +2,13 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <fnmatch.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
 
@@ -16,296 +18,1101 @@
 #define SWAPLONG(i) (((uint32_t)((i) & 0xFF000000) >> 24) | ((uint32_t)((i) & 0x00FF0000) >>  8) | ((uint32_t)((i) & 0x0000FF00) <<  8) | ((uint32_t)((i) & 0x000000FF) << 24))
 #endif
 
-uint8_t *dfs = NULL;
-uint32_t fs_size = 0;
+/* The image is built in two passes. The first pass scans the input directory
+   into a tree of nodes and computes the layout of the image (the offset of
+   every directory entry and file). The second pass writes the image
+   sequentially, streaming the contents of each file straight to the output,
+   so that memory usage does not depend on the size of the image.
 
-/* Offset from start of filesystem */
-inline uint32_t sector_offset(void *sector)
+   Layout of the image:
+     - root sector
+     - directory entries (the entries of each directory are contiguous)
+     - path hash table
+     - file contents (each one starting at a sector boundary)
+
+   Files with identical contents are stored only once: their directory
+   entries all point to the same data. */
+
+/* A file or directory to add to the image */
+typedef struct node
 {
-    uint32_t x = (uint8_t *)sector - dfs;
+    /* Name of the entry */
+    char *name;
+    /* Path on the host */
+    char *path;
+    /* Path relative to the root of the image */
+    char *rel_path;
+    /* Whether this is a directory */
+    int is_dir;
+    /* Uncompressed size of the file */
+    uint32_t size;
+    /* File flags (FLAGS_FILE, optionally FLAGS_COMPRESSED) */
+    uint32_t flags;
+    /* Number of bytes stored in the image for the file */
+    uint32_t data_size;
+    /* Offset of the directory entry */
+    uint32_t dirent;
+    /* Offset of the file contents, or of the first entry for directories */
+    uint32_t data;
+    /* Chunk offsets of a compressed file (see compressed_header_t) */
+    uint32_t *chunk_offsets;
+    uint32_t num_chunks;
+    /* Hash of the file contents */
+    uint64_t content_hash;
+    /* File with the same contents whose data is shared, or NULL */
+    struct node *dup_of;
+    /* Position of the file in the layout manifest (-1 if not listed), and in the tree */
+    int order;
+    int index;
+    /* Children of a directory */
+    struct node **children;
+    int num_children;
+} node_t;
+
+/* Patterns of the files to compress */
+const char **compress_patterns = NULL;
+int num_compress_patterns = 0;
+
+/* log2 of the uncompressed size of a chunk of a compressed file */
+#define COMPRESS_CHUNK_LOG2     13
+
+/* Size of the buffer used to copy file contents */
+#define COPY_BUFFER_SIZE        (256 * 1024)
+
+/* Manifest specifying the order of the file contents, or NULL */
+const char *layout_file = NULL;
+
+/* Whether to store files with identical contents only once */
+int dedup = 1;
+
+/* Statistics */
+int num_dups = 0;
+uint64_t dup_saved = 0;
+int num_files = 0;
+int num_dirs = 0;
+uint64_t total_input_size = 0;
+
+/* All files in layout order, used to write the contents and the path hash table */
+node_t **files = NULL;
 
-    return x;
+void print_help(const char * const prog_name)
+{
+    fprintf(stderr, "Usage: %s [--compress <Pattern>]... [--no-dedup] [--layout <Manifest>] <File> <Directory>\n", prog_name);
+    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
+    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    fprintf(stderr, "  --compress <Pattern> stores compressed the files whose path (relative to\n");
+    fprintf(stderr, "    <Directory>) matches the shell wildcard <Pattern>, eg: '*.sprite'\n");
+    fprintf(stderr, "  --no-dedup stores a copy of the contents of every file, even if identical\n");
+    fprintf(stderr, "  --layout <Manifest> places the contents of the files in the order they\n");
+    fprintf(stderr, "    appear in <Manifest>: either one path per line, or a log produced by\n");
+    fprintf(stderr, "    dfs_trace_enable() ('dfs-trace:' lines). Other files are placed after.\n");
 }
 
-inline void *sector_to_memory(uint32_t offset)
+/* Current time in milliseconds */
+double time_ms(void)
 {
-    return (void *)(dfs + offset);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
 }
 
-uint32_t dfs_alloc(int size)
+static inline uint32_t round_sector(uint32_t size)
 {
-    void *end;
-    int rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    return (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
 
-    if(!dfs)
-    {
-        dfs = malloc(rsize);
-        fs_size = rsize;
+/* Hash a path relative to the filesystem root, as done by the runtime */
+uint32_t path_hash(const char *path)
+{
+    uint32_t hash = PATH_HASH_INIT;
 
-        end = dfs;
-    }
-    else
+    while(*path == '/') { path++; }
+
+    for(; *path; path++)
     {
-        dfs = realloc(dfs, fs_size + rsize);
+        hash = PATH_HASH_STEP(hash, *path);
+    }
 
-        end = dfs + fs_size;
-        fs_size += rsize;
+    return hash;
+}
+
+/* Check hash of a path relative to the filesystem root, as done by the runtime */
+uint32_t path_check(const char *path)
+{
+    uint32_t check = PATH_CHECK_INIT;
+
+    while(*path == '/') { path++; }
+
+    for(; *path; path++)
+    {
+        check = PATH_CHECK_STEP(check, *path);
     }
 
-    /* Zero out last bytes */
-    memset(end, 0, rsize);
+    return check;
+}
 
-    return sector_offset(end);    
+/* Whether a file (path relative to the root directory) should be compressed */
+int should_compress(const char * const path)
+{
+    for(int i = 0; i < num_compress_patterns; i++)
+    {
+        if(fnmatch(compress_patterns[i], path, 0) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
-/* Add a new sector to the filesystem, return that sector pointer */
-uint32_t new_sector(void)
+#define LZ4_HASH_BITS       12
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MF_LIMIT        12
+#define LZ4_MAX_OFFSET      65535
+
+static inline uint32_t lz4_read32(const uint8_t *p)
 {
-    return dfs_alloc(SECTOR_SIZE);
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
 }
 
-uint32_t new_blob(int size)
+static inline uint32_t lz4_hash(uint32_t v)
 {
-    return dfs_alloc(size);    
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
 }
 
-void kill_fs()
+static uint8_t *lz4_write_length(uint8_t *op, int len)
 {
-    if(dfs)
+    while(len >= 255)
     {
-        free(dfs);
+        *op++ = 255;
+        len -= 255;
     }
+
+    *op++ = len;
+    return op;
 }
 
-void print_help(const char * const prog_name)
+/* Compress a buffer with the LZ4 block format. dst must be at least
+   len + len/255 + 16 bytes. Returns the compressed size. */
+int lz4_compress(const uint8_t *src, int len, uint8_t *dst)
 {
-    fprintf(stderr, "Usage: %s <File> <Directory>\n", prog_name);
-    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
-    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    int table[1 << LZ4_HASH_BITS];
+    uint8_t *op = dst;
+    int anchor = 0;
+    int ip = 0;
+
+    memset(table, 0xFF, sizeof(table));
+
+    while(ip < len - LZ4_MF_LIMIT)
+    {
+        uint32_t seq = lz4_read32(src + ip);
+        uint32_t h = lz4_hash(seq);
+        int ref = table[h];
+        table[h] = ip;
+
+        if(ref < 0 || ip - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != seq)
+        {
+            ip++;
+            continue;
+        }
+
+        /* Extend the match backwards, into the pending literals */
+        while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+        {
+            ip--;
+            ref--;
+        }
+
+        /* Extend the match forward. The last literals must stay literals. */
+        int match_len = LZ4_MIN_MATCH;
+        while(ip + match_len < len - LZ4_LAST_LITERALS && src[ip + match_len] == src[ref + match_len])
+        {
+            match_len++;
+        }
+
+        int lit_len = ip - anchor;
+        int offset = ip - ref;
+        uint8_t *token = op++;
+
+        *token = (MIN(lit_len, 15) << 4) | MIN(match_len - LZ4_MIN_MATCH, 15);
+        if(lit_len >= 15)
+        {
+            op = lz4_write_length(op, lit_len - 15);
+        }
+
+        memcpy(op, src + anchor, lit_len);
+        op += lit_len;
+
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+
+        if(match_len - LZ4_MIN_MATCH >= 15)
+        {
+            op = lz4_write_length(op, match_len - LZ4_MIN_MATCH - 15);
+        }
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    /* Last literals */
+    int lit_len = len - anchor;
+    *op++ = MIN(lit_len, 15) << 4;
+    if(lit_len >= 15)
+    {
+        op = lz4_write_length(op, lit_len - 15);
+    }
+
+    memcpy(op, src + anchor, lit_len);
+    op += lit_len;
+
+    return op - dst;
 }
 
-uint32_t add_file(const char * const file, uint32_t *size)
+/* Compress a file chunk by chunk. With out == NULL, only compute the chunk
+   offsets of the node (first pass); otherwise write the compressed file to
+   out, checking that it matches the first pass. Returns the compressed size,
+   or 0 on error. */
+uint32_t compress_file(node_t *node, FILE *out)
 {
-    FILE *fp;
+    uint32_t chunk_size = 1 << COMPRESS_CHUNK_LOG2;
+    uint32_t num_chunks = (node->size + chunk_size - 1) / chunk_size;
+    uint32_t header_size = sizeof(compressed_header_t) + (num_chunks + 1) * sizeof(uint32_t);
+    uint8_t *chunk = malloc(chunk_size);
+    uint8_t *comp = malloc(chunk_size + chunk_size / 255 + 16);
+    uint32_t pos = header_size;
+    FILE *fp = fopen(node->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", node->path);
+        free(chunk);
+        free(comp);
+        return 0;
+    }
+
+    if(!out)
+    {
+        node->num_chunks = num_chunks;
+        node->chunk_offsets = malloc((num_chunks + 1) * sizeof(uint32_t));
+    }
+    else
+    {
+        uint32_t header[2] = { SWAPLONG(COMPRESS_CHUNK_LOG2), SWAPLONG(num_chunks) };
+        fwrite(header, 1, sizeof(header), out);
+
+        for(uint32_t i = 0; i <= num_chunks; i++)
+        {
+            uint32_t offset = SWAPLONG(node->chunk_offsets[i]);
+            fwrite(&offset, 1, sizeof(offset), out);
+        }
+    }
+
+    for(uint32_t i = 0; i < num_chunks; i++)
+    {
+        int len = MIN(chunk_size, node->size - i * chunk_size);
+        int raw_len = (len + 1) & ~1;
+
+        if(fread(chunk, 1, len, fp) != len)
+        {
+            fprintf(stderr, "Cannot read contents of file '%s'!\n", node->path);
+            pos = 0;
+            break;
+        }
+
+        int comp_len = lz4_compress(chunk, len, comp);
+        const uint8_t *data = comp;
+
+        if(((comp_len + 1) & ~1) >= raw_len)
+        {
+            /* Incompressible, store it as is */
+            data = chunk;
+            comp_len = len;
+        }
+
+        if(!out)
+        {
+            node->chunk_offsets[i] = pos;
+        }
+        else
+        {
+            if(node->chunk_offsets[i] != pos)
+            {
+                fprintf(stderr, "File '%s' changed while building the image!\n", node->path);
+                pos = 0;
+                break;
+            }
+
+            fwrite(data, 1, comp_len, out);
+
+            /* Pad to an even length, so that all chunks can be read via DMA */
+            if(comp_len & 1)
+            {
+                fputc(0, out);
+            }
+        }
+
+        pos += (comp_len + 1) & ~1;
+    }
+
+    if(!out && pos)
+    {
+        node->chunk_offsets[num_chunks] = pos;
+    }
 
-    printf("Adding '%s' to filesystem image.\n", file);
+    fclose(fp);
+    free(chunk);
+    free(comp);
 
-    fp = fopen(file, "rb");
+    return pos;
+}
+
+/* Copy an uncompressed file to the output. Returns 0 on error. */
+int copy_file(node_t *node, FILE *out)
+{
+    static uint8_t buffer[COPY_BUFFER_SIZE];
+    FILE *fp = fopen(node->path, "rb");
+    uint32_t left = node->size;
 
     if(!fp)
     {
-        fprintf(stderr, "Cannot open file '%s' for read!\n", file);
+        fprintf(stderr, "Cannot open file '%s' for read!\n", node->path);
         return 0;
     }
 
-    fseek(fp, 0, SEEK_END);
-    *size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    while(left)
+    {
+        uint32_t len = MIN(left, COPY_BUFFER_SIZE);
 
-    if (*size > 0x0FFFFFFF)
+        if(fread(buffer, 1, len, fp) != len)
+        {
+            fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", node->path);
+            fclose(fp);
+            return 0;
+        }
+
+        fwrite(buffer, 1, len, out);
+        left -= len;
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+void free_node(node_t *node)
+{
+    for(int i = 0; i < node->num_children; i++)
     {
-        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
-        return 0;
+        free_node(node->children[i]);
     }
 
-    uint32_t blob = new_blob(*size);
-    uint8_t *data = sector_to_memory(blob);
+    free(node->children);
+    free(node->chunk_offsets);
+    free(node->name);
+    free(node->path);
+    free(node->rel_path);
+    free(node);
+}
+
+/* Hash the contents of a file (64-bit FNV-1a). Returns 0 on error. */
+int hash_file(node_t *node)
+{
+    static uint8_t buffer[COPY_BUFFER_SIZE];
+    FILE *fp = fopen(node->path, "rb");
+    uint64_t hash = 0xCBF29CE484222325ull;
+    size_t len;
 
-    int read = fread(data, 1, *size, fp);
-    if (read < 0) {
-        /* Wat? */
-        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", file);
-        fclose(fp);
-        return 0;    
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", node->path);
+        return 0;
+    }
+
+    while((len = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    {
+        for(size_t i = 0; i < len; i++)
+        {
+            hash = (hash ^ buffer[i]) * 0x100000001B3ull;
+        }
     }
 
     fclose(fp);
-    return blob;
+    node->content_hash = hash;
+    return 1;
+}
+
+/* Compare the contents of two files of the same size */
+int same_contents(node_t *a, node_t *b)
+{
+    static uint8_t buffer_a[COPY_BUFFER_SIZE], buffer_b[COPY_BUFFER_SIZE];
+    FILE *fa = fopen(a->path, "rb");
+    FILE *fb = fopen(b->path, "rb");
+    int same = fa && fb;
+    size_t len;
+
+    while(same && (len = fread(buffer_a, 1, sizeof(buffer_a), fa)) > 0)
+    {
+        same = fread(buffer_b, 1, len, fb) == len && !memcmp(buffer_a, buffer_b, len);
+    }
+
+    if(fa) { fclose(fa); }
+    if(fb) { fclose(fb); }
+
+    return same;
+}
+
+/* Find files with identical contents, and mark the copies as duplicates */
+void find_duplicates(void)
+{
+    uint32_t num_buckets = 16;
+
+    while(num_buckets < num_files * 2)
+    {
+        num_buckets *= 2;
+    }
+
+    node_t **buckets = calloc(num_buckets, sizeof(node_t *));
+
+    for(int i = 0; i < num_files; i++)
+    {
+        node_t *node = files[i];
+        uint32_t idx = node->content_hash & (num_buckets - 1);
+
+        /* Look for a file with the same hash (and thus very likely the same contents) */
+        while(buckets[idx] && buckets[idx]->content_hash != node->content_hash)
+        {
+            idx = (idx + 1) & (num_buckets - 1);
+        }
+
+        node_t *orig = buckets[idx];
+
+        if(!orig)
+        {
+            buckets[idx] = node;
+        }
+        else if(orig->size == node->size && orig->flags == node->flags && same_contents(orig, node))
+        {
+            printf("'%s' is identical to '%s', sharing its data.\n", node->path, orig->path);
+            node->dup_of = orig;
+            num_dups++;
+            dup_saved += round_sector(node->data_size);
+        }
+    }
+
+    free(buckets);
 }
 
-uint32_t add_directory(const char * const path)
+/* First pass: stat a file and decide how it will be stored */
+node_t *scan_file(const char * const path, const char * const rel_path, uint32_t size)
+{
+    if(size > 0x0FFFFFFF)
+    {
+        fprintf(stderr, "File '%s' too big for the filesystem!\n", path);
+        return NULL;
+    }
+
+    node_t *node = calloc(1, sizeof(node_t));
+    node->path = strdup(path);
+    node->rel_path = strdup(rel_path);
+    node->size = size;
+    node->flags = FLAGS_FILE;
+    node->data_size = size;
+
+    printf("Adding '%s' to filesystem image.\n", path);
+
+    if(dedup && !hash_file(node))
+    {
+        return NULL;
+    }
+
+    if(size > 0 && should_compress(rel_path))
+    {
+        uint32_t comp_size = compress_file(node, NULL);
+
+        if(!comp_size)
+        {
+            return NULL;
+        }
+
+        if(comp_size < size)
+        {
+            printf("Compressed to %u bytes (%.1f%%).\n", comp_size, comp_size * 100.0 / size);
+            node->flags |= FLAGS_COMPRESSED;
+            node->data_size = comp_size;
+        }
+        else
+        {
+            printf("Not compressible, stored uncompressed.\n");
+            free(node->chunk_offsets);
+            node->chunk_offsets = NULL;
+        }
+    }
+
+    num_files++;
+    total_input_size += size;
+
+    return node;
+}
+
+/* First pass: scan a directory recursively. Returns NULL (and sets *error on
+   failure) if the directory contains no files. */
+node_t *scan_directory(const char * const path, const char * const rel_path, int *error)
 {
-    directory_entry_t *tmp_entry;
-    uint32_t first_entry = 0;
-    uint32_t cur_entry = 0;
     DIR *dirp;
     struct dirent *dp;
 
     if((dirp = opendir(path)) == NULL)
     {
-        return 0;
+        return NULL;
     }
 
-    do {
-        if((dp = readdir(dirp)) != NULL)
+    node_t *dir = calloc(1, sizeof(node_t));
+    dir->is_dir = 1;
+    dir->path = strdup(path);
+    dir->rel_path = strdup(rel_path);
+
+    while((dp = readdir(dirp)) != NULL)
+    {
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+        {
+            /* Ignore */
+            continue;
+        }
+
+        char *file = malloc(strlen(path) + strlen(dp->d_name) + 2);
+        char *rel_file = malloc(strlen(rel_path) + strlen(dp->d_name) + 2);
+        struct stat stats;
+        node_t *child = NULL;
+
+        strcpy(file, path);
+
+        /* Only add a / if there isn't one */
+        if(path[strlen(path) - 1] != '/')
         {
-            if(strcmp(dp->d_name, ".") == 0)
+            strcat(file, "/");
+        }
+
+        strcat(file, dp->d_name);
+
+        strcpy(rel_file, rel_path);
+        if(rel_path[0])
+        {
+            strcat(rel_file, "/");
+        }
+
+        strcat(rel_file, dp->d_name);
+
+        /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
+        stat( file, &stats );
+
+        if(S_ISREG(stats.st_mode))
+        {
+            child = scan_file(file, rel_file, stats.st_size);
+
+            if(!child)
             {
-                /* Ignore */
+                *error = 1;
             }
-            else if(strcmp(dp->d_name, "..") == 0)
+        }
+        else if(S_ISDIR(stats.st_mode))
+        {
+            child = scan_directory(file, rel_file, error);
+
+            if(!child && !*error)
             {
-                /* Ignore */
+                fprintf(stderr, "Skipping empty directory: %s\n", file);
             }
-            else
-            {
-                char *file = malloc(strlen(path) + strlen(dp->d_name) + 2);
-                struct stat stats;
+        }
 
-                if(!file)
-                {
-                    /* Out of memory */
-                    return 0;
-                }
+        free(file);
+        free(rel_file);
 
-                strcpy(file, path);
+        if(*error)
+        {
+            break;
+        }
 
-                /* Only add a / if there isn't one */
-                if(path[strlen(path) - 1] != '/')
-                {
-                    strcat(file, "/");
-                }
+        if(child)
+        {
+            child->name = strdup(dp->d_name);
+            dir->children = realloc(dir->children, (dir->num_children + 1) * sizeof(node_t *));
+            dir->children[dir->num_children++] = child;
+        }
+    }
 
-                strcat(file, dp->d_name);
+    closedir(dirp);
 
-                /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
-                stat( file, &stats );
+    if(!dir->num_children || *error)
+    {
+        /* Don't support directories without files */
+        free_node(dir);
+        return NULL;
+    }
 
-                if(S_ISREG(stats.st_mode))
-                {
-                    uint32_t new_entry = new_sector();
-                    uint32_t file_size = 0;
+    num_dirs++;
+    return dir;
+}
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->next_entry = 0;
+/* Assign the offsets of the directory entries: the entries of each directory
+   are contiguous, so that walking a directory reads consecutive sectors. */
+uint32_t layout_dirents(node_t *dir, uint32_t offset)
+{
+    dir->data = offset;
 
-                    /* Copy over filename */
-                    strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
-                    tmp_entry->path[MAX_FILENAME_LEN] = 0;
+    for(int i = 0; i < dir->num_children; i++)
+    {
+        dir->children[i]->dirent = offset;
+        offset += SECTOR_SIZE;
+    }
 
-                    uint32_t new_file = add_file(file, &file_size);
+    for(int i = 0; i < dir->num_children; i++)
+    {
+        if(dir->children[i]->is_dir)
+        {
+            offset = layout_dirents(dir->children[i], offset);
+        }
+    }
 
-                    if(!new_file)
-                    {
-                        free(file);
-                        return 0;
-                    }
+    return offset;
+}
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_file);
-                    tmp_entry->flags = SWAPLONG((FLAGS_FILE << 28) | (file_size & 0x0FFFFFFF));
+/* Collect the files in the order their contents will be written */
+void collect_files(node_t *dir)
+{
+    for(int i = 0; i < dir->num_children; i++)
+    {
+        node_t *child = dir->children[i];
+
+        if(child->is_dir)
+        {
+            collect_files(child);
+        }
+        else
+        {
+            files[num_files++] = child;
+        }
+    }
+}
 
-                    if(cur_entry)
-                    {
-                        /* Link up! */
-                        tmp_entry = sector_to_memory(cur_entry);
-                        tmp_entry->next_entry = SWAPLONG(new_entry);
-                    }
+/* Order files by position in the manifest, keeping the tree order otherwise */
+int compare_layout(const void *a, const void *b)
+{
+    const node_t *na = *(const node_t **)a;
+    const node_t *nb = *(const node_t **)b;
 
-                    /* This is now the current working entry */
-                    cur_entry = new_entry;
-                }
-                else if(S_ISDIR(stats.st_mode))
-                {
-                    uint32_t new_entry = new_sector();
+    if(na->order != nb->order)
+    {
+        /* Files not in the manifest (-1) go last */
+        if(na->order < 0) { return 1; }
+        if(nb->order < 0) { return -1; }
+        return na->order - nb->order;
+    }
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->flags = SWAPLONG(FLAGS_DIR << 28); /* Size doesn't matter for directories */
-                    tmp_entry->next_entry = 0;
+    return na->index - nb->index;
+}
 
-                    /* Copy over filename */
-                    strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
-                    tmp_entry->path[MAX_FILENAME_LEN] = 0;
+/* Sort the files following the layout manifest. Returns 0 on error. */
+int apply_layout(const char * const manifest)
+{
+    FILE *fp = fopen(manifest, "r");
+    char line[4096];
+    int order = 0;
+    int unknown = 0;
 
-                    uint32_t new_directory = add_directory(file);
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open layout manifest '%s'!\n", manifest);
+        return 0;
+    }
 
-                    if(!new_directory)
-                    {
-                        fprintf(stderr, "Skipping empty directory: %s\n", file);
-                        free(file);
-                        continue;
-                    }
+    /* Index the files by path */
+    uint32_t num_buckets = 16;
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_directory);
+    while(num_buckets < num_files * 2)
+    {
+        num_buckets *= 2;
+    }
 
-                    if(cur_entry)
-                    {
-                        /* Link up! */
-                        tmp_entry = sector_to_memory(cur_entry);
-                        tmp_entry->next_entry = SWAPLONG(new_entry);
-                    }
+    node_t **buckets = calloc(num_buckets, sizeof(node_t *));
 
-                    /* This is now the current working entry */
-                    cur_entry = new_entry;
-                }
+    for(int i = 0; i < num_files; i++)
+    {
+        uint32_t idx = path_hash(files[i]->rel_path) & (num_buckets - 1);
 
-                free(file);
+        while(buckets[idx])
+        {
+            idx = (idx + 1) & (num_buckets - 1);
+        }
+
+        buckets[idx] = files[i];
+        files[i]->index = i;
+        files[i]->order = -1;
+    }
+
+    while(fgets(line, sizeof(line), fp))
+    {
+        char *path = line;
+        char *trace = strstr(line, "dfs-trace: ");
+
+        /* Strip the line terminator */
+        line[strcspn(line, "\r\n")] = 0;
 
-                if(!first_entry)
+        if(trace)
+        {
+            /* "dfs-trace: open <path>" or "dfs-trace: read <path> <offset> <size>" */
+            path = strchr(trace + strlen("dfs-trace: "), ' ');
+            if(!path)
+            {
+                continue;
+            }
+
+            path++;
+            if(!strncmp(trace + strlen("dfs-trace: "), "read ", 5))
+            {
+                /* Drop offset and size */
+                for(int i = 0; i < 2; i++)
                 {
-                    /* Return pointer to first file on list */
-                    first_entry = cur_entry;
+                    char *space = strrchr(path, ' ');
+                    if(space) { *space = 0; }
                 }
             }
         }
-    } while (dp != NULL);
 
-    closedir(dirp);
+        if(!strncmp(path, "rom:/", 5))
+        {
+            path += 5;
+        }
+
+        while(*path == '/') { path++; }
+
+        if(!*path || *path == '#')
+        {
+            /* Empty line or comment */
+            continue;
+        }
 
-    /* Will return 0 if we don't find any entries (don't support directories without files) */
-    return first_entry;
+        uint32_t idx = path_hash(path) & (num_buckets - 1);
+
+        while(buckets[idx] && strcmp(buckets[idx]->rel_path, path))
+        {
+            idx = (idx + 1) & (num_buckets - 1);
+        }
+
+        if(!buckets[idx])
+        {
+            unknown++;
+        }
+        else if(buckets[idx]->order < 0)
+        {
+            buckets[idx]->order = order++;
+        }
+    }
+
+    fclose(fp);
+    free(buckets);
+
+    qsort(files, num_files, sizeof(node_t *), compare_layout);
+
+    printf("Layout manifest: placed %d files first", order);
+    if(unknown)
+    {
+        printf(", %d entries did not match any file", unknown);
+    }
+
+    printf(".\n");
+    return 1;
+}
+
+/* Build the path hash table in memory, return its size */
+uint32_t build_path_hash_table(path_hash_table_t **out)
+{
+    uint32_t num_buckets = 16;
+
+    /* Keep the load factor at or below 50% so that probe sequences stay short */
+    while(num_buckets < num_files * 2)
+    {
+        num_buckets *= 2;
+    }
+
+    uint32_t size = sizeof(path_hash_table_t) + num_buckets * sizeof(path_hash_bucket_t);
+    path_hash_table_t *tbl = calloc(1, size);
+
+    tbl->magic = SWAPLONG(PATH_HASH_MAGIC);
+    tbl->num_buckets = SWAPLONG(num_buckets);
+
+    for(int i = 0; i < num_files; i++)
+    {
+        uint32_t hash = path_hash(files[i]->rel_path);
+        uint32_t check = path_check(files[i]->rel_path);
+        uint32_t idx = hash & (num_buckets - 1);
+
+        while(tbl->buckets[idx].dirent != PATH_HASH_EMPTY)
+        {
+            if(SWAPLONG(tbl->buckets[idx].hash) == hash && SWAPLONG(tbl->buckets[idx].check) == check)
+            {
+                /* Two paths with the same hashes: the runtime will walk the directories */
+                tbl->buckets[idx].dirent = SWAPLONG(PATH_HASH_AMBIGUOUS);
+                break;
+            }
+
+            idx = (idx + 1) & (num_buckets - 1);
+        }
+
+        if(tbl->buckets[idx].dirent == PATH_HASH_EMPTY)
+        {
+            tbl->buckets[idx].hash = SWAPLONG(hash);
+            tbl->buckets[idx].check = SWAPLONG(check);
+            tbl->buckets[idx].dirent = SWAPLONG(files[i]->dirent);
+        }
+    }
+
+    *out = tbl;
+    return size;
+}
+
+/* Pad the output to the next sector boundary */
+void pad_to_sector(FILE *out, uint32_t *pos)
+{
+    static const uint8_t zeros[SECTOR_SIZE];
+    uint32_t padding = round_sector(*pos) - *pos;
+
+    fwrite(zeros, 1, padding, out);
+    *pos += padding;
+}
+
+/* Second pass: write the directory entries */
+void write_dirents(node_t *dir, FILE *out, uint32_t *pos)
+{
+    for(int i = 0; i < dir->num_children; i++)
+    {
+        node_t *child = dir->children[i];
+        directory_entry_t entry;
+
+        memset(&entry, 0, sizeof(entry));
+
+        if(i + 1 < dir->num_children)
+        {
+            entry.next_entry = SWAPLONG(dir->children[i + 1]->dirent);
+        }
+
+        if(child->is_dir)
+        {
+            /* Size doesn't matter for directories */
+            entry.flags = SWAPLONG(FLAGS_DIR << 28);
+        }
+        else
+        {
+            entry.flags = SWAPLONG((child->flags << 28) | (child->size & 0x0FFFFFFF));
+        }
+
+        /* Copy over filename */
+        strncpy(entry.path, child->name, MAX_FILENAME_LEN);
+        entry.path[MAX_FILENAME_LEN] = 0;
+
+        entry.file_pointer = SWAPLONG(child->data);
+
+        fwrite(&entry, 1, sizeof(entry), out);
+        *pos += sizeof(entry);
+    }
+
+    for(int i = 0; i < dir->num_children; i++)
+    {
+        if(dir->children[i]->is_dir)
+        {
+            write_dirents(dir->children[i], out, pos);
+        }
+    }
 }
 
 int main(int argc, char *argv[])
 {
-    if(argc != 3)
+    const char *positional[2];
+    int num_positional = 0;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--no-dedup"))
+        {
+            dedup = 0;
+        }
+        else if(!strcmp(argv[i], "--layout") && i + 1 < argc)
+        {
+            layout_file = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--compress") && i + 1 < argc)
+        {
+            compress_patterns = realloc(compress_patterns, (num_compress_patterns + 1) * sizeof(char *));
+            compress_patterns[num_compress_patterns++] = argv[++i];
+        }
+        else if(argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            print_help(argv[0]);
+            return -1;
+        }
+        else if(num_positional < 2)
+        {
+            positional[num_positional++] = argv[i];
+        }
+        else
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(num_positional != 2)
     {
         print_help(argv[0]);
         return -1;
     }
 
-    /* Add in identifier */
-    directory_entry_t *id = sector_to_memory(new_sector());
+    const char *out_file = positional[0];
+    const char *in_dir = positional[1];
+
+    /* First pass: scan the input and compute the layout */
+    double t0 = time_ms();
+    int error = 0;
+    node_t *root = scan_directory(in_dir, "", &error);
 
-    if(!id)
+    if(!root)
     {
-        fprintf(stderr, "Out of memory!\n");
+        /* Error adding directory */
+        if(!error)
+        {
+            fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", in_dir);
+        }
 
+        free(compress_patterns);
         return -1;
     }
 
-    id->flags = SWAPLONG(ROOT_FLAGS);
-    id->next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
-    strcpy(id->path, ROOT_PATH);
+    /* The entries of the root directory start right after the root sector */
+    uint32_t pos = layout_dirents(root, SECTOR_SIZE);
 
-    if(!add_directory(argv[2]))
-    {
-        /* Error adding directory */
-        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", argv[2]);
+    files = malloc(num_files * sizeof(node_t *));
+    num_files = 0;
+    collect_files(root);
 
-        kill_fs();
+    path_hash_table_t *hash_table;
+    uint32_t hash_table_size = build_path_hash_table(&hash_table);
+    uint32_t hash_table_offset = pos;
+    pos = round_sector(pos + hash_table_size);
 
+    /* The data of the files follows the manifest order, so that files accessed
+       one after the other are contiguous (and the first copy of duplicated
+       files is the one accessed first). Data is sector aligned, so the start
+       of each file qualifies for the DMA fast path of dfs_read. */
+    if(layout_file && !apply_layout(layout_file))
+    {
+        free_node(root);
         return -1;
     }
 
-    /* Write out filesystem */
-    FILE *fp = fopen(argv[1], "wb");
+    if(dedup)
+    {
+        find_duplicates();
+    }
+
+    for(int i = 0; i < num_files; i++)
+    {
+        if(!files[i]->dup_of)
+        {
+            files[i]->data = pos;
+            pos = round_sector(pos + files[i]->data_size);
+        }
+    }
+
+    for(int i = 0; i < num_files; i++)
+    {
+        if(files[i]->dup_of)
+        {
+            files[i]->data = files[i]->dup_of->data;
+        }
+    }
+
+    uint32_t image_size = pos;
+    double t1 = time_ms();
+
+    /* Second pass: write out the filesystem */
+    FILE *fp = fopen(out_file, "wb");
 
     if(!fp)
     {
         /* Error writing file out */
-        fprintf(stderr, "Error opening '%s' for writing.\n", argv[1]);
-
-        kill_fs();
+        fprintf(stderr, "Error opening '%s' for writing.\n", out_file);
 
+        free_node(root);
         return -1;
     }
 
-    fwrite(dfs, 1, fs_size, fp);
+    /* Add in identifier */
+    directory_entry_t id;
+    memset(&id, 0, sizeof(id));
+    id.flags = SWAPLONG(ROOT_FLAGS);
+    id.next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
+    strcpy(id.path, ROOT_PATH);
+    id.file_pointer = SWAPLONG(hash_table_offset);
+
+    fwrite(&id, 1, sizeof(id), fp);
+    pos = sizeof(id);
+
+    write_dirents(root, fp, &pos);
+
+    fwrite(hash_table, 1, hash_table_size, fp);
+    pos += hash_table_size;
+    pad_to_sector(fp, &pos);
+
+    for(int i = 0; i < num_files && !error; i++)
+    {
+        node_t *node = files[i];
+
+        if(node->dup_of)
+        {
+            /* Already written */
+            continue;
+        }
+
+        if(node->flags & FLAGS_COMPRESSED)
+        {
+            error = compress_file(node, fp) != node->data_size;
+        }
+        else
+        {
+            error = !copy_file(node, fp);
+        }
+
+        pos += node->data_size;
+        pad_to_sector(fp, &pos);
+    }
+
     fclose(fp);
+    double t2 = time_ms();
+
+    free(hash_table);
+    free(files);
+    free_node(root);
+    free(compress_patterns);
+
+    if(error || pos != image_size)
+    {
+        fprintf(stderr, "Error writing '%s'.\n", out_file);
+        remove(out_file);
+        return -1;
+    }
 
-    kill_fs();
+    printf("Scanned %d files in %d directories (%.1f MiB) in %.1f ms.\n",
+        num_files, num_dirs, total_input_size / (1024.0 * 1024.0), t1 - t0);
+    printf("Wrote %.1f MiB image in %.1f ms.\n",
+        image_size / (1024.0 * 1024.0), t2 - t1);
+
+    if(num_dups)
+    {
+        printf("Deduplicated %d files, saving %llu bytes.\n", num_dups, (unsigned long long)dup_saved);
+    }
 
     return 0;
 }
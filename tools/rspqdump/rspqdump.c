@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/param.h>
+#include "rspq_constants.h"
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SWAPLONG(i) (i)
+#else
+#define SWAPLONG(i) (((uint32_t)((i) & 0xFF000000) >> 24) | ((uint32_t)((i) & 0x00FF0000) >>  8) | ((uint32_t)((i) & 0x0000FF00) <<  8) | ((uint32_t)((i) & 0x000000FF) << 24))
+#endif
+
+/* Internal command IDs (see rspq.c) */
+#define CMD_CALL            0x03
+/* Frequency of the CPU tick counter (half the CPU clock) */
+#define TICKS_PER_SECOND    46875000
+/* Maximum nesting level of block calls */
+#define MAX_NESTING         RSPQ_MAX_BLOCK_NESTING_LEVEL
+
+static const char *internal_names[] = {
+    "WAIT_NEW_INPUT", "NOOP", "JUMP", "CALL", "RET", "DMA",
+    "WRITE_STATUS", "SWAP_BUFFERS", "TEST_WRITE_STATUS",
+};
+
+/* Per-command statistics */
+typedef struct
+{
+    uint32_t count;         /* Number of times the command was run */
+    uint32_t in_blocks;     /* ...of which, from a block */
+    uint64_t written;       /* Bytes written in the queues (excluding block contents) */
+    uint64_t executed;      /* Bytes run by the RSP (including block contents) */
+    uint32_t redundant;     /* Runs identical to the previous run of the same command */
+} cmd_stats_t;
+
+/* Per-frame statistics */
+typedef struct
+{
+    uint32_t ticks;         /* CPU ticks at the end of the frame */
+    uint64_t written;       /* Bytes written in the queues */
+    uint64_t executed;      /* Bytes run by the RSP */
+    uint32_t commands;      /* Number of commands run */
+    uint32_t redundant;     /* Bytes of redundant commands */
+} frame_stats_t;
+
+/* A block recorded in the capture */
+typedef struct
+{
+    uint32_t addr;          /* Physical address of the block commands */
+    uint32_t *words;
+    int nwords;
+} block_t;
+
+/* Description of the overlays */
+static uint8_t cmd_sizes[256];
+static uint8_t ovl_bases[RSPQ_OVERLAY_ID_COUNT];
+static char ovl_names[RSPQ_OVERLAY_ID_COUNT][16];
+
+static cmd_stats_t cmds[256];
+static frame_stats_t *frames;
+static int num_frames;
+static block_t *blocks;
+static int num_blocks;
+static uint64_t block_bytes;
+static int missing_blocks;
+static int invalid_words;
+
+/* Last run of each command, used to find redundant commands */
+static uint32_t last_cmd[256][64];
+static bool last_valid[256];
+
+static bool flag_list;
+static bool flag_verbose;
+
+static void usage( void )
+{
+    printf( "Usage: rspqdump [-l] [-v] <capture file>\n" );
+    printf( "Decode a RSP command stream captured with rspq_capture_start().\n\n" );
+    printf( "  -l   List every command\n" );
+    printf( "  -v   Show statistics for each frame\n" );
+}
+
+static const char *cmd_name( int cmd, char *buf )
+{
+    int id = cmd >> 4;
+    if( id == 0 )
+    {
+        if( cmd < sizeof(internal_names) / sizeof(internal_names[0]) )
+        {
+            return internal_names[cmd];
+        }
+        sprintf( buf, "builtin#%d", cmd );
+    }
+    else if( ovl_bases[id] == 0xFF )
+    {
+        sprintf( buf, "?#%d", cmd & 0xF );
+    }
+    else
+    {
+        sprintf( buf, "%s#%d", ovl_names[id], (id - ovl_bases[id]) * 16 + (cmd & 0xF) );
+    }
+    return buf;
+}
+
+static block_t *find_block( uint32_t addr )
+{
+    for( int i = 0; i < num_blocks; i++ )
+    {
+        if( blocks[i].addr == addr ) { return &blocks[i]; }
+    }
+    return NULL;
+}
+
+static frame_stats_t *cur_frame( void )
+{
+    return &frames[num_frames];
+}
+
+static void run_words( const uint32_t *words, int nwords, char queue, int depth );
+
+/* Account a single command */
+static void run_command( const uint32_t *words, int size, char queue, int depth )
+{
+    int cmd = words[0] >> 24;
+    cmd_stats_t *st = &cmds[cmd];
+    frame_stats_t *fr = cur_frame();
+
+    st->count++;
+    st->executed += size * 4;
+    fr->commands++;
+    fr->executed += size * 4;
+    if( depth == 0 )
+    {
+        st->written += size * 4;
+        fr->written += size * 4;
+    }
+    else
+    {
+        st->in_blocks++;
+    }
+
+    if( flag_list )
+    {
+        char buf[32];
+        printf( "%6d %c %*s%-24s", num_frames, queue, depth * 2, "", cmd_name( cmd, buf ) );
+        for( int i = 0; i < size; i++ ) { printf( " %08x", words[i] ); }
+        printf( "\n" );
+    }
+
+    /* Overlay commands identical to the previous run are likely
+       redundant state changes */
+    if( cmd >> 4 )
+    {
+        if( last_valid[cmd] && !memcmp( last_cmd[cmd], words, size * 4 ) )
+        {
+            st->redundant++;
+            fr->redundant += size * 4;
+        }
+        memcpy( last_cmd[cmd], words, size * 4 );
+        last_valid[cmd] = true;
+    }
+
+    if( cmd == CMD_CALL && size >= 2 )
+    {
+        block_t *b = find_block( words[0] & 0xFFFFFF );
+        if( !b )
+        {
+            missing_blocks++;
+        }
+        else if( depth < MAX_NESTING )
+        {
+            run_words( b->words, b->nwords, queue, depth + 1 );
+        }
+    }
+}
+
+/* Decode a sequence of commands */
+static void run_words( const uint32_t *words, int nwords, char queue, int depth )
+{
+    int i = 0;
+    while( i < nwords )
+    {
+        int size = cmd_sizes[words[i] >> 24];
+        if( words[i] == 0 || size == 0 )
+        {
+            /* Padding, or an undefined command: skip a word and try to resync */
+            if( words[i] != 0 ) { invalid_words++; }
+            i++;
+            continue;
+        }
+        if( size > nwords - i ) { size = nwords - i; }
+
+        run_command( words + i, size, queue, depth );
+        i += size;
+    }
+}
+
+static void add_frame( uint32_t ticks )
+{
+    frames[num_frames++].ticks = ticks;
+    frames = realloc( frames, (num_frames + 1) * sizeof(frame_stats_t) );
+    memset( cur_frame(), 0, sizeof(frame_stats_t) );
+
+    /* Redundancy is only checked within a frame */
+    memset( last_valid, 0, sizeof(last_valid) );
+}
+
+static void decode( uint32_t *words, int nwords )
+{
+    uint32_t *block_words = NULL;
+    int block_nwords = 0;
+    bool in_block = false;
+
+    frames = calloc( 1, sizeof(frame_stats_t) );
+
+    int i = 0;
+    while( i < nwords )
+    {
+        int type = words[i] >> 24;
+        int len = words[i] & 0xFFFFFF;
+        uint32_t *payload = words + i + 1;
+        if( i + 1 + len > nwords )
+        {
+            fprintf( stderr, "warning: truncated record at word %d\n", i );
+            break;
+        }
+        i += 1 + len;
+
+        switch( type )
+        {
+            case RSPQ_CAPTURE_REC_LOWPRI:
+                run_words( payload, len, 'L', 0 );
+                break;
+
+            case RSPQ_CAPTURE_REC_HIGHPRI:
+                run_words( payload, len, 'H', 0 );
+                break;
+
+            case RSPQ_CAPTURE_REC_BLOCK:
+                /* Block contents are run when the block is called. If the
+                   beginning of the block was dropped, ignore it. */
+                if( in_block )
+                {
+                    block_words = realloc( block_words, (block_nwords + len) * 4 );
+                    memcpy( block_words + block_nwords, payload, len * 4 );
+                    block_nwords += len;
+                }
+                break;
+
+            case RSPQ_CAPTURE_REC_BLOCK_BEGIN:
+                in_block = true;
+                block_nwords = 0;
+                break;
+
+            case RSPQ_CAPTURE_REC_BLOCK_END:
+            {
+                if( !in_block ) { break; }
+                in_block = false;
+
+                /* Addresses are reused after a block is freed */
+                block_t *b = find_block( payload[0] );
+                if( !b )
+                {
+                    blocks = realloc( blocks, (num_blocks + 1) * sizeof(block_t) );
+                    b = &blocks[num_blocks++];
+                    b->addr = payload[0];
+                }
+                else
+                {
+                    free( b->words );
+                }
+                b->words = malloc( block_nwords * 4 );
+                memcpy( b->words, block_words, block_nwords * 4 );
+                b->nwords = block_nwords;
+                block_bytes += block_nwords * 4;
+
+                if( flag_list )
+                {
+                    printf( "%6d B block %08x (%d bytes)\n", num_frames, b->addr, block_nwords * 4 );
+                }
+                break;
+            }
+
+            case RSPQ_CAPTURE_REC_BLOCK_MOVE:
+            {
+                block_t *b = find_block( payload[0] );
+                if( b ) { b->addr = payload[1]; }
+                break;
+            }
+
+            case RSPQ_CAPTURE_REC_SYNCPOINT:
+                if( flag_list )
+                {
+                    printf( "%6d L syncpoint %u\n", num_frames, payload[0] );
+                }
+                break;
+
+            case RSPQ_CAPTURE_REC_FRAME:
+                if( flag_list )
+                {
+                    printf( "%6d - end of frame\n", num_frames );
+                }
+                add_frame( payload[0] );
+                break;
+
+            default:
+                fprintf( stderr, "warning: unknown record type %d at word %d\n", type, i - 1 - len );
+                break;
+        }
+    }
+
+    free( block_words );
+}
+
+static void report( uint32_t flags )
+{
+    char buf[32];
+
+    printf( "Commands:\n" );
+    printf( "  cmd  name                         count  in blocks    written   executed  redundant\n" );
+    for( int i = 0; i < 256; i++ )
+    {
+        cmd_stats_t *st = &cmds[i];
+        if( !st->count ) { continue; }
+        printf( "  %02x   %-24s %10u %10u %10llu %10llu %10u\n", i, cmd_name( i, buf ),
+            st->count, st->in_blocks, (unsigned long long)st->written,
+            (unsigned long long)st->executed, st->redundant );
+    }
+    printf( "\n" );
+
+    printf( "Blocks: %d created, %llu bytes\n", num_blocks, (unsigned long long)block_bytes );
+    if( missing_blocks )
+    {
+        printf( "  %d calls to blocks created before the capture\n", missing_blocks );
+    }
+    if( invalid_words )
+    {
+        printf( "Warning: %d words could not be decoded\n", invalid_words );
+    }
+    printf( "\n" );
+
+    if( !num_frames )
+    {
+        printf( "No frames marked (see rspq_capture_frame)\n" );
+        return;
+    }
+
+    /* The first frame is incomplete if the oldest records were dropped */
+    int first = (flags & RSPQ_CAPTURE_FLAG_DROPPED) ? 1 : 0;
+    uint64_t wmin = UINT64_MAX, wmax = 0, wsum = 0, emin = UINT64_MAX, emax = 0, esum = 0, rsum = 0;
+    for( int i = first; i < num_frames; i++ )
+    {
+        frame_stats_t *fr = &frames[i];
+        wmin = MIN( wmin, fr->written ); wmax = MAX( wmax, fr->written ); wsum += fr->written;
+        emin = MIN( emin, fr->executed ); emax = MAX( emax, fr->executed ); esum += fr->executed;
+        rsum += fr->redundant;
+    }
+    int n = num_frames - first;
+    if( n > 0 )
+    {
+        printf( "Frames: %d\n", n );
+        printf( "  written bytes/frame:   min %llu, avg %llu, max %llu\n",
+            (unsigned long long)wmin, (unsigned long long)(wsum / n), (unsigned long long)wmax );
+        printf( "  executed bytes/frame:  min %llu, avg %llu, max %llu\n",
+            (unsigned long long)emin, (unsigned long long)(esum / n), (unsigned long long)emax );
+        printf( "  redundant bytes/frame: avg %llu (%.1f%% of executed)\n",
+            (unsigned long long)(rsum / n), esum ? rsum * 100.0 / esum : 0.0 );
+    }
+
+    if( flag_verbose )
+    {
+        printf( "\n  frame    written   executed   commands  redundant     ms\n" );
+        for( int i = 0; i < num_frames; i++ )
+        {
+            frame_stats_t *fr = &frames[i];
+            printf( "  %5d %10llu %10llu %10u %10u", i, (unsigned long long)fr->written,
+                (unsigned long long)fr->executed, fr->commands, fr->redundant );
+            if( i > 0 )
+            {
+                printf( " %6.2f", (uint32_t)(fr->ticks - frames[i-1].ticks) * 1000.0 / TICKS_PER_SECOND );
+            }
+            printf( "\n" );
+        }
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    const char *fn = NULL;
+    for( int i = 1; i < argc; i++ )
+    {
+        if( !strcmp( argv[i], "-l" ) ) { flag_list = true; }
+        else if( !strcmp( argv[i], "-v" ) ) { flag_verbose = true; }
+        else if( !strcmp( argv[i], "-h" ) ) { usage(); return 0; }
+        else if( argv[i][0] == '-' || fn ) { usage(); return 1; }
+        else { fn = argv[i]; }
+    }
+    if( !fn )
+    {
+        usage();
+        return 1;
+    }
+
+    FILE *fp = fopen( fn, "rb" );
+    if( !fp )
+    {
+        fprintf( stderr, "cannot open %s\n", fn );
+        return 1;
+    }
+    fseek( fp, 0, SEEK_END );
+    long size = ftell( fp );
+    fseek( fp, 0, SEEK_SET );
+    uint8_t *img = malloc( size );
+    if( size < RSPQ_CAPTURE_HEADER_SIZE || fread( img, 1, size, fp ) != size ||
+        memcmp( img, RSPQ_CAPTURE_MAGIC, 8 ) )
+    {
+        fprintf( stderr, "%s: not a rspq capture file\n", fn );
+        return 1;
+    }
+    fclose( fp );
+
+    uint32_t *hdr = (uint32_t*)img;
+    uint32_t flags = SWAPLONG( hdr[2] );
+    uint32_t nwords = SWAPLONG( hdr[3] );
+    if( RSPQ_CAPTURE_HEADER_SIZE + nwords * 4 > size )
+    {
+        fprintf( stderr, "%s: truncated capture file\n", fn );
+        return 1;
+    }
+    memcpy( cmd_sizes, img + 16, 256 );
+    memcpy( ovl_bases, img + 16 + 256, sizeof(ovl_bases) );
+    memcpy( ovl_names, img + 16 + 256 + sizeof(ovl_bases), sizeof(ovl_names) );
+    for( int i = 0; i < RSPQ_OVERLAY_ID_COUNT; i++ ) { ovl_names[i][15] = 0; }
+
+    uint32_t *words = (uint32_t*)(img + RSPQ_CAPTURE_HEADER_SIZE);
+    for( int i = 0; i < nwords; i++ ) { words[i] = SWAPLONG( words[i] ); }
+
+    printf( "Capture: %u words%s\n\n", nwords,
+        (flags & RSPQ_CAPTURE_FLAG_DROPPED) ? " (ring buffer overflowed, oldest records dropped)" : "" );
+
+    decode( words, nwords );
+    if( flag_list ) { printf( "\n" ); }
+    report( flags );
+
+    free( img );
+    return 0;
+}